@@ -0,0 +1,288 @@
+#!/usr/bin/python3
+"""
+Converts devregs .dat files into C++ tables that are linked into devregs
+(configure --with-builtin-db, or DEVREGS_BUILTIN_DB for Android).
+
+The tables have the layout of struct regdb_t in src/devregs.h, and the
+name hash and the address and name indexes are built here, so a built-in
+database is used without any file I/O or parsing. This follows the
+parser in src/devregs.cpp and the index builders in src/regdb.cpp and
+has to be kept in step with them.
+"""
+import sys
+if sys.version_info < (3, 5):
+    sys.exit("local python is too old\n")
+import argparse
+import os
+import re
+
+argp = argparse.ArgumentParser()
+argp.add_argument('dat', nargs='+', help="devregs_*.dat files to compile in")
+argp.add_argument('-o', '--output', required=True, help="C++ file to write")
+
+r_regname = re.compile(r'[A-Za-z_][A-Za-z0-9_]*')
+r_name = re.compile(r'[A-Za-z0-9_]*')
+
+# <ctype.h> classes in the C locale
+SPACE = ' \t\n\v\f\r'
+CNTRL = ''.join(chr(c) for c in range(32)) + '\x7f'
+ALNUM = '0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ'
+
+
+def warn(path, lineno, msg):
+    sys.stderr.write("%s:%u: %s\n" % (path, lineno, msg))
+
+
+def strip_line(line):
+    """comments, leading spaces and unprintables, trailing spaces"""
+    for sep in ('#', '//'):
+        pos = line.find(sep)
+        if pos >= 0:
+            line = line[:pos]
+    start = 0
+    while start < len(line) and not ('!' <= line[start] <= '~'):
+        start += 1
+    return line[start:].rstrip(SPACE + CNTRL)
+
+
+def parse_number(text, base):
+    """strtoul(): returns (value, # of characters used)"""
+    pos = 0
+    if base in (0, 16) and len(text) > 2 and text[0] == '0' \
+            and text[1] in 'xX' and text[2] in '0123456789abcdefABCDEF':
+        base = 16
+        pos = 2
+    elif base == 0:
+        base = 8 if text.startswith('0') else 10
+    value = 0
+    while pos < len(text) and text[pos] in ALNUM:
+        digit = int(text[pos], 36)
+        if digit >= base:
+            break
+        value = value * base + digit
+        pos += 1
+    return value, pos
+
+
+def parse_bits(spec):
+    """start[-end], returns (startbit, bitcount) or None"""
+    startbit, used = parse_number(spec, 0)
+    rest = spec[used:]
+    if startbit > 31 or (rest and rest[0] != '-'):
+        return None
+    endbit = startbit
+    if rest:
+        endbit, used = parse_number(rest[1:], 0)
+        if used != len(rest) - 1:
+            return None
+    startbit, endbit = min(startbit, endbit), max(startbit, endbit)
+    bitcount = endbit - startbit + 1
+    if startbit > 31 or bitcount > 32 - startbit:
+        return None
+    return startbit, bitcount
+
+
+class Database:
+    """Register and field tables of one .dat file"""
+
+    def __init__(self, path):
+        self.path = path
+        self.regs = []          # [address, name, width, field_first, field_count]
+        self.fields = []        # (name, startbit, bitcount)
+        self.fieldsets = {}     # name -> [field_first, field_count]
+        self.open_fields = 0
+        with open(path, 'r', encoding='latin-1', newline='\n') as f:
+            self.parse(f.read().split('\n'))
+
+    def close_fields(self):
+        """fields are kept in the reverse of their order in the file"""
+        self.fields[self.open_fields:] = reversed(self.fields[self.open_fields:])
+        self.open_fields = len(self.fields)
+
+    def parse(self, lines):
+        state = None            # 'reg', 'set' or None
+        fieldset = None
+        for lineno, line in enumerate(lines, 1):
+            line = strip_line(line)
+            if not line:
+                continue
+            m = r_regname.match(line)
+            if m:
+                if self.parse_register(line, m.end(), lineno):
+                    state = 'reg'
+                continue
+            if line[0] == ':' and state:
+                state = self.parse_field(line, state, fieldset, lineno)
+            elif line[0] == '/':
+                name = r_name.match(line, 1).group()
+                rest = line[1 + len(name):]
+                if name and (not rest or rest[0] in SPACE):
+                    self.close_fields()
+                    fieldset = [len(self.fields), 0]
+                    self.fieldsets[name] = fieldset
+                    state = 'set'
+                else:
+                    warn(self.path, lineno, "invalid fieldset name %s" % line)
+            elif line[0] != ':':
+                warn(self.path, lineno, "unrecognized line <%s>" % line)
+        self.close_fields()
+
+    def parse_register(self, line, namelen, lineno):
+        rest = line[namelen:]
+        if not rest or rest[0] not in SPACE:
+            warn(self.path, lineno, "syntax error <%s>" % rest)
+            return False
+        rest = strip_line(rest)
+        if not rest or rest[0] not in '0123456789abcdefABCDEF':
+            warn(self.path, lineno, "expecting hex digit <%s>" % rest)
+            return False
+        address, used = parse_number(rest, 16)
+        rest = rest[used:]
+        width = 4
+        if rest.startswith('.'):
+            widths = {'w': 2, 'b': 1, 'l': 4}
+            if rest[1:2].lower() not in widths or rest[1:2] == '':
+                warn(self.path, lineno, "invalid width char %s" % rest[1:2])
+                return False
+            width = widths[rest[1:2].lower()]
+            rest = rest[2:]
+        if rest:
+            warn(self.path, lineno, "expecting end of addr, not %s" % rest[0])
+            return False
+        self.close_fields()
+        self.regs.append([address, line[:namelen], width, len(self.fields), 0])
+        return True
+
+    def parse_field(self, line, state, fieldset, lineno):
+        line = strip_line(line[1:])
+        name = line[:1] + r_name.match(line, 1).group() if line else ''
+        rest = line[len(name):]
+        if rest.startswith(':'):
+            spec = rest[1:]
+            bits = None
+            if spec[:1] in '0123456789' and spec:
+                bits = parse_bits(spec)
+            else:
+                for fname, startbit, bitcount in self.fields[self.open_fields:]:
+                    if fname.lower() == spec.lower():
+                        bits = (startbit, bitcount)
+                        break
+            if bits is None:
+                warn(self.path, lineno, "error parsing field")
+                return state
+            self.fields.append((name, bits[0], bits[1]))
+            if state == 'reg':
+                self.regs[-1][4] += 1
+            else:
+                fieldset[1] += 1
+        elif rest.startswith('/') and state == 'reg':
+            fs = self.fieldsets.get(name)
+            if fs is not None:
+                reg = self.regs[-1]
+                self.close_fields()
+                if reg[4] == 0:
+                    reg[3] = fs[0]
+                elif fs[0] != reg[3] + reg[4]:
+                    self.fields.extend(self.fields[fs[0]:fs[0] + fs[1]])
+                reg[4] += fs[1]
+                self.open_fields = len(self.fields)
+                return None
+        else:
+            warn(self.path, lineno, "missing field separator")
+        return state
+
+
+def name_hash(name):
+    """case-folded FNV-1a, as nameHash() in regdb.cpp"""
+    h = 0xcbf29ce484222325
+    for c in name.lower().encode():
+        h = ((h ^ c) * 0x100000001b3) & 0xffffffffffffffff
+    return (h ^ (h >> 32)) & 0xffffffff
+
+
+def build_name_hash(regs):
+    size = 64
+    while size < 2 * len(regs):
+        size *= 2
+    slots = [0] * size
+    for i, reg in enumerate(regs):
+        slot = name_hash(reg[1]) & (size - 1)
+        while slots[slot]:
+            slot = (slot + 1) & (size - 1)
+        slots[slot] = i + 1
+    return slots
+
+
+def c_ident(path):
+    base = os.path.basename(path)
+    return re.sub(r'[^A-Za-z0-9_]', '_', os.path.splitext(base)[0])
+
+
+def emit_array(out, ctype, name, items, per_line=8):
+    out.write("static constexpr %s %s[] = {\n" % (ctype, name))
+    for i in range(0, len(items), per_line):
+        out.write("\t" + " ".join(s + "," for s in items[i:i + per_line]) + "\n")
+    if not items:
+        out.write("\t{}\n" if ctype.startswith('struct') else "\t0\n")
+    out.write("};\n\n")
+
+
+def emit_database(out, db):
+    ident = c_ident(db.path)
+    strings = bytearray()
+    offsets = {}
+
+    def intern(name):
+        if name not in offsets:
+            offsets[name] = len(strings)
+            strings.extend(name.encode() + b'\0')
+        return offsets[name]
+
+    regs = ["{ 0x%x, %u, %u, %u, %u, %u }" % (r[0], intern(r[1]), len(r[1]), r[2], r[3], r[4])
+            for r in db.regs]
+    fields = ["{ %u, %u, %u, %u }" % (intern(f[0]), len(f[0]), f[1], f[2]) for f in db.fields]
+    order = range(len(db.regs))
+    addr_index = sorted(order, key=lambda i: (db.regs[i][0], i))
+    name_index = sorted(order, key=lambda i: (db.regs[i][1].lower(), i))
+    slots = build_name_hash(db.regs)
+
+    out.write("/* %s */\n" % os.path.basename(db.path))
+    emit_array(out, "struct regdb_reg_t", ident + "_regs", regs, 1)
+    emit_array(out, "struct regdb_field_t", ident + "_fields", fields, 2)
+    out.write("static constexpr char %s_strings[] =\n" % ident)
+    for chunk in bytes(strings).split(b'\0')[:-1] or [b'']:
+        out.write('\t"%s\\0"\n' % chunk.decode())
+    out.write("\t;\n\n")
+    emit_array(out, "uint32_t", ident + "_name_hash", [str(s) for s in slots], 16)
+    emit_array(out, "uint32_t", ident + "_addr_index", [str(i) for i in addr_index], 16)
+    emit_array(out, "uint32_t", ident + "_name_index", [str(i) for i in name_index], 16)
+    return ident, len(db.regs), len(db.fields), len(strings), len(slots)
+
+
+def main():
+    args = argp.parse_args()
+    dbs = [Database(path) for path in args.dat]
+    with open(args.output + '.tmp', 'w') as out:
+        out.write("/*\n * Generated by scripts/dat2cpp.py, do not edit. Databases:\n")
+        for path in args.dat:
+            out.write(" *\t%s\n" % os.path.basename(path))
+        out.write(" */\n\n")
+        out.write('#include "devregs.h"\n\n')
+        tables = [emit_database(out, db) for db in dbs]
+        out.write("struct regdb_builtin_t const regdb_builtin[] = {\n")
+        for db, (ident, nregs, nfields, nstrings, nslots) in zip(dbs, tables):
+            out.write('\t{ "%s", {\n' % os.path.basename(db.path))
+            out.write("\t\t%s_regs, %u,\n" % (ident, nregs))
+            out.write("\t\t%s_fields, %u,\n" % (ident, nfields))
+            out.write("\t\t%s_strings, %u,\n" % (ident, nstrings))
+            out.write("\t\t%s_name_hash, %u,\n" % (ident, nslots))
+            out.write("\t\t%s_addr_index,\n" % ident)
+            out.write("\t\t%s_name_index,\n" % ident)
+            out.write("\t\t0, 0 } },\n")
+        out.write("};\n\n")
+        out.write("unsigned const regdb_builtin_count = %u ;\n" % len(dbs))
+    os.replace(args.output + '.tmp', args.output)
+
+
+if __name__ == '__main__':
+    main()
@@ -2,11 +2,26 @@ LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE_TAGS := eng
-LOCAL_SRC_FILES:=devregs.cpp
+LOCAL_SRC_FILES:=devregs.cpp regdb.cpp arena.cpp physmem.cpp simbus.cpp snapshot.cpp sampler.cpp trace.cpp lineedit.cpp server.cpp
 LOCAL_MODULE:=devregs
 LOCAL_CPPFLAGS += -DANDROID
 LOCAL_SHARED_LIBRARIES:=libutils libc libstdc++
 LOCAL_C_INCLUDES += $(LOCAL_PATH)
+
+# e.g. DEVREGS_BUILTIN_DB := imx6q imx6dls links those databases into devregs
+ifneq ($(DEVREGS_BUILTIN_DB),)
+LOCAL_MODULE_CLASS := EXECUTABLES
+builtin_db_cpp := $(call local-generated-sources-dir)/builtin_db.cpp
+builtin_db_dat := $(foreach soc,$(DEVREGS_BUILTIN_DB),$(LOCAL_PATH)/../dat/devregs_$(soc).dat)
+$(builtin_db_cpp): PRIVATE_SCRIPT := $(LOCAL_PATH)/../scripts/dat2cpp.py
+$(builtin_db_cpp): PRIVATE_DAT := $(builtin_db_dat)
+$(builtin_db_cpp): PRIVATE_CUSTOM_TOOL = python3 $(PRIVATE_SCRIPT) -o $@ $(PRIVATE_DAT)
+$(builtin_db_cpp): $(LOCAL_PATH)/../scripts/dat2cpp.py $(builtin_db_dat)
+	$(transform-generated-source)
+LOCAL_GENERATED_SOURCES += $(builtin_db_cpp)
+LOCAL_CPPFLAGS += -DBUILTIN_DB
+endif
+
 include $(BUILD_EXECUTABLE)
 
 
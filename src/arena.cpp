@@ -0,0 +1,121 @@
+/*
+ * arena.cpp - bump allocator for the register database
+ *
+ * Everything devregs builds lives until the program exits, so memory
+ * is carved sequentially out of a few large blocks and never freed
+ * piecemeal. Callers that know how much they need up front (e.g. from
+ * the size of a .dat file) reserve it in one block. Only a loop that
+ * runs for as long as the user likes (the interactive mode) releases
+ * what each pass allocated, back to a mark taken before it.
+ *
+ * (c) Copyright 2010 by Boundary Devices under GPLv2
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "devregs.h"
+
+#define ARENA_ALIGN		8
+#define ARENA_BLOCKSIZE		65536
+
+struct arenaBlock_t {
+	struct arenaBlock_t	*prev ;
+	size_t			 size ;
+	size_t			 used ;
+};
+
+/* block header, rounded up so data is aligned */
+#define ARENA_HDR ((sizeof(struct arenaBlock_t)+ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1))
+
+static size_t alignUp(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN-1);
+}
+
+static char *blockData(struct arenaBlock_t *block)
+{
+	return (char *)block + ARENA_HDR ;
+}
+
+/*
+ * Make sure the current block has room for size more bytes
+ */
+void arenaReserve(struct arena_t &arena, size_t size)
+{
+	size = alignUp(size);
+	struct arenaBlock_t *block = arena.block ;
+	if (block && (block->size - block->used >= size))
+		return ;
+	if (size < ARENA_BLOCKSIZE)
+		size = ARENA_BLOCKSIZE ;
+	block = (struct arenaBlock_t *)malloc(ARENA_HDR+size);
+	if (0 == block) {
+		perror("arena");
+		exit(1);
+	}
+	block->prev = arena.block ;
+	block->size = size ;
+	block->used = 0 ;
+	arena.block = block ;
+}
+
+void *arenaAlloc(struct arena_t &arena, size_t size)
+{
+	size = alignUp(size);
+	arenaReserve(arena,size);
+	void *mem = blockData(arena.block) + arena.block->used ;
+	arena.block->used += size ;
+	return mem ;
+}
+
+/*
+ * Resize an allocation, in place if it is the most recent one and
+ * there is room, otherwise by copying it. The old space isn't reused.
+ */
+void *arenaGrow(struct arena_t &arena, void *mem, size_t oldsize, size_t newsize)
+{
+	struct arenaBlock_t *block = arena.block ;
+	oldsize = alignUp(oldsize);
+	newsize = alignUp(newsize);
+	if (mem && block
+	    && ((char *)mem + oldsize == blockData(block) + block->used)
+	    && (newsize - oldsize <= block->size - block->used)) {
+		block->used += newsize - oldsize ;
+		return mem ;
+	}
+	void *newmem = arenaAlloc(arena,newsize);
+	if (mem)
+		memcpy(newmem,mem,oldsize);
+	return newmem ;
+}
+
+void arenaFree(struct arena_t &arena)
+{
+	while (arena.block) {
+		struct arenaBlock_t *prev = arena.block->prev ;
+		free(arena.block);
+		arena.block = prev ;
+	}
+}
+
+void arenaMark(struct arena_t const &arena, struct arenaMark_t &mark)
+{
+	mark.block = arena.block ;
+	mark.used = arena.block ? arena.block->used : 0 ;
+}
+
+/*
+ * Free everything allocated since mark was taken
+ */
+void arenaRelease(struct arena_t &arena, struct arenaMark_t const &mark)
+{
+	while (arena.block != mark.block) {
+		struct arenaBlock_t *prev = arena.block->prev ;
+		free(arena.block);
+		arena.block = prev ;
+	}
+	if (arena.block)
+		arena.block->used = mark.used ;
+}
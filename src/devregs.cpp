@@ -7,10 +7,12 @@
  *		- display all registers
  *
  *	devregs register
- *		- display all registers matching register (strcasestr)
+ *		- display all registers matching register: the register of
+ *		  that name if there is one, else all registers starting
+ *		  with it, else all registers containing it (strcasestr)
  *
  *	devregs register.field
- *		- display all registers matching register (strcasestr)
+ *		- display the register of that name
  *		- also break out specified field
  *
  *	devregs register value
@@ -19,9 +21,70 @@
  *	devregs register.field value
  *		- set register field to specified value (read/modify/write)
  *
- * Registers may be specified by name or 0xADDRESS. If specified by name, all
- * registers containing the pattern are considered. If multiple registers 
- * match on a write request (2-parameter use cases), no write will be made.
+ *	devregs register field=value...
+ *		- set several fields of a register with a single
+ *		  read/modify/write
+ *
+ *	devregs 0xSTART-0xEND
+ *		- display all known registers within an address range
+ *
+ *	devregs --compile [in.dat out.db]
+ *		- write a compiled database, which is mapped and used in
+ *		  place of the .dat file for as long as it is up to date
+ *
+ *	devregs --backend file:regs.bin@0x02000000 ...
+ *		- use a file instead of /dev/mem, e.g. to run off-target
+ *
+ *	devregs --snapshot file [register]
+ *		- read all (or the matching) registers into a binary
+ *		  snapshot, decoded later with --show-snapshot file
+ *
+ *	devregs --diff file [other]
+ *		- display the registers and fields that differ between
+ *		  two snapshots, or between a snapshot and the registers
+ *		  as they are now
+ *
+ *	devregs --watch register[.field]...
+ *		- poll the registers until interrupted, displaying them
+ *		  (or the given fields) whenever they change
+ *
+ *	devregs --trigger register.field=value [--pre N] [--post N] [register...]
+ *		- sample the registers until the condition is met and
+ *		  display N samples before and after it
+ *
+ *	devregs --histogram register[.field] [--duration 5s]
+ *		- sample a field and display how often each value was seen
+ *
+ *	devregs --trace file register[.field]... [--duration 1h]
+ *		- record every change of the registers (or fields) to a
+ *		  binary trace, displayed later with --show-trace file
+ *
+ *	devregs --period 100us --rt-priority 80 --affinity 1 --trace ...
+ *		- sample every 100us rather than flat out, SCHED_FIFO on
+ *		  CPU 1, and report the intervals achieved
+ *
+ *	devregs -s script
+ *		- run the reads, writes, delays and polls in script (or
+ *		  stdin, for -s -) with the database parsed once
+ *
+ *	devregs -i
+ *		- interactive mode, taking script lines with history and
+ *		  tab completion of register and field names
+ *
+ *	devregs --serve socket
+ *	devregs --connect socket register[.field][=value]...
+ *		- serve register accesses to local clients from a daemon
+ *		  that parses the database and maps the registers once
+ *
+ *	devregs --trace file --group 'period=1ms cpu=1 register...' ...
+ *		- sample groups of registers each in a thread of its own,
+ *		  at a rate of its own, into a single trace
+ *
+ * Registers may be specified by name or 0xADDRESS. An address inside a
+ * known register refers to that register. If specified by name, all
+ * registers matching the pattern are considered. A write request
+ * (2-parameter use cases) needs the exact name of a single register,
+ * otherwise no write will be made.
  *
  * fields may be specified by name or bit numbers of the form "start[-end]"
  *
@@ -38,85 +101,194 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <ctype.h>
-
-typedef off_t phys_addr_t;
+#include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include "devregs.h"
 
 static bool word_access = false ;
 static int unsigned cpu_in_params = 0;
 static bool fancy_color_mode = false;
 static bool stdout_tty = isatty(STDOUT_FILENO);
+static bool compile_mode = false ;
+static bool stats_mode = false ;
+static char const *backend_spec = 0 ;
+static char const *snapshot_path = 0 ;
+static char const *show_snapshot_path = 0 ;
+static char const *diff_path = 0 ;
+static bool watch_mode = false ;
+static char const *trigger_spec = 0 ;
+static unsigned trigger_pre = 100 ;
+static unsigned trigger_post = 100 ;
+static char const *histogram_spec = 0 ;
+static uint64_t duration_ns = 0 ;	// 0 to sample until interrupted
+static char const *trace_path = 0 ;
+static char const *show_trace_path = 0 ;
+static uint64_t period_ns = 0 ;		// 0 to sample flat out
+static int rt_priority = 0 ;		// SCHED_FIFO priority, 0 for none
+static int affinity = -1 ;		// CPU to sample on, -1 for any
+static char const **group_specs = 0 ;	// --group, for --trace
+static unsigned group_count = 0 ;
+static struct samplePace_t pacing ;
+static char const *script_path = 0 ;
+static bool interactive_mode = false ;
+static char const *serve_path = 0 ;
+static char const *connect_path = 0 ;
+static bool dry_run = false ;
+
+/* holds the database and everything built from it */
+static struct arena_t arena ;
 
 struct fieldDescription_t {
 	char const 		   *name ;
+	unsigned		   namelen ;
 	unsigned    		   startbit ;
 	unsigned    		   bitcount ;
 	struct fieldDescription_t *next ;
 };
 
-struct registerDescription_t {
-	char const 		*name ;
-	fieldDescription_t 	*fields ;
-};
-
 struct reglist_t {
 	phys_addr_t 			address ;
 	unsigned		 	 width ; // # bytes in register
-	struct registerDescription_t	*reg ;
+	char const			*name ; // 0 if not in database
+	unsigned			 namelen ;
+	int				 index ; // in the database, -1 if not in it
 	struct fieldDescription_t	*fields ;
 	struct reglist_t		*next ;
 };
 
+/*
+ * fieldset fields are kept in the field table and shared by each
+ * register that references the set
+ */
 struct	fieldSet_t {
-	char const 			*name ;
-	struct fieldDescription_t	*fields ;
+	uint32_t			 name ; // offset into string pool
+	unsigned			 namelen ;
+	unsigned			 field_first ;
+	unsigned			 field_count ;
+	struct fieldLines_t		*lines ; // until loaded lazily
         struct	fieldSet_t 		*next ;
 };
 
-static struct fieldSet_t *fieldsets = 0 ;
+/*
+ * Where the field lines of a register or fieldset start in the .dat
+ * file, for loading them lazily
+ */
+struct fieldLines_t {
+	long				 offset ;
+	int				 lineNum ;
+};
+
+/* field_first of a register whose fields haven't been loaded yet */
+#define FIELDS_UNLOADED	0xffffffff
+
+/*
+ * The .dat file is parsed in place from a read-only mapping, so lines
+ * and names are (start,end) pointers into it rather than C strings.
+ */
 
 /* 
- * strips comments as well as skipping leading spaces
+ * skips leading spaces and unprintables
  */
-char *skipSpaces(char *buf){
-	char *comment = strchr(buf,'#');
-	if (comment)
-		*comment = '\0' ;
-	comment = strstr(buf,"//");
-	if (comment)
-		*comment = 0 ;
-	while( *buf ){
-		if( isprint(*buf) && (' ' != *buf) )
+static char const *skipSpaces(char const *next, char const *end){
+	while( next < end ){
+		if( isprint(*next) && (' ' != *next) )
 			break;
-		buf++ ;
+		next++ ;
 	}
-	return buf ;
+	return next ;
 }
 
-static void trimCtrl(char *buf){
-	char *tail = buf+strlen(buf);
-	// trim trailing <CR> if needed
-	while( tail > buf ){
-		--tail ;
-		if( iscntrl(*tail) ){
-			*tail = '\0' ;
-		} else
+/*
+ * Returns the next line of [pos,end) in line/lineEnd with comments,
+ * leading spaces and trailing spaces or <CR> stripped, and advances
+ * pos past it. Returns false at the end of the file.
+ */
+static bool nextLine(char const *&pos, char const *end, char const *&line, char const *&lineEnd){
+	if (pos >= end)
+		return false ;
+	char const *eol = (char const *)memchr(pos,'\n',end-pos);
+	if (0 == eol)
+		eol = end ;
+	line = pos ;
+	lineEnd = eol ;
+	pos = (eol < end) ? eol+1 : end ;
+	for (char const *p = line ; p < lineEnd ; p++) {
+		if (('#' == *p) || (('/' == *p) && (p+1 < lineEnd) && ('/' == p[1]))) {
+			lineEnd = p ;
 			break;
+		}
 	}
+	line = skipSpaces(line,lineEnd);
+	while( (lineEnd > line) && (isspace(lineEnd[-1]) || iscntrl(lineEnd[-1])) )
+		lineEnd-- ;
+	return true ;
 }
 
-static bool parseBits(char const *bitspec, unsigned &start, unsigned &count)
+/*
+ * Next whitespace-separated word of a NUL-terminated line, 0 at the
+ * end. Splits script lines, --group settings and simulator models.
+ */
+char *nextWord(char *&next)
 {
-	char *end ;
-	unsigned startbit = strtoul(bitspec,&end,0);
+	while (isspace(*next))
+		next++ ;
+	if ('\0' == *next)
+		return 0 ;
+	char *word = next ;
+	while (*next && !isspace(*next))
+		next++ ;
+	if (*next)
+		*next++ = '\0' ;
+	return word ;
+}
+
+/*
+ * strtoul() for text that isn't NUL-terminated
+ */
+static unsigned long parseNumber(char const *&next, char const *end, int base){
+	bool const hexPrefix = (next+2 < end) && ('0' == next[0])
+			       && ('x' == tolower(next[1])) && isxdigit(next[2]);
+	if ((0 == base) || (16 == base)) {
+		if (hexPrefix) {
+			base = 16 ;
+			next += 2 ;
+		} else if (0 == base) {
+			base = ((next < end) && ('0' == *next)) ? 8 : 10 ;
+		}
+	}
+	unsigned long value = 0 ;
+	while (next < end) {
+		int digit ;
+		if (isdigit(*next))
+			digit = *next - '0' ;
+		else if (isalpha(*next))
+			digit = tolower(*next) - 'a' + 10 ;
+		else
+			break;
+		if (digit >= base)
+			break;
+		value = value*base + digit ;
+		next++ ;
+	}
+	return value ;
+}
+
+static bool parseBits(char const *bitspec, char const *specEnd, unsigned &start, unsigned &count)
+{
+	char const *end = bitspec ;
+	unsigned startbit = parseNumber(end,specEnd,0);
+	int const speclen = specEnd-bitspec ;
 	if( (31 >= startbit)
 	    &&
-	    ( ('\0' == *end)
+	    ( (specEnd == end)
 	      ||
 	      ('-' == *end) ) ){
 		unsigned endbit ;
-		if( '-' == *end ){
-			endbit = strtoul(end+1,&end,0);
-			if('\0' != *end){
+		if( end < specEnd ){
+			end++ ;
+			endbit = parseNumber(end,specEnd,0);
+			if(specEnd != end){
 				endbit = ~startbit ;
 			}
 		} else {
@@ -133,499 +305,2419 @@ static bool parseBits(char const *bitspec, unsigned &start, unsigned &count)
 			count = bitcount ;
 			return true ;
 		} else
-			fprintf(stderr, "Invalid bitspec '%s'. Use form 'start-end' in decimal (%u,%u,%u)\n", bitspec,startbit,endbit,bitcount );
+			fprintf(stderr, "Invalid bitspec '%.*s'. Use form 'start-end' in decimal (%u,%u,%u)\n", speclen,bitspec,startbit,endbit,bitcount );
 	} else
-		fprintf(stderr, "Invalid field '%s'. Use form 'start-end' in decimal (%u,%x)\n", bitspec,startbit,*end );
+		fprintf(stderr, "Invalid field '%.*s'. Use form 'start-end' in decimal (%u,%x)\n", speclen,bitspec,startbit,(end < specEnd) ? *end : 0 );
+
+	return false ;
+}
+
+static bool parseBits(char const *bitspec, unsigned &start, unsigned &count)
+{
+	return parseBits(bitspec,bitspec+strlen(bitspec),start,count);
+}
+
+/*
+ * Tables under construction while parsing a .dat file. The mapped file
+ * itself is the string pool. When loading lazily, only the register
+ * lines are parsed up front and fields are read from the mapping when
+ * a register is selected.
+ */
+struct textdb_t {
+	char const		*filename ;
+	struct fieldLines_t	*lines ; // per register, when lazy
+	struct fieldSet_t	*fieldsets ;
+	struct arena_t		*arena ;
+	struct regdb_reg_t	*regs ;
+	unsigned		 reg_count ;
+	unsigned		 reg_alloc ;
+	struct regdb_field_t	*fields ;
+	unsigned		 field_count ;
+	unsigned		 field_alloc ;
+	char const		*strings ; // mapped .dat file
+	unsigned		 string_size ;
+	unsigned		 open_fields ; // first field of current register or fieldset
+};
+
+/*
+ * Tables are reserved at their largest possible size up front, so
+ * this only copies when fields are duplicated for a register that has
+ * both fields of its own and a fieldset.
+ */
+static void *growTable(struct textdb_t &t, void *table, unsigned &alloc, unsigned needed, size_t elsize)
+{
+	if (needed > alloc) {
+		unsigned newalloc = alloc ? alloc : 64 ;
+		while (needed > newalloc)
+			newalloc *= 2 ;
+		table = arenaGrow(*t.arena,table,alloc*elsize,newalloc*elsize);
+		alloc = newalloc ;
+	}
+	return table ;
+}
+
+static struct regdb_field_t *addField(struct textdb_t &t)
+{
+	t.fields = (struct regdb_field_t *)growTable(t,t.fields,t.field_alloc,t.field_count+1,sizeof(t.fields[0]));
+	return t.fields + t.field_count++ ;
+}
+
+/*
+ * Fields are displayed in the reverse of their order in the .dat file,
+ * so the fields of a register or fieldset are flipped once the last
+ * one has been read.
+ */
+static void closeFields(struct textdb_t &t)
+{
+	unsigned lo = t.open_fields ;
+	unsigned hi = t.field_count ;
+	while (lo+1 < hi) {
+		struct regdb_field_t const tmp = t.fields[lo];
+		t.fields[lo++] = t.fields[--hi];
+		t.fields[hi] = tmp ;
+	}
+	t.open_fields = t.field_count ;
+}
+
+/*
+ * A field's bits are given either as "start[-end]" or as the name of
+ * a field defined earlier in the same register or fieldset.
+ */
+static bool parseFieldBits
+	( struct textdb_t const &t,
+	  char const *fieldspec,
+	  char const *specEnd,
+	  unsigned &start,
+	  unsigned &count )
+{
+	if((fieldspec < specEnd) && isdigit(*fieldspec))
+		return parseBits(fieldspec,specEnd,start,count);
+
+	unsigned const speclen = specEnd-fieldspec ;
+	for (unsigned i = t.open_fields ; i < t.field_count ; i++) {
+		struct regdb_field_t const &f = t.fields[i];
+		if( (speclen == f.namelen)
+		    && (0 == strncasecmp(t.strings+f.name,fieldspec,speclen)) ){
+			start = f.startbit ;
+			count = f.bitcount ;
+			return true ;
+		}
+	}
+	return false ;
+}
+
+/*
+ *	- Outer loop determines which type of line we're dealing with
+ *	based on the first character:
+ *		A-Za-z_		- Register:	Name	0xADDRESS[.w|.l|.b]
+ *		:		- Field		:fieldname:startbit[-stopbit]
+ *		/		- Field set	/Fieldsetname
+ *
+ *	state field is used to determine whether a field will be added to the
+ *	most recent register or fieldset.
+ */
+enum ftState {
+	FT_UNKNOWN	= -1,
+	FT_REGISTER	= 0,
+	FT_FIELDSET	= 1
+};
+
+static void loadFieldset(struct textdb_t &t, struct fieldSet_t *fs);
+
+/*
+ * Parses a field line (:name:bits or :fieldset/) of the register or
+ * fieldset being read, returns the new state
+ */
+static enum ftState parseFieldLine
+	( struct textdb_t &t,
+	  char const *next,
+	  char const *lineEnd,
+	  enum ftState state,
+	  struct regdb_reg_t *reg,
+	  struct fieldSet_t *set,
+	  int lineNum )
+{
+	next=skipSpaces(next+1,lineEnd);
+	char const *start = next ;
+	if( next < lineEnd )
+		next++ ;
+	while((next < lineEnd) && (isalnum(*next) || ('_' == *next))){
+		next++ ;
+	}
+	unsigned nameLen = next-start ;
+	if( (next < lineEnd) && (':' == *next) ){
+		unsigned startbit, bitcount ;
+		if (parseFieldBits(t,next+1,lineEnd,startbit,bitcount)){
+			struct regdb_field_t *field = addField(t);
+			field->name = start-t.strings ;
+			field->namelen = nameLen ;
+			field->startbit = startbit ;
+			field->bitcount = bitcount ;
+			if (FT_REGISTER == state) {
+				reg->field_count++ ;
+			} else {
+				set->field_count++ ;
+			}
+		} else
+			fprintf( stderr, "error parsing field at line %u\n", lineNum );
+	} else if ((next < lineEnd) && ('/' == *next) && (FT_REGISTER == state)) {
+		struct fieldSet_t *fs = t.fieldsets ;
+		while (fs) {
+			if ((nameLen == fs->namelen)
+			    && (0 == strncmp(t.strings+fs->name,start,nameLen)))
+				break;
+			fs = fs->next ;
+		}
+		if (fs) {
+			closeFields(t);
+			loadFieldset(t,fs);
+			if (0 == reg->field_count) {
+				reg->field_first = fs->field_first ;
+			} else if (fs->field_first != reg->field_first+reg->field_count) {
+				for (unsigned i = 0 ; i < fs->field_count ; i++) {
+					struct regdb_field_t *field = addField(t);
+					*field = t.fields[fs->field_first+i];
+				}
+			}
+			reg->field_count += fs->field_count ;
+			t.open_fields = t.field_count ;
+			state = FT_UNKNOWN ; /* don't allow fields to be added */
+		}
+	} else {
+		fprintf( stderr, "missing field separator at line %u\n", lineNum );
+	}
+	return state ;
+}
+
+/*
+ * Lazily read the field lines of a register or fieldset, up to the
+ * next line that isn't a field
+ */
+static void readFields
+	( struct textdb_t &t,
+	  struct fieldLines_t const &lines,
+	  enum ftState state,
+	  struct regdb_reg_t *reg,
+	  struct fieldSet_t *set )
+{
+	char const *pos = t.strings+lines.offset ;
+	char const *end = t.strings+t.string_size ;
+	char const *next, *lineEnd ;
+	int lineNum = lines.lineNum ;
+	t.open_fields = t.field_count ;
+	while( (FT_UNKNOWN != state) && nextLine(pos,end,next,lineEnd) ){
+		lineNum++ ;
+		if( next == lineEnd )
+			continue;
+		if (':' != *next)
+			break;
+		state = parseFieldLine(t,next,lineEnd,state,reg,set,lineNum);
+	}
+	closeFields(t);
+}
+
+static void loadFieldset(struct textdb_t &t, struct fieldSet_t *fs)
+{
+	if (fs->lines) {
+		struct fieldLines_t const lines = *fs->lines ;
+		fs->lines = 0 ;
+		fs->field_first = t.field_count ;
+		readFields(t,lines,FT_FIELDSET,0,fs);
+	}
+}
+
+static char const *getDataPath(unsigned cpu) {
+	switch (cpu & 0xff000) {
+		case 0x63000:
+			return "/etc/devregs_imx6q.dat" ;
+		case 0x61000:
+			return "/etc/devregs_imx6dls.dat" ;
+		case 0x53000:
+			return "/etc/devregs_imx53.dat" ;
+	}
+	switch (cpu) {
+	case 0x10:
+		return "/etc/devregs_imx6q.dat";
+	case 0x51:
+	case 0x5:
+		return "/etc/devregs_imx51.dat";
+	case 0x7:
+		return "/etc/devregs_imx7d.dat";
+	case 0x81:
+		return "/etc/devregs_imx8mq.dat";
+	case 0x82:
+		return "/etc/devregs_imx8mm.dat";
+	default:
+		printf("unsupported CPU type: %x\n", cpu);
+	}
+	return "/etc/devregs.dat" ;
+}
+
+
+/*
+ * The compiled database lives next to the .dat file with a .db suffix
+ */
+static char *getDbPath(char const *datpath) {
+	unsigned len = strlen(datpath);
+	if ((4 < len) && (0 == strcmp(datpath+len-4,".dat")))
+		len -= 4 ;
+	char *dbpath = (char *)malloc(len+4);
+	memcpy(dbpath,datpath,len);
+	strcpy(dbpath+len,".db");
+	return dbpath ;
+}
+
+static void textdbView(struct textdb_t const &t, struct regdb_t &db)
+{
+	db.regs = t.regs ;
+	db.reg_count = t.reg_count ;
+	db.fields = t.fields ;
+	db.field_count = t.field_count ;
+	db.strings = t.strings ;
+	db.string_size = t.string_size ;
+}
+
+/*
+ * Parse a .dat file. If lazy, field lines are skipped and only read
+ * by loadFields() for registers that are actually used.
+ */
+static bool parseDatabase(char const *filename, struct textdb_t &t, bool lazy){
+	int fd = open(filename, O_RDONLY);
+	struct stat st ;
+	if( (0 > fd) || (0 != fstat(fd,&st)) ){
+		perror(filename);
+		if( 0 <= fd )
+			close(fd);
+		return false ;
+	}
+
+	/*
+	 * Names stay in the file, so the mapping is kept for as long as
+	 * the database is used.
+	 */
+	unsigned const fileSize = st.st_size ;
+	char const *map = "" ;
+	if (0 < fileSize) {
+		void *mem = mmap(0,fileSize,PROT_READ,MAP_PRIVATE,fd,0);
+		if (MAP_FAILED == mem) {
+			perror(filename);
+			close(fd);
+			return false ;
+		}
+		map = (char const *)mem ;
+	}
+	close(fd);
+
+	/*
+	 * Size the tables from the file length: a register line is at
+	 * least 4 bytes ("A 0\n") and a field line at least 5 (":A:0\n").
+	 */
+	memset(&t,0,sizeof(t));
+	t.filename = filename ;
+	t.arena = &arena ;
+	t.strings = map ;
+	t.string_size = fileSize ;
+	t.reg_alloc = fileSize/4 + 1 ;
+	t.field_alloc = fileSize/5 + 1 ;
+	arenaReserve(arena,
+		     t.reg_alloc*sizeof(t.regs[0])
+		     + t.field_alloc*sizeof(t.fields[0])
+		     + (lazy ? t.reg_alloc*sizeof(t.lines[0]) : 0) + 16);
+	t.regs = (struct regdb_reg_t *)arenaAlloc(arena,t.reg_alloc*sizeof(t.regs[0]));
+	t.fields = (struct regdb_field_t *)arenaAlloc(arena,t.field_alloc*sizeof(t.fields[0]));
+	if (lazy)
+		t.lines = (struct fieldLines_t *)arenaAlloc(arena,t.reg_alloc*sizeof(t.lines[0]));
+	enum ftState state = FT_UNKNOWN ;
+	char const *pos = map ;
+	char const *const mapEnd = map+fileSize ;
+	char const *next, *lineEnd ;
+	int lineNum = 0 ;
+
+//	printf("Using %s\n", filename);
+	while( nextLine(pos,mapEnd,next,lineEnd) ){
+		lineNum++ ;
+		if( next == lineEnd )
+			continue; // blank or comment
+		if(isalpha(*next) || ('_' == *next)){
+			char const *start = next++ ;
+			while((next < lineEnd) && (isalnum(*next) || ('_' == *next))){
+				next++ ;
+			}
+			if((next < lineEnd) && isspace(*next)){
+				unsigned namelen = next-start ;
+				next=skipSpaces(next,lineEnd);
+				if((next < lineEnd) && isxdigit(*next)){
+					char const *addrEnd = next ;
+					phys_addr_t addr = (phys_addr_t )parseNumber(addrEnd,lineEnd,16);
+					unsigned width = 4 ;
+					if( (addrEnd < lineEnd) && ('.' == *addrEnd) ){
+						char widthchar = (addrEnd+1 < lineEnd) ? tolower(addrEnd[1]) : '\0' ;
+						if('w' == widthchar) {
+							width = 2 ;
+						} else if( 'b' == widthchar) {
+							width = 1 ;
+						} else if( 'l' == widthchar) {
+							width = 4 ;
+						}
+						else {
+							fprintf(stderr, "Invalid width char %c on line number %u\n", widthchar, lineNum);
+							continue;
+						}
+						addrEnd = addrEnd+2 ;
+					}
+					if( lineEnd == addrEnd ){
+						closeFields(t);
+						t.regs = (struct regdb_reg_t *)growTable(t,t.regs,t.reg_alloc,t.reg_count+1,sizeof(t.regs[0]));
+						struct regdb_reg_t &newone = t.regs[t.reg_count++];
+						newone.address = addr ;
+						newone.width = width ;
+						newone.name = start-map ;
+						newone.namelen = namelen ;
+						newone.field_first = t.field_count ;
+						newone.field_count = 0 ;
+						state = FT_REGISTER ;
+						if (lazy) {
+							newone.field_first = FIELDS_UNLOADED ;
+							t.lines[t.reg_count-1].offset = pos-map ;
+							t.lines[t.reg_count-1].lineNum = lineNum ;
+						}
+//						printf( "%.*s: 0x%08lx, width %u\n", namelen, start, addr, width);
+						continue;
+					}
+					else
+						fprintf(stderr, "expecting end of addr, not %c\n", *addrEnd );
+				}
+				else
+					fprintf(stderr, "expecting hex digit, not %02x\n", (next < lineEnd) ? (unsigned char)*next : 0 );
+			}
+			fprintf(stderr, "%s: syntax error on line %u <%.*s>\n", filename, lineNum, (int)(lineEnd-next), next );
+		} else if((':' == *next) && (FT_UNKNOWN != state)) {
+			if (!lazy)
+				state = parseFieldLine(t,next,lineEnd,state,t.reg_count ? &t.regs[t.reg_count-1] : 0,t.fieldsets,lineNum);
+		} else if ('/' == *next) {
+			char const *start = ++next ;
+			while((next < lineEnd) && (isalnum(*next) || ('_' == *next))){
+				next++ ;
+			}
+			if ((start < next) && ((lineEnd == next) || isspace(*next))) {
+				closeFields(t);
+				struct	fieldSet_t  *fs = (struct fieldSet_t *)arenaAlloc(arena,sizeof(struct fieldSet_t ));
+				fs->namelen = next-start ;
+				fs->name = start-map ;
+				fs->field_first = t.field_count ;
+				fs->field_count = 0 ;
+				fs->lines = 0 ;
+				if (lazy) {
+					fs->lines = (struct fieldLines_t *)arenaAlloc(arena,sizeof(*fs->lines));
+					fs->lines->offset = pos-map ;
+					fs->lines->lineNum = lineNum ;
+				}
+				fs->next = t.fieldsets ;
+				t.fieldsets = fs ;
+				state = FT_FIELDSET ;
+			} else
+				fprintf(stderr,"Invalid fieldset name %.*s\n",(int)(lineEnd-start+1),start-1);
+		} else {
+			fprintf(stderr, "Unrecognized line <%.*s> at %u\n", (int)(lineEnd-next), next, lineNum );
+		}
+	}
+	closeFields(t);
+	return true ;
+}
+
+static struct regdb_t regdb ;
+static struct textdb_t textdb ;
+
+/*
+ * Make sure the fields of a register parsed lazily are loaded
+ */
+static void loadFields(struct regdb_t const *defs, unsigned idx)
+{
+	if( (defs != &regdb) || (defs->regs != textdb.regs) || (0 == textdb.lines) )
+		return ;
+	struct regdb_reg_t &reg = textdb.regs[idx];
+	if( FIELDS_UNLOADED == reg.field_first ){
+		reg.field_first = textdb.field_count ;
+		readFields(textdb,textdb.lines[idx],FT_REGISTER,&reg,0);
+		textdbView(textdb,regdb);
+	}
+}
+
+/*
+ * Use the database built into the program for filename, if any
+ */
+static bool builtinDatabase(char const *filename, struct regdb_t &db)
+{
+#ifdef BUILTIN_DB
+	char const *base = strrchr(filename,'/');
+	base = base ? base+1 : filename ;
+	for (unsigned i = 0 ; i < regdb_builtin_count ; i++) {
+		if (0 == strcmp(regdb_builtin[i].datfile,base)) {
+			db = regdb_builtin[i].db ;
+			return true ;
+		}
+	}
+#else
+	(void)filename ;
+	(void)db ;
+#endif
+	return false ;
+}
+
+/*
+ * Use a built-in database or the compiled database if there is an
+ * up-to-date one, otherwise parse the text. Only fields of registers
+ * that are selected are parsed if lazy.
+ */
+static struct regdb_t const *registerDefs(unsigned cputype = 0, bool lazy = false){
+	static bool loaded = false ;
+	if( !loaded ){
+		const char *filename = getDataPath(cputype);
+		if( builtinDatabase(filename,regdb) ){
+			regdbIndex(regdb,arena);
+			loaded = true ;
+			return &regdb ;
+		}
+		char *dbname = getDbPath(filename);
+		if( !regdbOpen(dbname,filename,regdb)
+		    && parseDatabase(filename,textdb,lazy) )
+			textdbView(textdb,regdb);
+		free(dbname);
+		regdbIndex(regdb,arena);
+		loaded = true ;
+	}
+	return &regdb ;
+}
+
+static int compileDatabase(char const *srcpath, char const *dbpath)
+{
+	struct regdb_t db ;
+	memset(&db,0,sizeof(db));
+	if( !parseDatabase(srcpath,textdb,false) )
+		return 1 ;
+	textdbView(textdb,db);
+	regdbIndex(db,arena);
+	regdbIndexNames(db,arena);
+	if( !regdbWrite(db,srcpath,dbpath) )
+		return 1 ;
+	printf("%s: %u registers, %u fields\n", dbpath, db.reg_count, db.field_count);
+	return 0 ;
+}
+
+static struct fieldDescription_t *newField
+	( char const *name,
+	  unsigned namelen,
+	  unsigned startbit,
+	  unsigned bitcount )
+{
+	struct fieldDescription_t *f = (struct fieldDescription_t *)arenaAlloc(arena,sizeof(*f));
+	f->name = name ;
+	f->namelen = namelen ;
+	f->startbit = startbit ;
+	f->bitcount = bitcount ;
+	f->next = 0 ;
+	return f ;
+}
+
+static struct reglist_t *newRegEntry
+	( struct regdb_t const *defs,
+	  struct regdb_reg_t const &r )
+{
+	struct reglist_t *newOne = (struct reglist_t *)arenaAlloc(arena,sizeof(*newOne));
+	newOne->address = r.address ;
+	newOne->width = r.width ;
+	newOne->name = defs->strings+r.name ;
+	newOne->namelen = r.namelen ;
+	newOne->index = &r - defs->regs ;
+	newOne->fields = 0 ;
+	newOne->next = 0 ;
+	return newOne ;
+}
+
+/*
+ * Build a list entry for a register from the database with all of its
+ * fields, or only those selected by fieldPart (a name or bit numbers).
+ * Returns 0 if fieldPart holds invalid bit numbers.
+ */
+static struct reglist_t *selectReg
+	( struct regdb_t const *defs,
+	  struct regdb_reg_t const &r,
+	  char const *fieldPart )
+{
+	struct reglist_t *newOne = newRegEntry(defs,r);
+	loadFields(defs,&r-defs->regs);
+	if (fieldPart && isdigit(*fieldPart)) {
+		unsigned start, count ;
+		if (!parseBits(fieldPart,start,count))
+			return 0 ;
+		newOne->fields = newField(fieldPart,strlen(fieldPart),start,count);
+		return newOne ;
+	}
+	/* walk backwards so the list ends up in table order */
+	unsigned const fieldLen = fieldPart ? strlen(fieldPart) : 0 ;
+	unsigned i = r.field_count ;
+	while (i--) {
+		struct regdb_field_t const &rhs = defs->fields[r.field_first+i];
+		if (fieldPart
+		    && ((fieldLen != rhs.namelen)
+			||
+			(0 != strncasecmp(fieldPart,defs->strings+rhs.name,fieldLen))))
+			continue;
+		struct fieldDescription_t *newf = newField(defs->strings+rhs.name,rhs.namelen,rhs.startbit,rhs.bitcount);
+		newf->next = newOne->fields ;
+		newOne->fields = newf ;
+	}
+	return newOne ;
+}
+
+static int compareIndex(void const *lhs, void const *rhs)
+{
+	uint32_t const l = *(uint32_t const *)lhs ;
+	uint32_t const r = *(uint32_t const *)rhs ;
+	return (l < r) ? -1 : (l > r);
+}
+
+static struct reglist_t const *parseRegisterSpec(char const *regname)
+{
+	char const c = *regname ;
+
+	if(isalpha(c) || ('_' == c)){
+                struct reglist_t *out = 0 ;
+                struct regdb_t const *defs = registerDefs();
+		char const *fieldPart = strchr(regname,'.');
+
+		if (0 == fieldPart)
+			fieldPart = strchr(regname,':');
+		unsigned const nameLen = fieldPart ? fieldPart++ - regname : strlen(regname);
+		unsigned slot = ~0U ;
+		int idx ;
+		while (0 <= (idx = regdbFindName(*defs,regname,nameLen,slot))) {
+			struct reglist_t *newOne = selectReg(defs,defs->regs[idx],fieldPart);
+			if (0 == newOne)
+				return 0 ;
+			newOne->next = out ;
+			out = newOne ;
+		}
+		/* fall back to a prefix, then a substring match, unless a field is given */
+		if (out || fieldPart)
+			return out ;
+		regdbIndexNames(regdb,arena);
+		unsigned first, last ;
+		uint32_t *matches ;
+		unsigned count = 0 ;
+		regdbPrefixRange(*defs,regname,nameLen,first,last);
+		if (first < last) {
+			matches = (uint32_t *)malloc((last-first)*sizeof(matches[0]));
+			while (first < last)
+				matches[count++] = defs->name_index[first++];
+		} else {
+			regdbSubstringRange(*defs,regname,nameLen,first,last);
+			matches = (uint32_t *)malloc((last-first)*sizeof(matches[0])+1);
+			while (first < last)
+				matches[count++] = defs->suffixes[first++].reg ;
+		}
+		/* list in table order, as a scan would */
+		qsort(matches,count,sizeof(matches[0]),compareIndex);
+		for (unsigned i = 0 ; i < count ; i++) {
+			if (i && (matches[i] == matches[i-1]))
+				continue;
+			struct reglist_t *newOne = selectReg(defs,defs->regs[matches[i]],0);
+			newOne->next = out ;
+			out = newOne ;
+		}
+		free(matches);
+		return out ;
+	} else if(isdigit(c)){
+		char *end ;
+		phys_addr_t address = (phys_addr_t)strtoul(regname,&end,16);
+		struct regdb_t const *defs = registerDefs();
+		if( '-' == *end ){
+			/* all known registers within an address range */
+			phys_addr_t last = (phys_addr_t)strtoul(end+1,&end,16);
+			if( (0 != *end) || (last < address) ){
+				fprintf( stderr, "Invalid address range '%s'. Use 0xSTART-0xEND\n", regname );
+				return 0 ;
+			}
+			struct reglist_t *out = 0, *tail = 0 ;
+			for (unsigned i = regdbAddrLowerBound(*defs,address) ; i < defs->reg_count ; i++) {
+				struct regdb_reg_t const &r = defs->regs[defs->addr_index[i]];
+				if( (phys_addr_t)r.address > last )
+					break;
+				struct reglist_t *newOne = selectReg(defs,r,0);
+				if( tail )
+					tail->next = newOne ;
+				else
+					out = newOne ;
+				tail = newOne ;
+			}
+			return out ;
+		} else if( (0 == *end) || (':' == *end) || ('.' == *end) ){
+                        struct fieldDescription_t *field = 0 ;
+			struct reglist_t *out = 0 ;
+
+			if (':' == *end) {
+				unsigned start, count ;
+				if (parseBits(end+1,start,count)) {
+					field = newField(end+1,strlen(end+1),start,count);
+				}
+			}
+			unsigned width = 4 ;
+			if( '.' == *end ){
+				char widthchar=tolower(end[1]);
+				if ('w' == widthchar) {
+					width = 2 ;
+				} else if ('b' == widthchar) {
+					width = 1 ;
+				} else if ('l' == widthchar) {
+					width = 4 ;
+				} else {
+					fprintf( stderr, "Invalid width char <%c>\n", widthchar);
+				}
+			}
+			/*
+			 * Unless an access width was given, an address inside a
+			 * register refers to that register.
+			 */
+			int idx = regdbFindAddress(*defs,address);
+			if( (0 <= idx)
+			    && (('.' != *end) || ((phys_addr_t)defs->regs[idx].address == address)) ){
+				out = newRegEntry(defs,defs->regs[idx]);
+				out->fields = field ;
+			} else {
+                                out = (struct reglist_t *)arenaAlloc(arena,sizeof(*out));
+				out->address = address ;
+				out->width = width ;
+				out->name = "" ;
+				out->namelen = 0 ;
+				out->index = -1 ;
+				out->fields = field ;
+				out->next = 0 ;
+			}
+			return out ;
+		} else {
+			fprintf( stderr, "Invalid register name or value '%s'. Use name or 0xHEX\n", regname );
+		}
+	} else {
+		fprintf( stderr, "Invalid register name or value '%s'. Use name or 0xHEX\n", regname );
+	}
+	return 0 ;
+}
+
+static bool isAddressRange(char const *regname)
+{
+	char *end ;
+	if (!isdigit(*regname))
+		return false ;
+	strtoul(regname,&end,16);
+	return '-' == *end ;
+}
+
+/*
+ * True if the registers a spec matched may be written: a single one,
+ * by its exact name rather than a prefix or substring, or by the
+ * address it starts at rather than one inside it. Otherwise reports
+ * why not.
+ */
+static bool writableReg(char const *regname, struct reglist_t const *regs)
+{
+	if (isAddressRange(regname)) {
+		fprintf(stderr, "Can't write an address range\n");
+		return false ;
+	}
+	phys_addr_t const address = isdigit(*regname) ? (phys_addr_t)strtoul(regname,0,16) : 0 ;
+	if (isdigit(*regname) && (0 <= regs->index) && (address != regs->address)) {
+		fprintf(stderr, "0x%08lx is inside %.*s:0x%08lx, no write made. Write %.*s, "
+			"or 0x%08lx.w or .b for just the bytes there\n",
+			(unsigned long)address, regs->namelen, regs->name, (unsigned long)regs->address,
+			regs->namelen, regs->name, (unsigned long)address);
+		return false ;
+	}
+	unsigned const len = strcspn(regname,".:");
+	bool const exact = isdigit(*regname)
+			   || ((regs->namelen == len) && (0 == strncasecmp(regs->name,regname,len)));
+	if (exact && (0 == regs->next))
+		return true ;
+	fprintf(stderr, "%s matches %s, no write made:\n", regname,
+		exact ? "more than one register" : "no register name exactly");
+	for (struct reglist_t const *r = regs ; r ; r = r->next)
+		fprintf(stderr, "\t%.*s\n", r->namelen, r->name);
+	return false ;
+}
+
+static unsigned fieldVal(unsigned startbit, unsigned bitcount, unsigned v)
+{
+	v >>= startbit ;
+	v &= (1<<bitcount)-1 ;
+	return v ;
+}
+
+static unsigned fieldMask(unsigned startbit, unsigned bitcount)
+{
+	return (0xffffffff >> (32-bitcount)) << startbit ;
+}
+
+#define RED	"\e[0;31m"
+#define GREEN	"\e[1;32m"
+#define BLUE	"\e[1;34m"
+#define YELLOW	"\e[1;33m"
+#define CYAN	"\e[0;36m"
+#define RST	"\e[1;0m"
+#define COL(_color)	(stdout_tty && fancy_color_mode ? _color : "")
+
+/*
+ * Reads the register value, returns false for an unsupported width
+ */
+static bool readReg(phys_addr_t address, unsigned width, unsigned &rv)
+{
+	if( (1 != width) && (2 != width) && (4 != width) )
+		return false ;
+	rv = physRead(address,width);
+	return true ;
+}
+
+/*
+ * Prints a register value read by readReg(), returns false for an
+ * unsupported width
+ */
+static bool printValue
+	( char const *name,
+	  unsigned namelen,
+	  phys_addr_t address,
+	  unsigned width,
+	  unsigned rv )
+{
+	if( 2 == width ) {
+		printf( "%.*s:0x%08lx\t=0x%04x\n", namelen, name, address, rv );
+	} else if( 4 == width ) {
+		printf( "%.*s:0x%08lx\t=0x%08x\n", namelen, name, address, rv );
+	} else if( 1 == width ) {
+		printf( "%.*s:0x%08lx\t=0x%02x\n", namelen, name, address, rv );
+	}
+	else {
+		fprintf(stderr, "Unsupported width in register %.*s\n", namelen, name);
+		return false ;
+	}
+	return true ;
+}
+
+/*
+ * Reads and prints the register value, returns false for an unsupported width
+ */
+static bool showValue
+	( char const *name,
+	  unsigned namelen,
+	  phys_addr_t address,
+	  unsigned width,
+	  unsigned &rv )
+{
+	rv = 0 ;
+	readReg(address,width,rv);
+	if (!printValue(name,namelen,address,width,rv))
+		return false ;
+	fflush(stdout);
+	return true ;
+}
+
+static void showField
+	( char const *name,
+	  unsigned namelen,
+	  unsigned startbit,
+	  unsigned bitcount,
+	  unsigned rv )
+{
+	unsigned const v = fieldVal(startbit,bitcount,rv);
+	printf("\t%s%-16.*s%s", COL(CYAN), namelen, name, COL(RST));
+	printf("\t%s%2u-%2u%s", COL(BLUE),  startbit, startbit+bitcount-1, COL(RST));
+	printf("\t=%s0x%x%s",  v ? COL(YELLOW) : "", v, COL(RST));
+	if (fancy_color_mode) {
+		int len = bitcount;
+		printf("\t");
+		while (--len >= 0) {
+			if ((v >> len) & 1)
+				printf("%s%u%s", COL(GREEN), 1, COL(RST));
+			else
+				printf("%s%u%s", COL(RED), 0, COL(RST));
+		}
+	}
+	printf("\n");
+}
+
+static void showReg(struct reglist_t const *reg)
+{
+	unsigned rv ; 
+	if (!showValue(reg->name,reg->namelen,reg->address,reg->width,rv))
+		return ;
+	struct fieldDescription_t *f = reg->fields ;
+	while(f){
+		showField(f->name,f->namelen,f->startbit,f->bitcount,rv);
+		f=f->next ;
+	}
+	fflush(stdout);
+}
+
+/*
+ * Display a register value, already read, straight from the database
+ * tables
+ */
+static void printDbReg(struct regdb_t const *defs, struct regdb_reg_t const &r, unsigned rv)
+{
+	loadFields(defs,&r-defs->regs);
+	if (!printValue(defs->strings+r.name,r.namelen,r.address,r.width,rv))
+		return ;
+	struct regdb_field_t const *f = defs->fields+r.field_first ;
+	for (unsigned i = 0 ; i < r.field_count ; i++, f++)
+		showField(defs->strings+f->name,f->namelen,f->startbit,f->bitcount,rv);
+}
+
+/*
+ * Display every register in the database. All of the registers are
+ * read first, in address order so each page is visited once, and then
+ * printed in the order of the database.
+ */
+static void dumpRegs(struct regdb_t const *defs)
+{
+	unsigned const count = defs->reg_count ;
+	phys_addr_t *addrs = (phys_addr_t *)arenaAlloc(arena,count*sizeof(addrs[0]));
+	for (unsigned i = 0 ; i < count ; i++)
+		addrs[i] = defs->regs[defs->addr_index[i]].address ;
+	physmemPlan(addrs,count);
+
+	unsigned *values = (unsigned *)arenaAlloc(arena,count*sizeof(values[0]));
+	for (unsigned i = 0 ; i < count ; i++) {
+		unsigned const idx = defs->addr_index[i];
+		values[idx] = 0 ;
+		readReg(defs->regs[idx].address,defs->regs[idx].width,values[idx]);
+	}
+	for (unsigned i = 0 ; i < count ; i++)
+		printDbReg(defs,defs->regs[i],values[i]);
+	fflush(stdout);
+}
+
+/*
+ * Map everything the registers in the list will need up front
+ */
+static void planRegs(struct reglist_t const *regs)
+{
+	unsigned count = 0 ;
+	for (struct reglist_t const *r = regs ; r ; r = r->next)
+		count++ ;
+	phys_addr_t *addrs = (phys_addr_t *)arenaAlloc(arena,count*sizeof(addrs[0]));
+	count = 0 ;
+	for (struct reglist_t const *r = regs ; r ; r = r->next)
+		addrs[count++] = r->address ;
+	physmemPlan(addrs,count);
+}
+
+/*
+ * The bits of reg that a write changes: those of its field if the spec
+ * selected one, else all of them, with value shifted into place.
+ * Returns false after reporting a spec with several fields, or a value
+ * that doesn't fit.
+ */
+static bool writeBits(struct reglist_t const *reg, bool fieldsOnly, unsigned &value, unsigned &mask)
+{
+	unsigned shift = 0 ;
+	mask = fieldMask(0,8*reg->width);
+	if (fieldsOnly) {
+		if ((0 == reg->fields) || reg->fields->next) {
+			fprintf(stderr, "%s field matched %.*s\n", reg->fields ? "More than one" : "No",
+				reg->namelen, reg->name);
+			return false ;
+		}
+		shift = reg->fields->startbit ;
+		mask = fieldMask(shift,reg->fields->bitcount);
+	}
+	unsigned maxValue = mask >> shift ;
+	if (value > maxValue) {
+		fprintf(stderr, "Value 0x%x exceeds max 0x%x for register %.*s\n", value, maxValue, reg->namelen, reg->name);
+		return false ;
+	}
+	value <<= shift ;
+	return true ;
+}
+
+/*
+ * The bits of reg that FIELD=VALUE assignments change, all of them
+ * combined so they take a single read-modify-write. Returns false
+ * after reporting an unknown or repeated field, or a value that
+ * doesn't fit.
+ */
+static bool writeFields(struct reglist_t const *reg, int count, char const *const *assigns, unsigned &value, unsigned &mask)
+{
+	value = mask = 0 ;
+	for (int i = 0 ; i < count ; i++) {
+		char const *eq = strchr(assigns[i],'=');
+		unsigned const namelen = eq ? eq-assigns[i] : 0 ;
+		struct fieldDescription_t const *f = reg->fields ;
+		while (f && ((f->namelen != namelen) || strncasecmp(f->name,assigns[i],namelen)))
+			f = f->next ;
+		if (0 == eq) {
+			fprintf(stderr, "Invalid '%s', use FIELD=VALUE\n", assigns[i]);
+			return false ;
+		}
+		if (0 == f) {
+			fprintf(stderr, "No field %.*s in %.*s\n", namelen, assigns[i],
+				reg->namelen, reg->name);
+			return false ;
+		}
+		char *end ;
+		unsigned const v = strtoul(eq+1,&end,16);
+		if ((end == eq+1) || ('\0' != *end)) {
+			fprintf(stderr, "Invalid value '%s', use hex\n", eq+1);
+			return false ;
+		}
+		unsigned const fmask = fieldMask(f->startbit,f->bitcount);
+		if (mask & fmask) {
+			fprintf(stderr, "%.*s overlaps an earlier field\n", namelen, assigns[i]);
+			return false ;
+		}
+		if (v > (fmask >> f->startbit)) {
+			fprintf(stderr, "Value 0x%x exceeds max 0x%x for field %.*s\n",
+				v, fmask >> f->startbit, namelen, assigns[i]);
+			return false ;
+		}
+		mask |= fmask ;
+		value |= v << f->startbit ;
+	}
+	return true ;
+}
+
+/*
+ * Read-modify-write the bits of mask, displaying the value before and
+ * after
+ */
+static void writeReg(struct reglist_t const *reg, unsigned mask, unsigned value)
+{
+	if( 1 == reg->width ){
+		unsigned const rv = physRead(reg->address,1);
+		value = (rv&~mask) | (value&mask);
+		printf( "%.*s:0x%08lx == 0x%02x...", reg->namelen, reg->name, reg->address, rv );
+		physWrite(reg->address,1,value);
+	} else if( 2 == reg->width ){
+		unsigned const rv = physRead(reg->address,2);
+		value = (rv&~mask) | (value&mask);
+		printf( "%.*s:0x%08lx == 0x%04x...", reg->namelen, reg->name, reg->address, rv );
+		physWrite(reg->address,2,value);
+	} else {
+		unsigned const rv = physRead(reg->address,4);
+		value = (rv&~mask) | (value&mask);
+		printf( "%.*s:0x%08lx == 0x%08x...", reg->namelen, reg->name, reg->address, rv );
+		physWrite(reg->address,4,value);
+	}
+	printf( "0x%08x\n", value );
+}
+
+static void putReg(struct reglist_t const *reg, bool fieldsOnly, unsigned value){
+	unsigned mask ;
+	if (writeBits(reg,fieldsOnly,value,mask))
+		writeReg(reg,mask,value);
+}
+
+struct readOrder_t {
+	uint64_t	address ;
+	uint32_t	index ;
+};
+
+static int compareReadOrder(void const *lhs, void const *rhs)
+{
+	struct readOrder_t const *l = (struct readOrder_t const *)lhs ;
+	struct readOrder_t const *r = (struct readOrder_t const *)rhs ;
+	if (l->address != r->address)
+		return (l->address < r->address) ? -1 : 1 ;
+	return (l->index < r->index) ? -1 : (l->index > r->index);
+}
+
+/*
+ * Read the registers of snapshot records into values, in address
+ * order and with everything mapped beforehand. Returns the time taken
+ * by the reads alone in ns.
+ */
+static uint64_t readRecords
+	( struct snapshot_reg_t const *recs,
+	  unsigned count,
+	  uint32_t *values )
+{
+	struct readOrder_t *order = (struct readOrder_t *)arenaAlloc(arena,count*sizeof(order[0]));
+	phys_addr_t *addrs = (phys_addr_t *)arenaAlloc(arena,count*sizeof(addrs[0]));
+	for (unsigned i = 0 ; i < count ; i++) {
+		order[i].address = addrs[i] = recs[i].address ;
+		order[i].index = i ;
+	}
+	qsort(order,count,sizeof(order[0]),compareReadOrder);
+	physmemPlan(addrs,count);
+
+	struct timespec start, end ;
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for (unsigned i = 0 ; i < count ; i++) {
+		struct snapshot_reg_t const &r = recs[order[i].index];
+		values[order[i].index] = physRead(r.address,r.width);
+	}
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	return (uint64_t)(end.tv_sec-start.tv_sec)*1000000000 + end.tv_nsec - start.tv_nsec ;
+}
+
+/*
+ * Capture the registers in the list, or every register in the
+ * database if there is no list, to a snapshot file. Everything but
+ * the reads themselves is done before or after the capture.
+ */
+static int takeSnapshot
+	( char const *path,
+	  unsigned cpu,
+	  struct regdb_t const *defs,
+	  struct reglist_t const *regs )
+{
+	unsigned count = 0 ;
+	if (regs) {
+		for (struct reglist_t const *r = regs ; r ; r = r->next)
+			count++ ;
+	} else
+		count = defs->reg_count ;
+
+	struct snapshot_reg_t *recs = (struct snapshot_reg_t *)arenaAlloc(arena,count*sizeof(recs[0]));
+	uint32_t *values = (uint32_t *)arenaAlloc(arena,count*sizeof(values[0]));
+	for (unsigned i = 0 ; i < count ; i++) {
+		if (regs) {
+			recs[i].address = regs->address ;
+			recs[i].width = regs->width ;
+			recs[i].reg = regs->index ;
+			regs = regs->next ;
+		} else {
+			recs[i].address = defs->regs[i].address ;
+			recs[i].width = defs->regs[i].width ;
+			recs[i].reg = i ;
+		}
+	}
+
+	struct snapshot_header_t header ;
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,SNAPSHOT_MAGIC,sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION ;
+	header.byte_order = SNAPSHOT_BYTE_ORDER ;
+	header.cpu = cpu ;
+	header.reg_count = count ;
+	struct timespec now ;
+	clock_gettime(CLOCK_REALTIME,&now);
+	header.time_ns = (int64_t)now.tv_sec*1000000000 + now.tv_nsec ;
+	header.capture_ns = readRecords(recs,count,values);
+	header.db_hash = regdbRegsHash(*defs);
+
+	if (!snapshotWrite(path,header,recs,values))
+		return 1 ;
+	printf("%s: %u registers read in %llu us\n", path, count,
+	       (unsigned long long)header.capture_ns/1000);
+	return 0 ;
+}
+
+/*
+ * Database index of a snapshot register, -1 if it isn't in the database.
+ * The recorded index is only good for the same register definitions,
+ * otherwise registers are looked up by address.
+ */
+static int snapshotRegIndex
+	( struct regdb_t const *defs,
+	  bool sameDefs,
+	  struct snapshot_reg_t const &r )
+{
+	int idx = -1 ;
+	if (sameDefs)
+		idx = (r.reg < defs->reg_count) ? (int)r.reg : -1 ;
+	else if (SNAPSHOT_NOREG != r.reg)
+		idx = regdbFindAddress(*defs,r.address);
+	if ((0 <= idx) && (defs->regs[idx].address != r.address))
+		idx = -1 ;
+	return idx ;
+}
+
+/*
+ * Decode a snapshot with the database of the CPU it was taken on
+ */
+static int showSnapshot(char const *path)
+{
+	struct snapshot_t snap ;
+	if (!snapshotOpen(path,snap))
+		return 1 ;
+	struct regdb_t const *defs = registerDefs(snap.header->cpu,true);
+	bool const sameDefs = (regdbRegsHash(*defs) == snap.header->db_hash);
+	if (!sameDefs)
+		fprintf(stderr, "%s: taken with different register definitions\n", path);
+	for (unsigned i = 0 ; i < snap.header->reg_count ; i++) {
+		struct snapshot_reg_t const &r = snap.regs[i];
+		int const idx = snapshotRegIndex(defs,sameDefs,r);
+		if (0 <= idx)
+			printDbReg(defs,defs->regs[idx],snap.values[i]);
+		else
+			printValue("",0,r.address,r.width,snap.values[i]);
+	}
+	return 0 ;
+}
+
+/*
+ * Display a register, or the fields of it, that changed from old to new
+ */
+static void printChange
+	( struct regdb_t const *defs,
+	  int idx,
+	  struct snapshot_reg_t const &r,
+	  unsigned old,
+	  unsigned now )
+{
+	int const digits = 2*r.width ;
+	char const *name = "" ;
+	unsigned namelen = 0 ;
+	if (0 <= idx) {
+		name = defs->strings+defs->regs[idx].name ;
+		namelen = defs->regs[idx].namelen ;
+	}
+	printf("%.*s:0x%08lx\t=0x%0*x -> %s0x%0*x%s\n", namelen, name,
+	       (unsigned long)r.address, digits, old, COL(YELLOW), digits, now, COL(RST));
+	if (0 > idx)
+		return ;
+	struct regdb_reg_t const &reg = defs->regs[idx];
+	loadFields(defs,idx);
+	unsigned const changed = old ^ now ;
+	struct regdb_field_t const *f = defs->fields+reg.field_first ;
+	for (unsigned i = 0 ; i < reg.field_count ; i++, f++) {
+		if (0 == fieldVal(f->startbit,f->bitcount,changed))
+			continue ;
+		printf("\t%s%-16.*s%s", COL(CYAN), f->namelen, defs->strings+f->name, COL(RST));
+		printf("\t%s%2u-%2u%s", COL(BLUE), f->startbit, f->startbit+f->bitcount-1, COL(RST));
+		printf("\t=0x%x -> %s0x%x%s\n", fieldVal(f->startbit,f->bitcount,old),
+		       COL(YELLOW), fieldVal(f->startbit,f->bitcount,now), COL(RST));
+	}
+}
+
+/*
+ * Compare a snapshot with another one, or with the registers as they
+ * are now if other is 0. Like diff(1), returns 0 if nothing changed,
+ * 1 if something did and 2 on trouble.
+ */
+static int diffSnapshot(char const *path, char const *other, unsigned cpu = 0)
+{
+	struct snapshot_t a, b ;
+	if (!snapshotOpen(path,a))
+		return 2 ;
+	unsigned const count = a.header->reg_count ;
+	uint32_t const *values ;
+	uint32_t *match = 0 ;
+	bool bSameDefs = false ;
+	if (other) {
+		if (!snapshotOpen(other,b))
+			return 2 ;
+		uint32_t *aligned = (uint32_t *)arenaAlloc(arena,count*sizeof(aligned[0]));
+		match = (uint32_t *)arenaAlloc(arena,count*sizeof(match[0]));
+		values = b.values ;
+		if (!snapshotAlign(a,b,aligned,match))
+			values = aligned ;
+		else
+			match = 0 ;
+		bSameDefs = (b.header->cpu == a.header->cpu)
+			    && (b.header->db_hash == a.header->db_hash);
+	} else {
+		if (cpu != a.header->cpu) {
+			fprintf(stderr, "%s: taken on a different CPU (0x%x)\n", path, a.header->cpu);
+			return 2 ;
+		}
+		uint32_t *live = (uint32_t *)arenaAlloc(arena,count*sizeof(live[0]));
+		readRecords(a.regs,count,live);
+		values = live ;
+	}
+
+	struct regdb_t const *defs = registerDefs(a.header->cpu,true);
+	bool const sameDefs = (regdbRegsHash(*defs) == a.header->db_hash);
+	bSameDefs = bSameDefs && sameDefs ;
+
+	struct timespec start, end ;
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	uint32_t *changed = (uint32_t *)arenaAlloc(arena,(count+1)*sizeof(changed[0]));
+	unsigned const nchanged = snapshotChanges(a.values,values,count,changed);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+
+	for (unsigned i = 0 ; i < nchanged ; i++) {
+		unsigned const pos = changed[i];
+		struct snapshot_reg_t const &r = a.regs[pos];
+		printChange(defs,snapshotRegIndex(defs,sameDefs,r),r,a.values[pos],values[pos]);
+	}
+	unsigned onlyA = 0, onlyB = 0 ;
+	if (match) {
+		char *inA = (char *)arenaAlloc(arena,b.header->reg_count);
+		memset(inA,0,b.header->reg_count);
+		for (unsigned i = 0 ; i < count ; i++) {
+			if (SNAPSHOT_NOREG != match[i]) {
+				inA[match[i]] = 1 ;
+				continue ;
+			}
+			struct snapshot_reg_t const &r = a.regs[i];
+			int const idx = snapshotRegIndex(defs,sameDefs,r);
+			if (0 == onlyA++)
+				printf("only in %s:\n", path);
+			printValue(0 <= idx ? defs->strings+defs->regs[idx].name : "",
+				   0 <= idx ? defs->regs[idx].namelen : 0,
+				   r.address,r.width,a.values[i]);
+		}
+		for (unsigned j = 0 ; j < b.header->reg_count ; j++) {
+			if (inA[j])
+				continue ;
+			struct snapshot_reg_t const &r = b.regs[j];
+			int const idx = snapshotRegIndex(defs,bSameDefs,r);
+			if (0 == onlyB++)
+				printf("only in %s:\n", other);
+			printValue(0 <= idx ? defs->strings+defs->regs[idx].name : "",
+				   0 <= idx ? defs->regs[idx].namelen : 0,
+				   r.address,r.width,b.values[j]);
+		}
+	}
+	fflush(stdout);
+	if (stats_mode)
+		fprintf(stderr, "%u registers compared in %lu us\n", count,
+			(unsigned long)((end.tv_sec-start.tv_sec)*1000000 + (end.tv_nsec-start.tv_nsec)/1000));
+	return (nchanged || onlyA || onlyB) ? 1 : 0 ;
+}
+
+/*
+ * True if a register spec selects fields rather than a whole register
+ * (whose fields are all listed anyway)
+ */
+static bool specHasField(char const *spec)
+{
+	if (isdigit(*spec))
+		return 0 != strchr(spec,':');
+	return 0 != strpbrk(spec,".:");
+}
+
+/*
+ * Registers selected for sampling, with their list entries for display
+ */
+struct sampleSet_t {
+	unsigned		 count ;
+	struct reglist_t const	**regs ;
+	struct sampleReg_t	 *sregs ;
+};
+
+/*
+ * Select and map the registers matching specs for sampling. Changes
+ * to a register count only in the fields given, if any. Returns false
+ * after reporting a spec that matched nothing.
+ */
+static bool selectSamples(int count, char const **specs, struct sampleSet_t &set)
+{
+	struct reglist_t const **lists = (struct reglist_t const **)arenaAlloc(arena,count*sizeof(lists[0]));
+	unsigned nregs = 0 ;
+	for (int i = 0 ; i < count ; i++) {
+		lists[i] = parseRegisterSpec(specs[i]);
+		if (0 == lists[i]) {
+			fprintf (stderr, "Nothing matched %s\n", specs[i]);
+			return false ;
+		}
+		for (struct reglist_t const *r = lists[i] ; r ; r = r->next)
+			nregs++ ;
+	}
+
+	set.count = nregs ;
+	set.regs = (struct reglist_t const **)arenaAlloc(arena,nregs*sizeof(set.regs[0]));
+	set.sregs = (struct sampleReg_t *)arenaAlloc(arena,nregs*sizeof(set.sregs[0]));
+	unsigned n = 0 ;
+	for (int i = 0 ; i < count ; i++) {
+		bool const fieldsOnly = specHasField(specs[i]);
+		for (struct reglist_t const *r = lists[i] ; r ; r = r->next, n++) {
+			struct sampleReg_t &sr = set.sregs[n];
+			set.regs[n] = r ;
+			sr.address = r->address ;
+			sr.width = r->width ;
+			sr.mask = fieldMask(0,8*r->width);
+			if (fieldsOnly) {
+				sr.mask = 0 ;
+				for (struct fieldDescription_t const *f = r->fields ; f ; f = f->next)
+					sr.mask |= fieldMask(f->startbit,f->bitcount);
+				if (0 == sr.mask) {
+					fprintf (stderr, "No field of %.*s matched %s\n", r->namelen, r->name, specs[i]);
+					return false ;
+				}
+			}
+		}
+	}
+	samplePrepare(set.sregs,nregs);
+	return true ;
+}
+
+static void printStamp(int64_t ns)
+{
+	uint64_t const abs = (0 > ns) ? -ns : ns ;
+	char stamp[32];
+	snprintf(stamp, sizeof(stamp), "%s%llu.%09llu", (0 > ns) ? "-" : "",
+		 (unsigned long long)abs/1000000000, (unsigned long long)abs%1000000000);
+	printf("%14s ", stamp);
+}
+
+/*
+ * Display a sampled register with its fields, or only those that
+ * changed from old
+ */
+static void printWatched
+	( int64_t ns,
+	  struct reglist_t const *reg,
+	  unsigned old,
+	  unsigned rv,
+	  bool allFields )
+{
+	printStamp(ns);
+	printValue(reg->name,reg->namelen,reg->address,reg->width,rv);
+	for (struct fieldDescription_t const *f = reg->fields ; f ; f = f->next) {
+		if (allFields || fieldVal(f->startbit,f->bitcount,old^rv))
+			showField(f->name,f->namelen,f->startbit,f->bitcount,rv);
+	}
+}
+
+/*
+ * Set up sampling as the options ask: every --period, pinned to a CPU
+ * or SCHED_FIFO with memory locked, and to stop on ^C or after
+ * --duration. Call once the buffers for sampling are allocated.
+ * Returns false after reporting an error.
+ */
+static bool startSampling(void)
+{
+	if (period_ns)
+		samplePeriod(pacing,period_ns);
+	if ((rt_priority || (0 <= affinity)) && !sampleRealtime(affinity,rt_priority))
+		return false ;
+	sampleStopOnSignal();
+	if (duration_ns)
+		sampleStopAfter(duration_ns);
+	return true ;
+}
+
+/*
+ * Report how sampling went, returns rc
+ */
+static int finishSampling(int rc)
+{
+	samplePrintPacing(stderr,pacing);
+	if (stats_mode)
+		physmemPrintStats(stderr);
+	return rc ;
+}
+
+struct watchList_t {
+	struct reglist_t const	**regs ;
+	uint32_t		 *shown ;	// values last displayed
+	uint64_t		  start ;
+};
+
+static void drainWatch(struct sampleRing_t &ring, void *ctx)
+{
+	struct watchList_t &w = *(struct watchList_t *)ctx ;
+	while (ring.tail != ring.head) {
+		struct sample_t const &s = ring.samples[ring.tail++ & ring.mask];
+		printWatched(s.ns-w.start,w.regs[s.reg],w.shown[s.reg],s.value,false);
+		w.shown[s.reg] = s.value ;
+	}
+	fflush(stdout);
+}
+
+/*
+ * Poll the registers matching specs until interrupted, and display the
+ * ones that change
+ */
+static int watchRegs(int count, char const **specs)
+{
+	struct sampleSet_t set ;
+	if (!selectSamples(count,specs,set))
+		return 1 ;
+	unsigned const nregs = set.count ;
+	struct watchList_t w ;
+	w.regs = set.regs ;
+	w.shown = (uint32_t *)arenaAlloc(arena,nregs*sizeof(w.shown[0]));
+	uint32_t *values = (uint32_t *)arenaAlloc(arena,nregs*sizeof(values[0]));
+	struct sampleRing_t ring ;
+	sampleRingInit(ring,4*nregs);
+
+	sampleOnce(set.sregs,nregs,values);
+	for (unsigned i = 0 ; i < nregs ; i++) {
+		w.shown[i] = values[i];
+		printWatched(0,w.regs[i],values[i],values[i],true);
+	}
+	fflush(stdout);
+
+	if (!startSampling())
+		return 1 ;
+	w.start = sampleNow();
+	uint64_t const passes = sampleWatch(set.sregs,nregs,values,ring,drainWatch,&w);
+	uint64_t const elapsed = sampleNow()-w.start ;
+	fprintf(stderr, "%llu passes over %u registers in %llu ms, %llu passes/s\n",
+		(unsigned long long)passes, nregs, (unsigned long long)elapsed/1000000,
+		elapsed ? (unsigned long long)(passes*1000000000.0/elapsed) : 0ULL);
+	return 0 ;
+}
+
+/*
+ * The bits of a single register or field to sample, returns false
+ * after reporting a spec that doesn't select one
+ */
+static bool selectField(char const *spec, unsigned &startbit, unsigned &bitcount)
+{
+	struct reglist_t const *reg = parseRegisterSpec(spec);
+	if (0 == reg) {
+		fprintf (stderr, "Nothing matched %s\n", spec);
+		return false ;
+	}
+	if (reg->next) {
+		fprintf (stderr, "More than one register matched %s\n", spec);
+		return false ;
+	}
+	startbit = 0 ;
+	bitcount = 8*reg->width ;
+	if (specHasField(spec)) {
+		if ((0 == reg->fields) || reg->fields->next) {
+			fprintf (stderr, "%s needs to select a single field\n", spec);
+			return false ;
+		}
+		startbit = reg->fields->startbit ;
+		bitcount = reg->fields->bitcount ;
+	}
+	return true ;
+}
+
+/*
+ * Parse a trigger condition: REG[.FIELD] followed by one of
+ *
+ *	=V	equals V
+ *	!=V	doesn't equal V
+ *	&M=V	the bits of M equal V
+ *	=>V	becomes V, e.g. =>1 for the rising edge of a one bit field
+ *	~	changes
+ *
+ * with V and M in hex like other values. The register part is copied
+ * to regname. Returns false after reporting an invalid condition.
+ */
+static bool parseTrigger(char const *spec, struct trigger_t &t, char *&regname)
+{
+	char const *op = strpbrk(spec,"!=&~");
+	if ((0 == op) || (op == spec)) {
+		fprintf(stderr, "Invalid trigger '%s', use REG[.FIELD] and =V, !=V, &M=V, =>V or ~\n", spec);
+		return false ;
+	}
+	regname = (char *)arenaAlloc(arena,op-spec+1);
+	memcpy(regname,spec,op-spec);
+	regname[op-spec] = '\0' ;
+	unsigned bitcount ;
+	if (!selectField(regname,t.shift,bitcount))
+		return false ;
+	t.reg = 0 ;
+	t.mask = fieldMask(0,bitcount);
+
+	char *end ;
+	char const *arg = op+1 ;
+	t.op = TRIGGER_EQ ;
+	t.value = 0 ;
+	if ('~' == *op) {
+		t.op = TRIGGER_CHANGE ;
+		end = (char *)arg ;
+	} else {
+		if (('!' == op[0]) && ('=' == op[1])) {
+			t.op = TRIGGER_NE ;
+			arg = op+2 ;
+		} else if (('=' == op[0]) && ('>' == op[1])) {
+			t.op = TRIGGER_BECOMES ;
+			arg = op+2 ;
+		} else if ('&' == op[0]) {
+			t.mask &= strtoul(arg,&end,16);
+			arg = ((end != arg) && ('=' == *end)) ? end+1 : "" ;
+		} else if ('=' != op[0])
+			arg = "" ;
+		t.value = strtoul(arg,&end,16);
+		if (end == arg)
+			end = (char *)"?" ;
+	}
+	if ('\0' != *end) {
+		fprintf(stderr, "Invalid trigger '%s', use REG[.FIELD] and =V, !=V, &M=V, =>V or ~\n", spec);
+		return false ;
+	}
+	if (t.value & ~t.mask) {
+		fprintf(stderr, "Trigger value 0x%x exceeds mask 0x%x\n", t.value, t.mask);
+		return false ;
+	}
+	return true ;
+}
+
+/*
+ * Sample the trigger register and those matching specs until the
+ * trigger fires, then display the rows around it: all values at the
+ * first, and the changes after that, timed from the trigger.
+ */
+static int triggerCapture(int count, char const **specs)
+{
+	struct trigger_t t ;
+	char *regname ;
+	if (!parseTrigger(trigger_spec,t,regname))
+		return 1 ;
+	char const **all = (char const **)arenaAlloc(arena,(count+1)*sizeof(all[0]));
+	all[0] = regname ;
+	for (int i = 0 ; i < count ; i++)
+		all[i+1] = specs[i];
+	struct sampleSet_t set ;
+	if (!selectSamples(count+1,all,set))
+		return 1 ;
+
+	printf("waiting for %s\n", trigger_spec);
+	fflush(stdout);
+	if (!startSampling())
+		return 1 ;
+	struct sampleCapture_t cap ;
+	bool const fired = sampleTrigger(set.sregs,set.count,t,trigger_pre,trigger_post,cap);
+	if (!fired)
+		fprintf(stderr, "Interrupted before the trigger\n");
+	if (0 == cap.rows)
+		return 1 ;
+
+	uint64_t const t0 = cap.ns[fired ? cap.trigger : cap.rows-1];
+	uint32_t const *prev = 0 ;
+	for (unsigned row = 0 ; row < cap.rows ; row++) {
+		uint32_t const *values = cap.values+(size_t)row*set.count ;
+		int64_t const ns = cap.ns[row]-t0 ;
+		if (fired && (row == cap.trigger)) {
+			printStamp(ns);
+			printf("trigger %s\n", trigger_spec);
+		}
+		for (unsigned i = 0 ; i < set.count ; i++) {
+			if (0 == prev)
+				printWatched(ns,set.regs[i],values[i],values[i],true);
+			else if ((prev[i] ^ values[i]) & set.sregs[i].mask)
+				printWatched(ns,set.regs[i],prev[i],values[i],false);
+		}
+		prev = values ;
+	}
+	fflush(stdout);
+	fprintf(stderr, "%u of %llu samples kept, %llu ns apart on average\n",
+		cap.rows, (unsigned long long)cap.taken, (cap.rows > 1)
+		? (unsigned long long)(cap.ns[cap.rows-1]-cap.ns[0])/(cap.rows-1) : 0ULL);
+	return fired ? 0 : 1 ;
+}
+
+/*
+ * Sample a register or field for --duration, or until interrupted, and
+ * display the values seen with how often each was seen
+ */
+static int histogram(char const *spec)
+{
+	unsigned startbit, bitcount ;
+	struct sampleSet_t set ;
+	if (!selectField(spec,startbit,bitcount) || !selectSamples(1,&spec,set))
+		return 1 ;
+	struct histogram_t h ;
+	histogramInit(h,startbit,bitcount);
+
+	if (!startSampling())
+		return 1 ;
+	uint64_t const start = sampleNow();
+	uint64_t const samples = sampleHistogram(set.sregs[0],h);
+	uint64_t const elapsed = sampleNow()-start ;
+
+	struct histEntry_t *values ;
+	unsigned const n = histogramValues(h,values);
+	uint64_t most = 0 ;
+	for (unsigned i = 0 ; i < n ; i++) {
+		if (values[i].count > most)
+			most = values[i].count ;
+	}
+	printf("%s: %llu samples in %llu ms, %llu/s, %u distinct values\n", spec,
+	       (unsigned long long)samples, (unsigned long long)elapsed/1000000,
+	       elapsed ? (unsigned long long)(samples*1000000000.0/elapsed) : 0ULL, n);
+	for (unsigned i = 0 ; i < n ; i++) {
+		int const bar = (int)((40*values[i].count + most-1)/most);
+		printf("\t=%s0x%x%s\t%12llu\t%6.2f%%\t%.*s\n",
+		       COL(YELLOW), values[i].value, COL(RST),
+		       (unsigned long long)values[i].count, 100.0*values[i].count/samples,
+		       bar, "########################################");
+	}
+	fflush(stdout);
+	free(values);
+	return 0 ;
+}
+
+/*
+ * Parse a duration such as 5s, 100ms or 10us (seconds if no unit),
+ * returns 0 if it's invalid
+ */
+static uint64_t parseDuration(char const *value)
+{
+	char *end ;
+	double const n = strtod(value,&end);
+	double scale = 1e9 ;
+	if (0 == strcmp(end,"ms"))
+		scale = 1e6 ;
+	else if (0 == strcmp(end,"us"))
+		scale = 1e3 ;
+	else if (0 == strcmp(end,"m"))
+		scale = 60e9 ;
+	else if (('\0' != *end) && strcmp(end,"s"))
+		return 0 ;
+	if ((end == value) || (n <= 0))
+		return 0 ;
+	return (uint64_t)(n*scale);
+}
+
+#define TRACE_RING	65536	// samples between a sampler and the trace writer
+
+/*
+ * Parse a --group spec, words that are either settings or registers:
+ *
+ *	period=TIME	start a pass every TIME rather than flat out
+ *	cpu=N		sample on CPU number N
+ *	priority=N	sample SCHED_FIFO at priority N
+ *
+ * Returns the number of register specs, put into specs, or -1 after
+ * reporting an error.
+ */
+static int parseGroup(char const *spec, struct sampleGroup_t &g, char const **&specs)
+{
+	size_t const len = strlen(spec);
+	char *words = (char *)arenaAlloc(arena,len+1);
+	memcpy(words,spec,len+1);
+	specs = (char const **)arenaAlloc(arena,(len/2+1)*sizeof(specs[0]));
+	int count = 0 ;
+	char *next = words ;
+	while (char *word = nextWord(next)) {
+		char *value = strchr(word,'=');
+		if (0 == value) {
+			specs[count++] = word ;
+			continue;
+		}
+		*value++ = '\0' ;
+		char *end ;
+		long const n = strtol(value,&end,0);
+		bool ok = (end != value) && ('\0' == *end) && (0 <= n);
+		if (0 == strcmp(word,"period")) {
+			g.period_ns = parseDuration(value);
+			ok = (0 != g.period_ns);
+		} else if (0 == strcmp(word,"cpu")) {
+			g.cpu = n ;
+		} else if (0 == strcmp(word,"priority")) {
+			g.priority = n ;
+			ok = ok && (n >= sched_get_priority_min(SCHED_FIFO))
+			     && (n <= sched_get_priority_max(SCHED_FIFO));
+		} else {
+			ok = false ;
+		}
+		if (!ok) {
+			fprintf(stderr, "Invalid %s=%s in group '%s'\n", word, value, spec);
+			return -1 ;
+		}
+	}
+	if (0 == count)
+		fprintf(stderr, "No registers in group '%s'\n", spec);
+	return count ? count : -1 ;
+}
+
+/*
+ * Record the changes of the registers matching specs and those of each
+ * --group to a trace until interrupted or for --duration. The registers
+ * on the command line form a group with --period, --affinity and
+ * --rt-priority. Each group is sampled by a thread of its own into a
+ * ring, and the writer runs in another thread, merging the rings.
+ */
+static int traceRegs(unsigned cpu, int count, char const **specs)
+{
+	unsigned const first = count ? 1 : 0 ;
+	unsigned const ngroups = first + group_count ;
+	struct sampleGroup_t *groups = (struct sampleGroup_t *)arenaAlloc(arena,ngroups*sizeof(groups[0]));
+	struct sampleSet_t *sets = (struct sampleSet_t *)arenaAlloc(arena,ngroups*sizeof(sets[0]));
+	unsigned n = 0 ;
+	for (unsigned g = 0 ; g < ngroups ; g++) {
+		struct sampleGroup_t &group = groups[g];
+		memset(&group,0,sizeof(group));
+		group.cpu = -1 ;
+		int gcount = count ;
+		char const **gspecs = specs ;
+		if (g < first) {
+			group.period_ns = period_ns ;
+			group.cpu = affinity ;
+			group.priority = rt_priority ;
+		} else if (0 > (gcount = parseGroup(group_specs[g-first],group,gspecs)))
+			return 1 ;
+		if (!selectSamples(gcount,gspecs,sets[g]))
+			return 1 ;
+		group.regs = sets[g].sregs ;
+		group.count = sets[g].count ;
+		group.base = n ;
+		n += group.count ;
+	}
+	struct snapshot_reg_t *recs = (struct snapshot_reg_t *)arenaAlloc(arena,n*sizeof(recs[0]));
+	uint32_t *masks = (uint32_t *)arenaAlloc(arena,n*sizeof(masks[0]));
+	uint32_t *values = (uint32_t *)arenaAlloc(arena,n*sizeof(values[0]));
+	for (unsigned g = 0 ; g < ngroups ; g++) {
+		struct sampleGroup_t const &group = groups[g];
+		for (unsigned i = 0 ; i < group.count ; i++) {
+			struct snapshot_reg_t &rec = recs[group.base+i];
+			rec.address = group.regs[i].address ;
+			rec.width = group.regs[i].width ;
+			rec.reg = sets[g].regs[i]->index ;
+			masks[group.base+i] = group.regs[i].mask ;
+		}
+	}
+
+	struct trace_header_t header ;
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,TRACE_MAGIC,sizeof(header.magic));
+	header.version = TRACE_VERSION ;
+	header.cpu = cpu ;
+	header.db_hash = regdbRegsHash(*registerDefs());
+	header.reg_count = n ;
+	struct timespec now ;
+	clock_gettime(CLOCK_REALTIME,&now);
+	header.time_ns = (int64_t)now.tv_sec*1000000000 + now.tv_nsec ;
+	header.start_ns = sampleNow();
+
+	/* every register starts with a record of its value */
+	struct sampleRing_t **rings = (struct sampleRing_t **)arenaAlloc(arena,ngroups*sizeof(rings[0]));
+	for (unsigned g = 0 ; g < ngroups ; g++) {
+		struct sampleGroup_t &group = groups[g];
+		struct sampleRing_t &ring = group.ring ;
+		sampleRingInit(ring,(2*group.count > TRACE_RING) ? 2*group.count : TRACE_RING);
+		group.values = values+group.base ;
+		sampleOnce(group.regs,group.count,group.values);
+		for (unsigned i = 0 ; i < group.count ; i++) {
+			struct sample_t &s = ring.samples[ring.head++ & ring.mask];
+			s.ns = header.start_ns ;
+			s.reg = group.base+i ;
+			s.value = group.values[i];
+		}
+		ring.watermark = header.start_ns ;
+		rings[g] = &ring ;
+	}
+	if (!traceStart(trace_path,header,recs,masks,rings,ngroups))
+		return 1 ;
+	sampleStopOnSignal();
+	if (duration_ns)
+		sampleStopAfter(duration_ns);
+	unsigned started = 0 ;
+	while ((started < ngroups) && sampleGroupStart(groups[started]))
+		started++ ;
+	if (started < ngroups)
+		sample_stop = 1 ;
 
-	return false ;
+	/*
+	 * have the samplers take ^C and the --duration timer, so they stop
+	 * at once even when SCHED_FIFO keeps this thread off their CPU
+	 */
+	sigset_t signals ;
+	sigemptyset(&signals);
+	sigaddset(&signals,SIGINT);
+	sigaddset(&signals,SIGTERM);
+	sigaddset(&signals,SIGALRM);
+	pthread_sigmask(SIG_BLOCK,&signals,0);
+	bool ok = (started == ngroups);
+	uint64_t *passes = (uint64_t *)arenaAlloc(arena,ngroups*sizeof(passes[0]));
+	for (unsigned g = 0 ; g < ngroups ; g++) {
+		if ((g < started) && !sampleGroupJoin(groups[g]))
+			ok = false ;
+		passes[g] = groups[g].passes ;
+	}
+	uint64_t const elapsed = sampleNow()-header.start_ns ;
+	if (!traceFinish(passes) || !ok)
+		return 1 ;
+	for (unsigned g = 0 ; g < ngroups ; g++) {
+		struct sampleGroup_t const &group = groups[g];
+		fprintf(stderr, "%s: group %u: %llu passes over %u registers in %llu ms, %llu samples dropped\n",
+			trace_path, g, (unsigned long long)group.passes, group.count,
+			(unsigned long long)elapsed/1000000, (unsigned long long)group.ring.dropped);
+		samplePrintPacing(stderr,group.pace);
+	}
+	return 0 ;
 }
 
-static struct fieldDescription_t *parseFields
-	( struct reglist_t const *regs,
-	  char const *fieldname )
+/*
+ * Display a trace with the database of the CPU it was taken on: each
+ * register in full at the start, then its changes
+ */
+static int showTrace(char const *path)
 {
-	if(isdigit(*fieldname)){
-		unsigned start, count ;
-		if (parseBits(fieldname,start,count)){
-			fieldDescription_t *f = new fieldDescription_t ;
-			f->name = fieldname ;
-			f->startbit = start ;
-			f->bitcount = count ;
-			f->next = 0 ;
-			return f ;
-		}
-	} else if( regs ){
-                struct fieldDescription_t *head = 0 ;
-		struct fieldDescription_t *tail = 0 ;
-		while( regs ){
-			if( regs->reg ){
-				struct fieldDescription_t *f = regs->reg->fields ;
-				while( f ){
-					if( 0 == strcasecmp(f->name,fieldname) ){
-						struct fieldDescription_t *newf = new struct fieldDescription_t ;
-						*newf = *f ;
-						newf->next = 0 ;
-						tail = newf ;
-						if( 0 == head )
-							head = newf ;
-					}
-					f = f->next ;
-				}
+	struct trace_t trace ;
+	if (!traceOpen(path,trace))
+		return 1 ;
+	struct trace_header_t const &header = *trace.header ;
+	struct regdb_t const *defs = registerDefs(header.cpu,true);
+	bool const sameDefs = (regdbRegsHash(*defs) == header.db_hash);
+	if (!sameDefs)
+		fprintf(stderr, "%s: taken with different register definitions\n", path);
+	unsigned const n = header.reg_count ;
+	int *idx = (int *)arenaAlloc(arena,(n+1)*sizeof(idx[0]));
+	char *seen = (char *)arenaAlloc(arena,n+1);
+	for (unsigned i = 0 ; i < n ; i++) {
+		idx[i] = snapshotRegIndex(defs,sameDefs,trace.regs[i]);
+		seen[i] = 0 ;
+	}
+	time_t const started = header.time_ns/1000000000 ;
+	char when[64];
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&started));
+	printf("%s: started %s, %u registers\n", path, when, n);
+
+	struct traceRecord_t rec ;
+	while (traceNext(trace,rec)) {
+		struct snapshot_reg_t const &r = trace.regs[rec.reg];
+		int const i = idx[rec.reg];
+		printStamp(rec.ns);
+		if (0 > i) {
+			printValue("",0,r.address,r.width,rec.value);
+		} else {
+			struct regdb_reg_t const &reg = defs->regs[i];
+			printValue(defs->strings+reg.name,reg.namelen,r.address,r.width,rec.value);
+			loadFields(defs,i);
+			unsigned const mask = trace.masks[rec.reg];
+			unsigned const changed = seen[rec.reg] ? (rec.old ^ rec.value) : ~0U ;
+			struct regdb_field_t const *f = defs->fields+reg.field_first ;
+			for (unsigned j = 0 ; j < reg.field_count ; j++, f++) {
+				if (fieldMask(f->startbit,f->bitcount) & mask & changed)
+					showField(defs->strings+f->name,f->namelen,f->startbit,f->bitcount,rec.value);
 			}
-			regs = regs->next ;
 		}
-		return head ;
-	} else {
-		fprintf(stderr, "Can't parse named fields without matching registers\n" );
+		seen[rec.reg] = 1 ;
 	}
+	fflush(stdout);
+	for (unsigned g = 0 ; g < trace.groups ; g++)
+		fprintf(stderr, "%s: group %u: %llu passes, %llu samples dropped\n", path, g,
+			(unsigned long long)trace.passes[g], (unsigned long long)trace.dropped[g]);
+	if (!trace.ended)
+		fprintf(stderr, "%s: no end record, the trace was cut short\n", path);
 	return 0 ;
 }
 
 /*
- *	- Outer loop determines which type of line we're dealing with
- *	based on the first character:
- *		A-Za-z_		- Register:	Name	0xADDRESS[.w|.l|.b]
- *		:		- Field		:fieldname:startbit[-stopbit]
- *		/		- Field set	/Fieldsetname
+ * A script (-s) is run in one process, so the database is parsed and
+ * the registers are mapped once rather than once per command. Each line
+ * is one of:
  *
- *	state field is used to determine whether a field will be added to the
- *	most recent register or fieldset.
+ *	REG[.FIELD]			display, as devregs REG[.FIELD]
+ *	REG[.FIELD] VALUE		write, as devregs REG[.FIELD] VALUE
+ *	delay TIME			wait, e.g. delay 10ms
+ *	poll CONDITION [TIMEOUT]	wait up to TIMEOUT (1s) for a
+ *					--trigger condition, e.g.
+ *					poll UART1_USR2.TXDC=1 100ms
+ *
+ * with values in hex, and '#' starting a comment. The whole script is
+ * parsed before any register is touched, so a typo on the last line
+ * doesn't leave the hardware half set up, and --dry-run stops there.
  */
-enum ftState {
-	FT_UNKNOWN	= -1,
-	FT_REGISTER	= 0,
-	FT_FIELDSET	= 1
+enum scriptOp_e {
+	SCRIPT_READ,
+	SCRIPT_WRITE,
+	SCRIPT_DELAY,
+	SCRIPT_POLL
 };
 
-static char const *getDataPath(unsigned cpu) {
-	switch (cpu & 0xff000) {
-		case 0x63000:
-			return "/etc/devregs_imx6q.dat" ;
-		case 0x61000:
-			return "/etc/devregs_imx6dls.dat" ;
-		case 0x53000:
-			return "/etc/devregs_imx53.dat" ;
-	}
-	switch (cpu) {
-	case 0x10:
-		return "/etc/devregs_imx6q.dat";
-	case 0x51:
-	case 0x5:
-		return "/etc/devregs_imx51.dat";
-	case 0x7:
-		return "/etc/devregs_imx7d.dat";
-	case 0x81:
-		return "/etc/devregs_imx8mq.dat";
-	case 0x82:
-		return "/etc/devregs_imx8mm.dat";
-	default:
-		printf("unsupported CPU type: %x\n", cpu);
-	}
-	return "/etc/devregs.dat" ;
-}
+#define SCRIPT_POLL_NS	1000000000	// default poll timeout
+#define SCRIPT_FIELDS	32		// FIELD=VALUE per write
 
-static struct reglist_t const *registerDefs(unsigned cputype = 0){
-	static struct reglist_t *regs = 0 ;
-	if( 0 == regs ){
-		struct reglist_t *head = 0, *tail = 0 ;
-		const char *filename = getDataPath(cputype);
-		FILE *fDefs = fopen(filename, "rt");
-		if( fDefs ){
-                        enum ftState state = FT_UNKNOWN ;
-			char inBuf[256];
-			int lineNum = 0 ;
-
-//			printf("Using %s\n", filename);
-			while( fgets(inBuf,sizeof(inBuf),fDefs) ){
-				lineNum++ ;
-				// skip unprintables
-                                char *next = skipSpaces(inBuf);
-				if( *next && ('#' != *next) ){
-					trimCtrl(next);
-				} // not blank or comment
-				if(isalpha(*next) || ('_' == *next)){
-					char *start = next++ ;
-					while(isalnum(*next) || ('_' == *next)){
-						next++ ;
-					}
-					if(isspace(*next)){
-						char *end=next-1 ;
-						next=skipSpaces(next);
-						if(isxdigit(*next)){
-							char *addrEnd ;
-							phys_addr_t addr = (phys_addr_t )strtoul(next,&addrEnd,16);
-							unsigned width = 4 ;
-							if( addrEnd && ('.' == *addrEnd) ){
-								char widthchar = tolower(addrEnd[1]);
-								if('w' == widthchar) {
-									width = 2 ;
-								} else if( 'b' == widthchar) {
-									width = 1 ;
-								} else if( 'l' == widthchar) {
-									width = 4 ;
-								}
-								else {
-									fprintf(stderr, "Invalid width char %c on line number %u\n", widthchar, lineNum);
-									continue;
-								}
-								addrEnd = addrEnd+2 ;
-							}
-							if( addrEnd && ('\0'==*addrEnd)){
-								unsigned namelen = end-start+1 ;
-								char *name = (char *)malloc(namelen+1);
-								memcpy(name,start,namelen);
-								name[namelen] = '\0' ;
-                                                                struct reglist_t *newone = new reglist_t ;
-								newone->address=addr ;
-								newone->width = width ;
-								newone->reg = new registerDescription_t ;
-								newone->reg->name = name ;
-								newone->reg->fields = newone->fields = 0 ;
-								if(tail){
-									tail->next = newone ;
-								} else
-									head = newone ;
-								tail = newone ;
-                                                                state = FT_REGISTER ;
-//								printf( "%s: 0x%08lx, width %u\n", newone->reg->name, newone->address, newone->width);
-								continue;
-							}
-							else
-								fprintf(stderr, "expecting end of addr, not %c\n", addrEnd ? *addrEnd : '?' );
-						}
-						else
-							fprintf(stderr, "expecting hex digit, not %02x\n", (unsigned char)*next );
-					}
-					fprintf(stderr, "%s: syntax error on line %u <%s>\n", filename, lineNum,next );
-				} else if((':' == *next) && (FT_UNKNOWN != state)) {
-                                        next=skipSpaces(next+1);
-					char *start = next++ ;
-					while(isalnum(*next) || ('_' == *next)){
-						next++ ;
-					}
-					unsigned nameLen = next-start ;
-					char *name = new char [nameLen+1];
-					memcpy(name,start,nameLen);
-					name[nameLen] = 0 ;
-					if( ':' == *next ){
-						struct fieldDescription_t *field = parseFields(tail,next+1);
-						if(field){
-							field->name = name ;
-							if (FT_REGISTER == state) {
-								field->next = tail->fields ;
-								tail->fields = field ;
-							} else {
-								field->next = fieldsets->fields ;
-								fieldsets->fields = field ;
-							}
-						} else 
-                                                        fprintf( stderr, "error parsing field at line %u\n", lineNum );
-					} else if (('/' == *next) && (FT_REGISTER == state)) {
-						struct fieldSet_t const *fs = fieldsets ;
-						while (fs) {
-							if (0 == strcmp(fs->name,name))
-								break;
-							fs = fs->next ;
-						}
-						if (fs) {
-							if (tail->fields) {
-                                                                struct fieldDescription_t *back = tail->fields ;
-                                                                struct fieldDescription_t *front = back ;
-								while(front) {
-									back = front ;
-									front = back->next ;
-								}
-								back->next = fs->fields ;
-							} else
-                                                                tail->fields = fs->fields ;
-							state = FT_UNKNOWN ; /* don't allow fields to be added */
-						}
-					} else {
-						fprintf( stderr, "missing field separator at line %u\n", lineNum );
-					}
-				} else if ('/' == *next) {
-					char *start = ++next ;
-					while(isalnum(*next) || ('_' == *next)){
-						next++ ;
-					}
-					if ((start < next) && (isspace(*next) || ('\0'==*next))) {
-						*next = '\0' ;
-                                                struct	fieldSet_t  *fs = (struct fieldSet_t *)malloc(sizeof(struct fieldSet_t ));
-						fs->name = strdup(start);
-						fs->fields = 0 ;
-						fs->next = fieldsets ;
-						fieldsets = fs ;
-						state = FT_FIELDSET ;
-					} else
-						fprintf(stderr,"Invalid fieldset name %s\n",start-1);
-				} else if (*next && ('#' != *next)) {
-					fprintf(stderr, "Unrecognized line <%s> at %u\n", next, lineNum );
-				}
-			}
-			fclose(fDefs);
-			regs = head ;
-		} else 
-			perror(filename);
-	}
-	return regs ;
-}
+struct scriptStep_t {
+	unsigned		 line ;
+	enum scriptOp_e		 op ;
+	struct reglist_t const	*regs ;		// read, write and poll
+	unsigned		 mask ;		// write: bits written
+	unsigned		 value ;	// write: shifted into place
+	char const		*condition ;	// poll
+	struct trigger_t	 trigger ;	// poll
+	struct sampleReg_t	 sreg ;		// poll
+	uint64_t		 ns ;		// delay, poll timeout
+	struct scriptStep_t	*next ;
+};
 
-static struct reglist_t const *parseRegisterSpec(char const *regname)
+/*
+ * Parse one line of a script into step, which keeps pointers into the
+ * text. Returns false after reporting an error.
+ */
+static bool parseScriptLine
+	( char const *path,
+	  unsigned line,
+	  char *text,
+	  struct scriptStep_t &step )
 {
-	char const c = *regname ;
-
-	if(isalpha(c) || ('_' == c)){
-                struct reglist_t *out = 0 ;
-                struct reglist_t const *defs = registerDefs();
-		char *regPart = strdup(regname);
-		char *fieldPart = strchr(regPart,'.');
-		bool widthspec = false ;
-		unsigned fieldLen = 0 ;
-
-		if (0 == fieldPart) {
-			fieldPart = strchr(regPart,':');
-			widthspec = false ;
+	char *comment = strchr(text,'#');
+	if (comment)
+		*comment = '\0' ;
+	char *next = text ;
+	char *word = nextWord(next);
+	char *arg = nextWord(next);
+	char *extra = arg ? nextWord(next) : 0 ;
+	memset(&step,0,sizeof(step));
+	step.line = line ;
+	if (0 == strcmp(word,"delay")) {
+		step.op = SCRIPT_DELAY ;
+		if (arg && !extra && (0 != (step.ns = parseDuration(arg))))
+			return true ;
+		fprintf(stderr, "%s:%u: use delay TIME, e.g. delay 10ms\n", path, line);
+		return false ;
+	}
+	if (0 == strcmp(word,"poll")) {
+		char *regname ;
+		step.op = SCRIPT_POLL ;
+		step.ns = SCRIPT_POLL_NS ;
+		if ((0 == arg) || nextWord(next)
+		    || (extra && (0 == (step.ns = parseDuration(extra))))) {
+			fprintf(stderr, "%s:%u: use poll CONDITION [TIMEOUT]\n", path, line);
+			return false ;
 		}
-		else
-			widthspec = true ;
-		if (fieldPart) {
-			*fieldPart++ = '\0' ;
-			fieldLen = strlen(fieldPart);
-		}
-		unsigned const nameLen = strlen(regname);
-		while(defs){
-                        if( 0 == strncasecmp(regPart,defs->reg->name,nameLen) ) {
-				struct reglist_t *newOne = new struct reglist_t ;
-				memcpy(newOne,defs,sizeof(*newOne));
-				if (fieldPart) {
-					newOne->fields = 0 ;
-					if (isdigit(*fieldPart)) {
-						unsigned start, count ;
-						if (parseBits(fieldPart,start,count)) {
-							fieldDescription_t *newf = new struct fieldDescription_t ;
-							newf->name = fieldPart ;
-							newf->startbit = start ;
-							newf->bitcount = count ;
-							newf->next = 0 ;
-							newOne->fields = newf ;
-						}
-						else
-							return 0 ;
-					} else {
-						fieldDescription_t *rhs = defs->fields ;
-						while (rhs) {
-							if( 0 == strcasecmp(fieldPart,rhs->name) ) {
-								fieldDescription_t *newf = new struct fieldDescription_t ;
-								memcpy(newf,rhs,sizeof(*newf));
-								newf->next = newOne->fields ;
-								newOne->fields = newf ;
-							}
-							rhs = rhs->next ;
-						}
-					} // search for named fields
-				} // only copy specified field
-				newOne->next = out ;
-				out = newOne ;
-			}
-			defs = defs->next ;
+		if (!parseTrigger(arg,step.trigger,regname)) {
+			fprintf(stderr, "%s:%u: invalid condition\n", path, line);
+			return false ;
 		}
-		free(regPart);
-		return out ;
-	} else if(isdigit(c)){
-		char *end ;
-		phys_addr_t address = (phys_addr_t)strtoul(regname,&end,16);
-		if( (0 == *end) || (':' == *end) || ('.' == *end) ){
-                        struct fieldDescription_t *field = 0 ;
-			unsigned start, count ;
-			struct reglist_t *out = 0 ;
-			struct reglist_t const *defs = registerDefs();
-			unsigned const nameLen = strlen(regname);
-			while(defs){
-				if( defs->address == address ) {
-					out = new struct reglist_t ;
-					memcpy(out,defs,sizeof(*out));
-					out->next = 0 ;
-					out->fields = field ;
-					break;
-				}
-				defs = defs->next ;
-			}
-
-			if (':' == *end) {
-				unsigned start, count ;
-				if (parseBits(end+1,start,count)) {
-					field = new struct fieldDescription_t ;
-					field->name = end+1 ;
-					field->startbit = start ;
-					field->bitcount = count ;
-					field->next = 0 ;
-				}
-			}
-			struct fieldDescription_t *fields = 0 ;
-			unsigned width = 4 ;
-			if( '.' == *end ){
-				char widthchar=tolower(end[1]);
-				if ('w' == widthchar) {
-					width = 2 ;
-				} else if ('b' == widthchar) {
-					width = 1 ;
-				} else if ('l' == widthchar) {
-					width = 4 ;
-				} else {
-					fprintf( stderr, "Invalid width char <%c>\n", widthchar);
-				}
-			}
-			if( 0 == out ){
-                                out = new struct reglist_t ;
-				out->address = address ;
-				out->width = width ;
-				out->reg = 0 ;
-				out->fields = fields ;
-				out->next = 0 ;
+		step.condition = arg ;
+		step.regs = parseRegisterSpec(regname);
+		step.sreg.address = step.regs->address ;
+		step.sreg.width = step.regs->width ;
+		return true ;
+	}
+	bool const assigns = arg && strchr(arg,'=');
+	if (extra && !assigns) {
+		fprintf(stderr, "%s:%u: unexpected '%s'\n", path, line, extra);
+		return false ;
+	}
+	step.regs = parseRegisterSpec(word);
+	if (0 == step.regs) {
+		fprintf(stderr, "%s:%u: nothing matched %s\n", path, line, word);
+		return false ;
+	}
+	step.op = SCRIPT_READ ;
+	if (0 == arg)
+		return true ;
+	step.op = SCRIPT_WRITE ;
+	if (!writableReg(word,step.regs)) {
+		fprintf(stderr, "%s:%u: invalid write\n", path, line);
+		return false ;
+	}
+	if (assigns) {
+		char const *fields[SCRIPT_FIELDS];
+		int count = 0 ;
+		for (char *f = arg ; f ; f = (f == arg) ? extra : nextWord(next)) {
+			if (SCRIPT_FIELDS == count) {
+				fprintf(stderr, "%s:%u: more than %u fields\n", path, line, SCRIPT_FIELDS);
+				return false ;
 			}
-			return out ;
-		} else {
-			fprintf( stderr, "Invalid register name or value '%s'. Use name or 0xHEX\n", regname );
+			fields[count++] = f ;
 		}
-	} else {
-		fprintf( stderr, "Invalid register name or value '%s'. Use name or 0xHEX\n", regname );
+		if (specHasField(word) || !writeFields(step.regs,count,fields,step.value,step.mask)) {
+			fprintf(stderr, "%s:%u: use REG FIELD=VALUE...\n", path, line);
+			return false ;
+		}
+		return true ;
 	}
-	return 0 ;
+	char *end ;
+	step.value = strtoul(arg,&end,16);
+	if ((end == arg) || ('\0' != *end)) {
+		fprintf(stderr, "%s:%u: invalid value '%s', use hex\n", path, line, arg);
+		return false ;
+	}
+	if (!writeBits(step.regs,specHasField(word),step.value,step.mask)) {
+		fprintf(stderr, "%s:%u: invalid write\n", path, line);
+		return false ;
+	}
+	return true ;
 }
 
-static int getFd(void){
-	static int fd = -1 ;
-	if( 0 > fd ){
-		fd = open("/dev/mem", O_RDWR | O_SYNC);
-		if (fd<0) {
-			perror("/dev/mem");
-			exit(1);
+/*
+ * Parse a script, returns its steps in order or 0 after reporting an
+ * error. count is the number of steps.
+ */
+static struct scriptStep_t *parseScript(char const *path, FILE *fIn, unsigned &count)
+{
+	struct scriptStep_t *first = 0, **tail = &first ;
+	char *inBuf = 0 ;
+	size_t inSize = 0 ;
+	unsigned line = 0 ;
+	count = 0 ;
+	/* lines of any length, rather than split into separate steps */
+	while (0 < getline(&inBuf,&inSize,fIn)) {
+		line++ ;
+		char *next = inBuf ;
+		while (isspace(*next))
+			next++ ;
+		if (('\0' == *next) || ('#' == *next))
+			continue;
+		struct scriptStep_t *step = (struct scriptStep_t *)arenaAlloc(arena,sizeof(*step));
+		char *text = (char *)arenaAlloc(arena,strlen(next)+1);
+		strcpy(text,next);
+		if (!parseScriptLine(path,line,text,*step)) {
+			free(inBuf);
+			return 0 ;
 		}
+		*tail = step ;
+		tail = &step->next ;
+		count++ ;
 	}
-	return fd ;
+	free(inBuf);
+	if (0 == first)
+		fprintf(stderr, "%s: nothing to do\n", path);
+	return first ;
 }
 
-#define MAP_SIZE 4096
-#define MAP_MASK ( MAP_SIZE - 1 )
+/*
+ * Display what a step would do, for --dry-run
+ */
+static void printStep(char const *path, struct scriptStep_t const *step)
+{
+	printf("%s:%u: ", path, step->line);
+	switch (step->op) {
+	case SCRIPT_READ: {
+		unsigned count = 0 ;
+		for (struct reglist_t const *r = step->regs ; r ; r = r->next)
+			count++ ;
+		printf("read %.*s:0x%08lx", step->regs->namelen, step->regs->name, step->regs->address);
+		if (1 < count)
+			printf(" and %u more", count-1);
+		printf("\n");
+		break;
+	}
+	case SCRIPT_WRITE:
+		printf("write %.*s:0x%08lx bits 0x%08x = 0x%08x\n",
+		       step->regs->namelen, step->regs->name, step->regs->address,
+		       step->mask, step->value);
+		break;
+	case SCRIPT_DELAY:
+		printf("delay %llu us\n", (unsigned long long)step->ns/1000);
+		break;
+	case SCRIPT_POLL:
+		printf("poll %.*s:0x%08lx for %s, up to %llu us\n",
+		       step->regs->namelen, step->regs->name, step->regs->address,
+		       step->condition, (unsigned long long)step->ns/1000);
+		break;
+	}
+}
 
-static unsigned volatile *getReg(phys_addr_t addr){
-	static void *map = 0 ;
-	static phys_addr_t prevPage = -1U ;
-	unsigned offs = addr & MAP_MASK ;
-	phys_addr_t page = addr - offs;
-	if( page != prevPage ){
-		if( map ){
-		   munmap(map,MAP_SIZE);
-		}
-		map = mmap(0, MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, getFd(), page );
-		if( MAP_FAILED == map ){
-			perror("mmap");
-			exit(1);
+/*
+ * Run a step whose registers are mapped, returns false after reporting
+ * a poll that timed out
+ */
+static bool runStep(char const *path, struct scriptStep_t const *step)
+{
+	switch (step->op) {
+	case SCRIPT_READ:
+		for (struct reglist_t const *r = step->regs ; r ; r = r->next)
+			showReg(r);
+		break;
+	case SCRIPT_WRITE:
+		writeReg(step->regs,step->mask,step->value);
+		break;
+	case SCRIPT_DELAY: {
+		struct timespec ts = { (time_t)(step->ns/1000000000), (long)(step->ns%1000000000) };
+		while ((0 != nanosleep(&ts,&ts)) && (EINTR == errno) && !sample_stop)
+			;
+		break;
+	}
+	case SCRIPT_POLL: {
+		unsigned value ;
+		if (!samplePoll(step->sreg,step->trigger,step->ns,value) && !sample_stop) {
+			fflush(stdout);
+			fprintf(stderr, "%s:%u: %s not met after %llu us, read 0x%x\n",
+				path, step->line, step->condition,
+				(unsigned long long)step->ns/1000, value);
+			return false ;
 		}
-		prevPage = page ;
+		break;
 	}
-	return (unsigned volatile *)((char *)map+offs);
+	}
+	fflush(stdout);
+	return true ;
 }
 
-static unsigned fieldVal(struct fieldDescription_t *f, unsigned v)
+/*
+ * Run a script from path, or stdin if path is "-". Returns 0 if every
+ * step ran, otherwise stops at the first that failed.
+ */
+static int runScript(char const *path)
 {
-	v >>= f->startbit ;
-	v &= (1<<f->bitcount)-1 ;
-	return v ;
+	FILE *fIn = strcmp(path,"-") ? fopen(path, "r") : stdin ;
+	if (0 == fIn) {
+		perror(path);
+		return 1 ;
+	}
+	if (stdin == fIn)
+		path = "stdin" ;
+	unsigned count ;
+	struct scriptStep_t *steps = parseScript(path,fIn,count);
+	if (stdin != fIn)
+		fclose(fIn);
+	if (0 == steps)
+		return 1 ;
+	if (dry_run) {
+		for (struct scriptStep_t const *step = steps ; step ; step = step->next)
+			printStep(path,step);
+		return 0 ;
+	}
+
+	/* map everything the script touches up front */
+	unsigned naddrs = 0 ;
+	for (struct scriptStep_t const *step = steps ; step ; step = step->next) {
+		for (struct reglist_t const *r = step->regs ; r ; r = r->next)
+			naddrs++ ;
+	}
+	phys_addr_t *addrs = (phys_addr_t *)arenaAlloc(arena,(naddrs+1)*sizeof(addrs[0]));
+	naddrs = 0 ;
+	for (struct scriptStep_t const *step = steps ; step ; step = step->next) {
+		for (struct reglist_t const *r = step->regs ; r ; r = r->next)
+			addrs[naddrs++] = r->address ;
+	}
+	physmemPlan(addrs,naddrs);
+	for (struct scriptStep_t *step = steps ; step ; step = step->next) {
+		if (SCRIPT_POLL == step->op)
+			samplePrepare(&step->sreg,1);
+	}
+
+	sampleStopOnSignal();
+	for (struct scriptStep_t const *step = steps ; step && !sample_stop ; step = step->next) {
+		if (!runStep(path,step))
+			return 1 ;
+	}
+	fflush(stdout);
+	if (sample_stop) {
+		fprintf(stderr, "%s: interrupted\n", path);
+		return 1 ;
+	}
+	return 0 ;
 }
 
-#define RED	"\e[0;31m"
-#define GREEN	"\e[1;32m"
-#define BLUE	"\e[1;34m"
-#define YELLOW	"\e[1;33m"
-#define CYAN	"\e[0;36m"
-#define RST	"\e[1;0m"
-#define COL(_color)	(stdout_tty && fancy_color_mode ? _color : "")
+static char const *const replCommands[] = {
+	"delay", "poll", "help", "quit"
+};
 
-static void showReg(struct reglist_t const *reg)
+/*
+ * Tab completion for the interactive mode: register names from the
+ * sorted name index, the fields of a register after REG., and commands
+ */
+static unsigned completeName
+	( char const *word,
+	  unsigned len,
+	  unsigned &stem,
+	  struct lineMatch_t *matches,
+	  unsigned max )
 {
-	unsigned rv ; 
-        unsigned volatile *regPtr = getReg(reg->address);
-	if( 2 == reg->width ) {
-		unsigned short volatile *p = (unsigned short volatile *)regPtr ;
-		rv = *p ;
-		printf( "%s:0x%08lx\t=0x%04x\n", reg->reg ? reg->reg->name : "", reg->address, rv );
-	} else if( 4 == reg->width ) {
-		unsigned volatile *p = regPtr ;
-		rv = *p ;
-		printf( "%s:0x%08lx\t=0x%08x\n", reg->reg ? reg->reg->name : "", reg->address, rv );
-	} else if( 1 == reg->width ) {
-		unsigned char volatile *p = (unsigned char volatile *)regPtr ;
-		rv = *p ;
-		printf( "%s:0x%08lx\t=0x%02x\n", reg->reg ? reg->reg->name : "", reg->address, rv );
+	struct regdb_t const *defs = registerDefs();
+	unsigned count = 0 ;
+	char const *dot = (char const *)memchr(word,'.',len);
+	if (dot) {
+		unsigned slot = ~0U ;
+		int const idx = regdbFindName(*defs,word,dot-word,slot);
+		if (0 > idx)
+			return 0 ;
+		loadFields(defs,idx);
+		stem = dot+1-word ;
+		unsigned const flen = len-stem ;
+		struct regdb_reg_t const &r = defs->regs[idx];
+		struct regdb_field_t const *f = defs->fields+r.field_first ;
+		for (unsigned i = 0 ; i < r.field_count ; i++, f++) {
+			if ((f->namelen < flen) || strncasecmp(defs->strings+f->name,dot+1,flen))
+				continue;
+			if (count < max) {
+				matches[count].text = defs->strings+f->name ;
+				matches[count].len = f->namelen ;
+			}
+			count++ ;
+		}
+		return count ;
 	}
-	else {
-		fprintf(stderr, "Unsupported width in register %s\n", reg->reg->name);
-		return ;
+	stem = 0 ;
+	for (unsigned i = 0 ; i < sizeof(replCommands)/sizeof(replCommands[0]) ; i++) {
+		if (strncasecmp(replCommands[i],word,len))
+			continue;
+		if (count < max) {
+			matches[count].text = replCommands[i];
+			matches[count].len = strlen(replCommands[i]);
+		}
+		count++ ;
 	}
-	fflush(stdout);
-	struct fieldDescription_t *f = reg->fields ;
-	while(f){
-		printf("\t%s%-16s%s", COL(CYAN), f->name, COL(RST));
-		printf("\t%s%2u-%2u%s", COL(BLUE),  f->startbit, f->startbit+f->bitcount-1, COL(RST));
-		printf("\t=%s0x%x%s",  fieldVal(f,rv) ? COL(YELLOW) : "", fieldVal(f,rv), COL(RST));
-		if (fancy_color_mode) {
-			int len = f->bitcount;
-			unsigned b = fieldVal(f,rv);
-			printf("\t");
-			while (--len >= 0) {
-				if ((b >> len) & 1)
-					printf("%s%u%s", COL(GREEN), 1, COL(RST));
-				else
-					printf("%s%u%s", COL(RED), 0, COL(RST));
-			}
+	unsigned first, last ;
+	regdbPrefixRange(*defs,word,len,first,last);
+	for (unsigned i = first ; i < last ; i++, count++) {
+		if (count < max) {
+			struct regdb_reg_t const &r = defs->regs[defs->name_index[i]];
+			matches[count].text = defs->strings+r.name ;
+			matches[count].len = r.namelen ;
 		}
-		printf("\n");
-		fflush(stdout);
-		f=f->next ;
 	}
+	return count ;
 }
 
-static void putReg(struct reglist_t const *reg,unsigned value){
-	unsigned shift = 0 ;
-	unsigned mask = 0xffffffff ;
-	if (reg->fields) {
-		// Only single field allowed
-		if (0 == reg->fields->next) {
-			shift = reg->fields->startbit ;
-			mask = ((1<<reg->fields->bitcount)-1)<<shift ;
-		} else {
-			fprintf(stderr, "More than one field matched %s\n", reg->reg->name);
-			return ;
+/*
+ * Interactive mode: the lines of a script, one at a time, with the
+ * database, its indexes and the page mappings kept between them
+ */
+static int interactive(void)
+{
+	regdbIndexNames(regdb,arena);
+	char const *home = getenv("HOME");
+	char *history = 0 ;
+	if (home) {
+		history = (char *)arenaAlloc(arena,strlen(home)+sizeof("/.devregs_history"));
+		sprintf(history, "%s/.devregs_history", home);
+	}
+	lineInit(history,completeName);
+	sampleStopOnSignal();
+	/* each command's allocations go once it is done, the indexes are built */
+	struct arenaMark_t mark ;
+	arenaMark(arena,mark);
+	unsigned line = 0 ;
+	char const *text ;
+	while (0 != (text = lineRead("devregs> "))) {
+		arenaRelease(arena,mark);
+		line++ ;
+		char command[16];
+		if ((1 != sscanf(text," %15s",command)) || ('#' == command[0]))
+			continue;
+		if (!strcmp(command,"quit") || !strcmp(command,"exit"))
+			break ;
+		if (!strcmp(command,"help")) {
+			printf("REG[.FIELD]            display\n"
+			       "REG[.FIELD] VALUE      write\n"
+			       "REG FIELD=VALUE...     write fields at once\n"
+			       "delay TIME             wait\n"
+			       "poll CONDITION [TIME]  wait up to TIME (1s) for a --trigger CONDITION\n"
+			       "quit                   leave (or ^D)\n");
+			continue;
 		}
+		char *copy = (char *)arenaAlloc(arena,strlen(text)+1);
+		strcpy(copy,text);
+		struct scriptStep_t step ;
+		if (!parseScriptLine("devregs",line,copy,step))
+			continue;
+		if (SCRIPT_POLL == step.op)
+			samplePrepare(&step.sreg,1);
+		sample_stop = 0 ;
+		runStep("devregs",&step);
+		if (stats_mode)
+			physmemPrintStats(stderr);
 	}
-	unsigned maxValue = mask >> shift ;
-	if (value > maxValue) {
-		fprintf(stderr, "Value 0x%x exceeds max 0x%x for register %s\n", value, maxValue, reg->reg->name);
-		return ;
+	lineFinish();
+	return 0 ;
+}
+
+/*
+ * Thin client of a daemon (--connect): the registers given, by exact
+ * name (REG or REG.FIELD) or address, are displayed with all of the
+ * requests sent before any reply is read, or a register and a value
+ * are written as on the command line. With --snapshot FILE the daemon
+ * takes a snapshot into FILE, and with --stats it reports its latency
+ * counters.
+ */
+static int connectRegs(char const *path, int count, char const **args)
+{
+	int const fd = serverConnect(path);
+	if (0 > fd)
+		return 1 ;
+	struct serverBuf_t buf = { 0, 0, 0 };
+	unsigned requests = 0 ;
+	/* REG=VALUE writes, anything else reads */
+	bool *writes = (bool *)arenaAlloc(arena,count*sizeof(writes[0]));
+	for (int i = 0 ; i < count ; i++) {
+		char *name = (char *)arenaAlloc(arena,strlen(args[i])+1);
+		strcpy(name,args[i]);
+		char *eq = strchr(name,'=');
+		char *end ;
+		uint32_t value = 0 ;
+		writes[i] = (0 != eq);
+		if (eq) {
+			*eq++ = '\0' ;
+			value = strtoul(eq,&end,16);
+			if ((end == eq) || ('\0' != *end)) {
+				fprintf(stderr, "Invalid value '%s', use hex\n", eq);
+				return 1 ;
+			}
+		}
+		uint64_t address = 0 ;
+		if (isdigit(*name)) {
+			address = strtoull(name,&end,16);
+			if ('\0' != *end) {
+				fprintf(stderr, "Invalid address '%s', use 0xADDRESS\n", name);
+				return 1 ;
+			}
+			name = 0 ;
+		}
+		serverRequest(buf,writes[i] ? SERVER_WRITE : SERVER_DECODE,name,address,value,0,requests++);
 	}
-	if( 1 == reg->width ){
-		unsigned char volatile * const rv = (unsigned char volatile *)getReg(reg->address);
-		value = (*rv&~mask) | ((value<<shift)&mask);
-		printf( "%s:0x%08lx == 0x%02x...", reg->reg ? reg->reg->name : "", reg->address, *rv );
-		*rv = value ;
-	} else if( 2 == reg->width ){
-		unsigned short volatile * const rv = (unsigned short volatile *)getReg(reg->address);
-		value = (*rv&~mask) | ((value<<shift)&mask);
-		printf( "%s:0x%08lx == 0x%04x...", reg->reg ? reg->reg->name : "", reg->address, *rv );
-		*rv = value ;
-	} else {
-		unsigned volatile * const rv = getReg(reg->address);
-		value = (*rv&~mask) | ((value<<shift)&mask);
-		printf( "%s:0x%08lx == 0x%08x...", reg->reg ? reg->reg->name : "", reg->address, *rv );
-		*rv = value ;
+	if (snapshot_path)
+		serverRequest(buf,SERVER_SNAPSHOT,0,0,0,0,requests++);
+	if (stats_mode)
+		serverRequest(buf,SERVER_STATS,0,0,0,0,requests++);
+	if (!serverSend(fd,buf)) {
+		perror(path);
+		return 1 ;
 	}
-	printf( "0x%08x\n", value );
+
+	int rc = 0 ;
+	for (unsigned tag = 0 ; tag < requests ; tag++) {
+		struct serverReply_t reply ;
+		uint8_t const *data ;
+		if (!serverReceive(fd,reply,data)) {
+			fprintf(stderr, "%s: connection closed\n", path);
+			return 1 ;
+		}
+		if (reply.status) {
+			fprintf(stderr, "%s: %s\n", (tag < (unsigned)count) ? args[tag] : path,
+				strerror(-reply.status));
+			rc = 1 ;
+			continue;
+		}
+		char const *name = (char const *)data ;
+		if (tag >= (unsigned)count) {
+			if (snapshot_path && (tag == (unsigned)count)) {
+				FILE *fOut = fopen(snapshot_path, "wb");
+				if ((0 == fOut) || (1 != fwrite(data,reply.length,1,fOut))
+				    || (0 != fclose(fOut))) {
+					perror(snapshot_path);
+					rc = 1 ;
+				} else
+					printf("%s: %u registers\n", snapshot_path,
+					       ((struct snapshot_header_t const *)data)->reg_count);
+			} else
+				serverPrintStats(stdout,(struct serverStats_t const *)data);
+		} else if (writes[tag]) {
+			printf("%.*s:0x%08lx == 0x%0*x...0x%08x\n", reply.namelen, name,
+			       (unsigned long)reply.address, 2*reply.width, reply.old, reply.value);
+		} else {
+			printValue(name,reply.namelen,reply.address,reply.width,reply.value);
+			uint8_t const *next = data+reply.namelen ;
+			uint8_t const *last = data+reply.length ;
+			while (next + sizeof(struct serverField_t) <= last) {
+				struct serverField_t f ;
+				memcpy(&f,next,sizeof(f));
+				next += sizeof(f);
+				showField((char const *)next,f.namelen,f.startbit,f.bitcount,reply.value);
+				next += f.namelen ;
+			}
+		}
+	}
+	fflush(stdout);
+	close(fd);
+	return rc ;
 }
 
 static void printUsage(void) {
-	printf("Usage: devregs [-w] [-c CPUNAME]\n");
+	printf("Usage: devregs [-w] [-c CPUNAME] [--stats] [--backend BACKEND]\n");
+	printf("       devregs [-c CPUNAME] register field=value...\n");
+	printf("       devregs [-c CPUNAME] --compile [in.dat out.db]\n");
+	printf("       devregs [-c CPUNAME] --snapshot FILE [register]\n");
+	printf("       devregs --show-snapshot FILE\n");
+	printf("       devregs [-c CPUNAME] --diff FILE [OTHER]\n");
+	printf("       devregs [-c CPUNAME] --watch register[.field]... [--duration TIME]\n");
+	printf("       devregs [-c CPUNAME] --trigger CONDITION [--pre N] [--post N] [register...]\n");
+	printf("       devregs [-c CPUNAME] --histogram register[.field] [--duration TIME]\n");
+	printf("       devregs [-c CPUNAME] --trace FILE register[.field]... [--group SPEC]... [--duration TIME]\n");
+	printf("       devregs --show-trace FILE\n");
+	printf("       devregs [-c CPUNAME] [--dry-run] -s SCRIPT\n");
+	printf("       devregs [-c CPUNAME] -i\n");
+	printf("       devregs [-c CPUNAME] --serve SOCKET\n");
+	printf("       devregs --connect SOCKET [--snapshot FILE] [--stats] [register[.field][=value]]...\n");
 	puts("  -w   Using word access\n"
+		 "  -s SCRIPT  run the reads, writes, delays and polls in SCRIPT (- for stdin),\n"
+		 "             one per line:\n"
+			"\tREG[.FIELD]                display\n"
+			"\tREG[.FIELD] VALUE          write\n"
+			"\tREG FIELD=VALUE...         write fields at once\n"
+			"\tdelay TIME                 wait\n"
+			"\tpoll CONDITION [TIMEOUT]   wait up to TIMEOUT (1s) for a --trigger CONDITION\n"
+		 "  --dry-run  with -s, check the script and show what it would do\n"
+		 "  -i   interactive mode, taking the lines of a script with history and\n"
+		 "       tab completion of register and field names\n"
+		 "  --serve SOCKET  serve reads, writes, decodes and snapshots on a Unix socket\n"
+		 "  --connect SOCKET  read registers, or write those given as REG=VALUE, by exact\n"
+		 "             name or address through a daemon, with --snapshot FILE and\n"
+		 "             --stats for its latency counters\n"
 		 "  -f fancy color mode (-ff to force, for e.g. pipe to less -r)\n"
 		 "  -c CPUNAME in case the revision is not readable in /proc/cpuinfo fixit manually with :\n"
 			"\timx8mm\n"
@@ -634,10 +2726,70 @@ static void printUsage(void) {
 			"\timx6q\n"
 			"\timx6dls\n"
 			"\timx53\n"
+		 "  --compile  write a compiled database (by default next to the .dat file)\n"
+		 "  --stats    report how many pages were mapped\n"
+		 "  --backend  where registers are read and written:\n"
+			"\tdevmem             /dev/mem (default)\n"
+			"\tfile:PATH[@BASE]   file PATH simulates memory at physical address BASE\n"
+			"\tmemfd:SIZE[@BASE]  SIZE bytes of zeroed memory at BASE\n"
+			"\tsim:MODEL          simulated bus with the latencies given in file MODEL\n"
+		 "  --snapshot FILE  read all (or the matching) registers into binary FILE\n"
+		 "  --show-snapshot FILE  decode a snapshot\n"
+		 "  --diff FILE [OTHER]  compare a snapshot with OTHER, or with the registers now\n"
+		 "  --watch    display registers (or fields) as they change, until ^C or --duration\n"
+		 "  --trigger  sample until register[.field] meets a condition, then display\n"
+		 "             the samples around it. CONDITION is register[.field] and one of\n"
+			"\t=V     equals V\n"
+			"\t!=V    doesn't equal V\n"
+			"\t&M=V   the bits in mask M equal V\n"
+			"\t=>V    becomes V (an edge)\n"
+			"\t~      changes\n"
+		 "  --pre N, --post N  samples to keep before and after the trigger (100)\n"
+		 "  --histogram  count the values a register or field takes while sampled\n"
+		 "  --duration TIME  sample for TIME (e.g. 5s, 200ms) rather than until ^C\n"
+		 "  --trace FILE  record every change of the registers (or fields) to binary FILE\n"
+		 "  --show-trace FILE  display a trace\n"
+		 "  --period TIME  start a sampling pass every TIME rather than flat out,\n"
+		 "             and report the intervals achieved\n"
+		 "  --rt-priority N  sample SCHED_FIFO at priority N, with memory locked\n"
+		 "  --affinity CPU  sample on CPU number CPU, with memory locked\n"
+		 "  --group 'SETTINGS register[.field]...'  with --trace, sample more registers\n"
+		 "             in a thread of their own, with SETTINGS of:\n"
+			"\tperiod=TIME  as --period\n"
+			"\tcpu=N        as --affinity\n"
+			"\tpriority=N   as --rt-priority\n"
+		 "             --period, --affinity and --rt-priority apply to the other registers\n"
 		 );
 	exit(1);
 }
 
+/*
+ * Value of an option such as --backend SPEC, which is pulled from the
+ * argument list along with the option
+ */
+static char const *optionValue(char const **argv, int arg, unsigned &skip)
+{
+	char const *value = argv[arg + skip];
+	if (!value) {
+		fprintf(stderr,"Do not forget to specify a value for %s\n", argv[arg]);
+		printUsage();
+	}
+	skip++;
+	return value ;
+}
+
+static unsigned optionNumber(char const **argv, int arg, unsigned &skip)
+{
+	char const *value = optionValue(argv,arg,skip);
+	char *end ;
+	unsigned long n = strtoul(value,&end,0);
+	if ((end == value) || ('\0' != *end)) {
+		fprintf(stderr,"Invalid number '%s' for %s\n", value, argv[arg]);
+		printUsage();
+	}
+	return n ;
+}
+
 static void parseArgs( int &argc, char const **argv )
 {
 	int arg = 1;
@@ -646,7 +2798,74 @@ static void parseArgs( int &argc, char const **argv )
 		char const *p = argv[arg];
 		if ('-' == *p++ ) {
 			unsigned skip = 1;
-			if ('w' == tolower(*p)) {
+			if ('-' == *p) {
+				if (!strcmp(p, "-compile")) {
+					compile_mode = true ;
+				} else if (!strcmp(p, "-stats")) {
+					stats_mode = true ;
+				} else if (!strcmp(p, "-backend")) {
+					backend_spec = optionValue(argv,arg,skip);
+				} else if (!strcmp(p, "-snapshot")) {
+					snapshot_path = optionValue(argv,arg,skip);
+				} else if (!strcmp(p, "-show-snapshot")) {
+					show_snapshot_path = optionValue(argv,arg,skip);
+				} else if (!strcmp(p, "-diff")) {
+					diff_path = optionValue(argv,arg,skip);
+				} else if (!strcmp(p, "-watch")) {
+					watch_mode = true ;
+				} else if (!strcmp(p, "-trigger")) {
+					trigger_spec = optionValue(argv,arg,skip);
+				} else if (!strcmp(p, "-pre")) {
+					trigger_pre = optionNumber(argv,arg,skip);
+				} else if (!strcmp(p, "-post")) {
+					trigger_post = optionNumber(argv,arg,skip);
+				} else if (!strcmp(p, "-trace")) {
+					trace_path = optionValue(argv,arg,skip);
+				} else if (!strcmp(p, "-show-trace")) {
+					show_trace_path = optionValue(argv,arg,skip);
+				} else if (!strcmp(p, "-histogram")) {
+					histogram_spec = optionValue(argv,arg,skip);
+				} else if (!strcmp(p, "-period")) {
+					char const *value = optionValue(argv,arg,skip);
+					period_ns = parseDuration(value);
+					if (0 == period_ns) {
+						fprintf(stderr,"Invalid period '%s', use e.g. 100us or 1ms\n", value);
+						printUsage();
+					}
+				} else if (!strcmp(p, "-rt-priority")) {
+					rt_priority = optionNumber(argv,arg,skip);
+					if ((rt_priority < sched_get_priority_min(SCHED_FIFO))
+					    || (rt_priority > sched_get_priority_max(SCHED_FIFO))) {
+						fprintf(stderr,"Invalid SCHED_FIFO priority %d\n", rt_priority);
+						printUsage();
+					}
+				} else if (!strcmp(p, "-affinity")) {
+					affinity = optionNumber(argv,arg,skip);
+				} else if (!strcmp(p, "-serve")) {
+					serve_path = optionValue(argv,arg,skip);
+				} else if (!strcmp(p, "-connect")) {
+					connect_path = optionValue(argv,arg,skip);
+				} else if (!strcmp(p, "-dry-run")) {
+					dry_run = true ;
+				} else if (!strcmp(p, "-group")) {
+					group_specs = (char const **)realloc(group_specs,(group_count+1)*sizeof(group_specs[0]));
+					group_specs[group_count++] = optionValue(argv,arg,skip);
+				} else if (!strcmp(p, "-duration")) {
+					char const *value = optionValue(argv,arg,skip);
+					duration_ns = parseDuration(value);
+					if (0 == duration_ns) {
+						fprintf(stderr,"Invalid duration '%s', use e.g. 5s or 200ms\n", value);
+						printUsage();
+					}
+				} else {
+					printf( "unknown option %s\n", argv[arg]);
+					printUsage();
+				}
+			} else if ('i' == tolower(*p)) {
+				interactive_mode = true ;
+			} else if ('s' == tolower(*p)) {
+				script_path = optionValue(argv,arg,skip);
+			} else if ('w' == tolower(*p)) {
 				word_access = true ;
 				printf("Using word access\n" );
 			} else if ('f' == tolower(*p)) {
@@ -783,6 +3002,18 @@ int main(int argc, char const **argv)
 	unsigned parse_arguments = 1;
 
 	parseArgs(argc,argv);
+	if (connect_path)
+		return connectRegs(connect_path,argc-1,argv+1);
+	if (backend_spec && !physmemSelect(backend_spec))
+		return -1 ;
+	if (compile_mode && (3 == argc))
+		return compileDatabase(argv[1],argv[2]);
+	if (show_snapshot_path)
+		return showSnapshot(show_snapshot_path);
+	if (show_trace_path)
+		return showTrace(show_trace_path);
+	if (diff_path && (2 == argc))
+		return diffSnapshot(diff_path,argv[1]);
 	if (!cpu_in_params && !getcpu(cpu, "/sys/devices/soc0/soc_id") &&
 	    !getcpu(cpu, "/proc/cpuinfo")) {
 		fprintf(stderr, "Error reading CPU type\n");
@@ -792,16 +3023,84 @@ int main(int argc, char const **argv)
 	if (cpu_in_params)
 		cpu = cpu_in_params;
 	//printf( "CPU type is 0x%x\n", cpu);
-	registerDefs(cpu);
-	if( 1 == argc ){
-                struct reglist_t const *defs = registerDefs();
-		while(defs){
-                        showReg(defs);
-			defs = defs->next ;
+	if (compile_mode) {
+		if (1 != argc)
+			printUsage();
+		char const *filename = getDataPath(cpu);
+		char *dbname = getDbPath(filename);
+		return compileDatabase(filename,dbname);
+	}
+	if (diff_path) {
+		if (1 != argc)
+			printUsage();
+		return diffSnapshot(diff_path,0,cpu);
+	}
+	if (watch_mode) {
+		if (2 > argc)
+			printUsage();
+		registerDefs(cpu,true);
+		return finishSampling(watchRegs(argc-1,argv+1));
+	}
+	if (script_path) {
+		if (1 != argc)
+			printUsage();
+		registerDefs(cpu,false);
+		int const rc = runScript(script_path);
+		if (stats_mode)
+			physmemPrintStats(stderr);
+		return rc ;
+	}
+	if (serve_path) {
+		if (1 != argc)
+			printUsage();
+		/* every field up front, loading them isn't thread-safe */
+		return serverRun(serve_path,registerDefs(cpu,false),cpu);
+	}
+	if (interactive_mode) {
+		if (1 != argc)
+			printUsage();
+		registerDefs(cpu,false);
+		return interactive();
+	}
+	if (group_count && !trace_path) {
+		fprintf(stderr, "--group is only for --trace\n");
+		printUsage();
+	}
+	if (trace_path) {
+		if ((2 > argc) && (0 == group_count))
+			printUsage();
+		registerDefs(cpu,true);
+		return finishSampling(traceRegs(cpu,argc-1,argv+1));
+	}
+	if (histogram_spec) {
+		if (1 != argc)
+			printUsage();
+		registerDefs(cpu,true);
+		return finishSampling(histogram(histogram_spec));
+	}
+	if (trigger_spec) {
+		registerDefs(cpu,true);
+		return finishSampling(triggerCapture(argc-1,argv+1));
+	}
+	if (snapshot_path) {
+		struct reglist_t const *regs = 0 ;
+		if (2 < argc)
+			printUsage();
+		registerDefs(cpu,true);
+		if ((2 == argc) && (0 == (regs = parseRegisterSpec(argv[1])))) {
+			fprintf (stderr, "Nothing matched %s\n", argv[1]);
+			return 1 ;
 		}
+		return takeSnapshot(snapshot_path,cpu,registerDefs(),regs);
+	}
+	/* a full dump needs every field, otherwise only load what's selected */
+	registerDefs(cpu,1 != argc);
+	if( 1 == argc ){
+		dumpRegs(registerDefs());
 	} else {
                 struct reglist_t const *regs = parseRegisterSpec(argv[parse_arguments]);
 		if( regs ){
+			planRegs(regs);
 			if( 2 == (argc-parse_arguments+1) ){
 				while( regs ){
 					showReg(regs);
@@ -810,17 +3109,27 @@ int main(int argc, char const **argv)
 			} else {
 				char *end ;
 				unsigned value = strtoul(argv[1+parse_arguments],&end,16);
-				if( '\0' == *end ){
-					while( regs ){
-						showReg(regs);
-						putReg(regs,value);
-						regs = regs->next ;
+				if( !writableReg(argv[parse_arguments],regs) ){
+					return 1 ;
+				} else if( strchr(argv[1+parse_arguments],'=') ){
+					if( specHasField(argv[parse_arguments]) ){
+						fprintf( stderr, "Use REG FIELD=VALUE..., not with a field of REG\n" );
+						return 1 ;
 					}
+					/* one read, shown by writeReg(), so nothing clears on read before it */
+					unsigned mask ;
+					if( writeFields(regs,argc-parse_arguments-1,argv+parse_arguments+1,value,mask) )
+						writeReg(regs,mask,value);
+				} else if( '\0' == *end ){
+					showReg(regs);
+					putReg(regs,specHasField(argv[parse_arguments]),value);
 				} else 
 					fprintf( stderr, "Invalid value '%s', use hex\n", argv[1+parse_arguments] );
 			}
 		} else
 			fprintf (stderr, "Nothing matched %s\n", argv[parse_arguments]);
 	}
+	if (stats_mode)
+		physmemPrintStats(stderr);
 	return 1;
 }
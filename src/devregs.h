@@ -0,0 +1,579 @@
+/*
+ * devregs.h - declarations shared between the devregs source files
+ *
+ * (c) Copyright 2010 by Boundary Devices under GPLv2
+ *
+ */
+#ifndef __DEVREGS_H__
+#define __DEVREGS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+typedef off_t phys_addr_t;
+
+/*
+ * Bump allocator, see arena.cpp
+ */
+struct arena_t {
+	struct arenaBlock_t	*block ;	// current block, 0 if none yet
+};
+
+/* where an arena was, to release what was allocated since */
+struct arenaMark_t {
+	struct arenaBlock_t	*block ;
+	size_t			 used ;
+};
+
+/* arena.cpp */
+void arenaReserve(struct arena_t &arena, size_t size);
+void *arenaAlloc(struct arena_t &arena, size_t size);
+void *arenaGrow(struct arena_t &arena, void *mem, size_t oldsize, size_t newsize);
+void arenaFree(struct arena_t &arena);
+void arenaMark(struct arena_t const &arena, struct arenaMark_t &mark);
+void arenaRelease(struct arena_t &arena, struct arenaMark_t const &mark);
+
+/*
+ * Register database tables.
+ *
+ * The same record layout is used whether the database was parsed from
+ * a text .dat file or mapped from a compiled .db file, so the records
+ * are fixed-size and position-independent: names are stored as offset
+ * and length into a string pool and a register's fields are a range
+ * of the field table. Registers using the same fieldset share its
+ * range.
+ */
+struct regdb_reg_t {
+	uint64_t	address ;
+	uint32_t	name ;		// offset into string pool
+	uint16_t	namelen ;
+	uint16_t	width ;		// # bytes in register
+	uint32_t	field_first ;	// index into field table
+	uint32_t	field_count ;
+};
+
+struct regdb_field_t {
+	uint32_t	name ;		// offset into string pool
+	uint16_t	namelen ;
+	uint8_t		startbit ;
+	uint8_t		bitcount ;
+};
+
+struct regdb_suffix_t {
+	uint32_t	reg ;		// register index
+	uint32_t	offset ;	// into register name
+};
+
+struct regdb_t {
+	struct regdb_reg_t const	*regs ;
+	unsigned			 reg_count ;
+	struct regdb_field_t const	*fields ;
+	unsigned			 field_count ;
+	char const			*strings ;
+	unsigned			 string_size ;
+	uint32_t const			*name_hash ;	// register index+1 by name, 0 if empty
+	unsigned			 name_hash_size ;	// power of 2
+	uint32_t const			*addr_index ;	// register indexes by address
+	uint32_t const			*name_index ;	// register indexes by name
+	struct regdb_suffix_t const	*suffixes ;	// name suffixes, sorted
+	unsigned			 suffix_count ;
+};
+
+/*
+ * Compiled database file layout:
+ *
+ *	regdb_header_t
+ *	regdb_section_t[section_count]
+ *	section data, each 8-byte aligned
+ *
+ * Values are in the byte order of the host that compiled the database,
+ * which is used in place and not converted: byte_order tells a reader
+ * on a host of the other order to fall back to the .dat file. Readers
+ * ignore section types they don't know about, so indexes can be added
+ * without a version bump.
+ */
+#define REGDB_MAGIC	"DEVREGDB"
+#define REGDB_VERSION	2
+#define REGDB_BYTE_ORDER 0x01020304	// as stored by the host
+
+enum regdbSection_e {
+	REGDB_REGS	= 1,
+	REGDB_FIELDS	= 2,
+	REGDB_STRINGS	= 3,
+	REGDB_NAMEHASH	= 4,
+	REGDB_ADDRINDEX	= 5,
+	REGDB_NAMEINDEX	= 6,
+	REGDB_SUFFIXES	= 7
+};
+
+struct regdb_header_t {
+	char		magic[8];
+	uint32_t	byte_order ;	// REGDB_BYTE_ORDER
+	uint32_t	version ;
+	uint32_t	section_count ;
+	uint32_t	reserved ;
+	uint64_t	src_size ;	// of the .dat file compiled
+	int64_t		src_mtime ;
+	uint64_t	src_hash ;
+};
+
+struct regdb_section_t {
+	uint32_t	type ;
+	uint32_t	count ;		// # of records
+	uint32_t	offset ;	// from start of file
+	uint32_t	size ;		// in bytes
+};
+
+/*
+ * Databases compiled into the program by scripts/dat2cpp.py when
+ * configured --with-builtin-db, found by the name of their .dat file
+ */
+struct regdb_builtin_t {
+	char const		*datfile ;	// e.g. "devregs_imx6q.dat"
+	struct regdb_t		 db ;
+};
+
+#ifdef BUILTIN_DB
+extern struct regdb_builtin_t const regdb_builtin[];
+extern unsigned const regdb_builtin_count ;
+#endif
+
+/*
+ * Snapshot file layout:
+ *
+ *	snapshot_header_t
+ *	snapshot_reg_t[reg_count]
+ *	uint32_t values[reg_count]
+ *
+ * Values are kept in an array of their own so a capture is a single
+ * pass of reads into it, and so two captures of the same registers can
+ * be compared word by word. Values are in the byte order of the host
+ * that took the snapshot, as byte_order shows.
+ */
+#define SNAPSHOT_MAGIC		"DEVREGSN"
+#define SNAPSHOT_VERSION	2
+#define SNAPSHOT_BYTE_ORDER	0x01020304	// as stored by the host
+
+struct snapshot_header_t {
+	char		magic[8];
+	uint32_t	version ;
+	uint32_t	cpu ;		// as detected or given with -c
+	uint64_t	db_hash ;	// regdbRegsHash() of the database used
+	int64_t		time_ns ;	// CLOCK_REALTIME at the start of capture
+	uint64_t	capture_ns ;	// time taken by the reads
+	uint32_t	reg_count ;
+	uint32_t	byte_order ;	// SNAPSHOT_BYTE_ORDER
+};
+
+struct snapshot_reg_t {
+	uint64_t	address ;
+	uint32_t	width ;
+	uint32_t	reg ;		// database index, SNAPSHOT_NOREG if not in it
+};
+
+#define SNAPSHOT_NOREG	0xffffffff
+
+struct snapshot_t {
+	struct snapshot_header_t const	*header ;
+	struct snapshot_reg_t const	*regs ;
+	uint32_t const			*values ;
+};
+
+/* snapshot.cpp */
+bool snapshotWrite
+	( char const *path,
+	  struct snapshot_header_t const &header,
+	  struct snapshot_reg_t const *regs,
+	  uint32_t const *values );
+bool snapshotOpen(char const *path, struct snapshot_t &snap);
+unsigned snapshotChanges
+	( uint32_t const *a,
+	  uint32_t const *b,
+	  unsigned count,
+	  uint32_t *changed );
+bool snapshotAlign
+	( struct snapshot_t const &a,
+	  struct snapshot_t const &b,
+	  uint32_t *values,
+	  uint32_t *match );
+
+/* physmem.cpp */
+struct physmemStats_t {
+	unsigned long	maps ;		// mmap() calls
+	unsigned long	unmaps ;	// munmap() calls
+	unsigned long	hits ;		// accesses to a page already mapped
+	unsigned long	regions ;	// planned regions mapped
+};
+
+/*
+ * Register access backend. map() returns MAP_FAILED on failure, and
+ * read() and write() access a register of width bytes at ptr, the
+ * mapped address of addr. report(), if any, adds to --stats.
+ */
+struct physmemBackend_t {
+	char const	*name ;
+	void		*(*map)(phys_addr_t start, size_t len);
+	void		 (*unmap)(void *map, size_t len);
+	unsigned	 (*read)(void volatile *ptr, phys_addr_t addr, unsigned width);
+	void		 (*write)(void volatile *ptr, phys_addr_t addr, unsigned width, unsigned value);
+	void		 (*report)(FILE *f);
+};
+
+bool physmemSelect(char const *spec);
+struct physmemBackend_t const *physmemBackend(void);
+void physmemPlan(phys_addr_t *addrs, unsigned count);
+void volatile *physMap(phys_addr_t addr);
+void volatile *physRegion(phys_addr_t addr);
+unsigned physRead(phys_addr_t addr, unsigned width);
+void physWrite(phys_addr_t addr, unsigned width, unsigned value);
+struct physmemStats_t const &physmemStats(void);
+void physmemPrintStats(FILE *f);
+
+/*
+ * A register being sampled, resolved to its mapping once so sampling
+ * loops do nothing but reads, see sampler.cpp
+ */
+struct sampleReg_t {
+	void volatile	*ptr ;
+	phys_addr_t	 address ;
+	unsigned	 width ;
+	unsigned	 mask ;		// bits whose changes count
+};
+
+struct sample_t {
+	uint64_t	ns ;		// CLOCK_MONOTONIC
+	uint32_t	reg ;		// index into the sampled registers
+	uint32_t	value ;
+};
+
+/*
+ * Samples are written at head and consumed from tail, both counting
+ * up and wrapping at 2^32, so head-tail is the number in the ring
+ */
+struct sampleRing_t {
+	struct sample_t	*samples ;
+	unsigned	 mask ;		// size-1, size is a power of 2
+	unsigned	 head ;
+	unsigned	 tail ;
+	uint64_t	 dropped ;	// samples lost to a full ring
+	uint64_t	 watermark ;	// no sample to come is older, see sampleStream()
+};
+
+/*
+ * Pacing of a sampling thread that starts a pass every period_ns, with
+ * the intervals achieved, see samplePeriod()
+ */
+struct samplePace_t {
+	uint64_t	 period_ns ;
+	uint64_t	 next_wake ;
+	uint64_t	 last_wake ;
+	uint64_t	*intervals ;	// histogram of 1us buckets
+	uint64_t	 count ;
+	uint64_t	 sum ;
+	uint64_t	 min ;
+	uint64_t	 max ;
+	uint64_t	 missed ;	// periods skipped after overruns
+};
+
+/*
+ * A group of registers sampled by a thread of its own into a ring
+ */
+struct sampleGroup_t {
+	struct sampleReg_t	*regs ;
+	unsigned		 count ;
+	unsigned		 base ;		// number of the first register
+	uint32_t		*values ;
+	struct sampleRing_t	 ring ;
+	uint64_t		 period_ns ;	// 0 to run flat out
+	int			 cpu ;		// -1 for any
+	int			 priority ;	// SCHED_FIFO, 0 for none
+	struct samplePace_t	 pace ;
+	uint64_t		 passes ;
+	bool			 failed ;
+	pthread_t		 thread ;
+};
+
+typedef void (*sampleDrain_t)(struct sampleRing_t &ring, void *ctx);
+
+/*
+ * Condition on a field of a sampled register, (value >> shift) & mask
+ */
+enum triggerOp_e {
+	TRIGGER_EQ,		// equals value
+	TRIGGER_NE,		// doesn't equal value
+	TRIGGER_BECOMES,	// equals value, and didn't on the previous sample
+	TRIGGER_CHANGE		// differs from the previous sample
+};
+
+struct trigger_t {
+	unsigned		reg ;		// index into the sampled registers
+	unsigned		shift ;
+	unsigned		mask ;
+	unsigned		value ;
+	enum triggerOp_e	op ;
+};
+
+/*
+ * Rows of samples, one value per sampled register, kept around the
+ * row on which a trigger fired. Rows are in a ring until the capture
+ * ends, then rotated so row 0 is the oldest.
+ */
+struct sampleCapture_t {
+	unsigned	 rows ;		// kept
+	uint64_t	*ns ;		// CLOCK_MONOTONIC of each row
+	uint32_t	*values ;	// rows*count
+	unsigned	 trigger ;	// row that fired, rows if none did
+	uint64_t	 taken ;	// rows sampled in all
+};
+
+/*
+ * Counts of the values seen in a field, (value >> shift) & mask: in an
+ * array indexed by value for fields of up to HISTOGRAM_DENSE_BITS, else
+ * in a hash table of the values seen
+ */
+#define HISTOGRAM_DENSE_BITS	16
+
+struct histEntry_t {
+	uint32_t	value ;
+	uint64_t	count ;		// 0 for a free slot
+};
+
+struct histogram_t {
+	unsigned		 shift ;
+	unsigned		 mask ;
+	uint64_t		*counts ;	// mask+1 entries, 0 if hashed
+	struct histEntry_t	*table ;	// 0 if dense
+	unsigned		 table_mask ;	// size-1, size is a power of 2
+	unsigned		 used ;		// values in the table
+};
+
+/* sampler.cpp */
+extern volatile sig_atomic_t sample_stop ;
+void sampleStopOnSignal(void);
+void sampleStopAfter(uint64_t ns);
+uint64_t sampleNow(void);
+void samplePeriod(struct samplePace_t &p, uint64_t ns);
+void samplePrintPacing(FILE *f, struct samplePace_t const &p);
+bool sampleRealtime(int cpu, int priority);
+void samplePrepare(struct sampleReg_t *regs, unsigned count);
+void sampleOnce(struct sampleReg_t const *regs, unsigned count, uint32_t *values);
+void sampleRingInit(struct sampleRing_t &ring, unsigned minSize);
+uint64_t sampleWatch
+	( struct sampleReg_t const *regs,
+	  unsigned count,
+	  uint32_t *values,
+	  struct sampleRing_t &ring,
+	  sampleDrain_t drain,
+	  void *ctx );
+bool sampleTrigger
+	( struct sampleReg_t const *regs,
+	  unsigned count,
+	  struct trigger_t const &trigger,
+	  unsigned pre,
+	  unsigned post,
+	  struct sampleCapture_t &cap );
+bool samplePoll
+	( struct sampleReg_t const &reg,
+	  struct trigger_t const &trigger,
+	  uint64_t timeout_ns,
+	  unsigned &value );
+uint64_t sampleStream
+	( struct sampleReg_t const *regs,
+	  unsigned count,
+	  unsigned base,
+	  uint32_t *values,
+	  struct sampleRing_t &ring );
+bool sampleGroupStart(struct sampleGroup_t &g);
+bool sampleGroupJoin(struct sampleGroup_t &g);
+void histogramInit(struct histogram_t &h, unsigned shift, unsigned bitcount);
+uint64_t sampleHistogram(struct sampleReg_t const &reg, struct histogram_t &h);
+unsigned histogramValues(struct histogram_t const &h, struct histEntry_t *&values);
+
+/*
+ * Trace file layout:
+ *
+ *	trace_header_t
+ *	snapshot_reg_t[reg_count]	registers sampled
+ *	uint32_t masks[reg_count]	bits whose changes were recorded
+ *	records
+ *
+ * A record is three unsigned LEB128 numbers: the ns since the previous
+ * record (or start_ns), the register's position in the table, and its
+ * value XORed with the one in its previous record (or 0). Records are in
+ * time order even when several threads sampled. Each register has a
+ * record at the start. The trace ends with a record for position
+ * reg_count whose value is the number of sampling groups, followed by
+ * the number of passes and of samples dropped by each group, and is
+ * still readable up to the last whole record without.
+ */
+#define TRACE_MAGIC		"DEVREGTR"
+#define TRACE_VERSION		2
+
+struct trace_header_t {
+	char		magic[8];
+	uint32_t	version ;
+	uint32_t	cpu ;
+	uint64_t	db_hash ;	// regdbRegsHash() of the database used
+	int64_t		time_ns ;	// CLOCK_REALTIME at start_ns
+	uint64_t	start_ns ;	// CLOCK_MONOTONIC at the start
+	uint32_t	reg_count ;
+	uint32_t	reserved ;
+};
+
+/*
+ * A trace being read, see traceNext()
+ */
+struct trace_t {
+	struct trace_header_t const	*header ;
+	struct snapshot_reg_t const	*regs ;
+	uint32_t const			*masks ;
+	uint8_t const			*next ;
+	uint8_t const			*end ;
+	uint32_t			*values ;	// last of each register
+	uint64_t			 ns ;		// since start_ns
+	bool				 ended ;	// end record read
+	unsigned			 groups ;
+	uint64_t			*passes ;	// of each group
+	uint64_t			*dropped ;	// of each group
+};
+
+struct traceRecord_t {
+	uint64_t	ns ;		// since start_ns
+	uint32_t	reg ;		// position in the table
+	uint32_t	value ;
+	uint32_t	old ;		// from the previous record, 0 at first
+};
+
+/* trace.cpp */
+bool traceStart
+	( char const *path,
+	  struct trace_header_t const &header,
+	  struct snapshot_reg_t const *regs,
+	  uint32_t const *masks,
+	  struct sampleRing_t **rings,
+	  unsigned nrings );
+bool traceFinish(uint64_t const *passes);
+bool traceOpen(char const *path, struct trace_t &trace);
+bool traceNext(struct trace_t &trace, struct traceRecord_t &rec);
+
+/*
+ * A tab completion candidate, see lineComplete_t
+ */
+struct lineMatch_t {
+	char const	*text ;		// not NUL-terminated
+	unsigned	 len ;
+};
+
+/*
+ * Completes word[0..len): fills in up to max candidates, each to take
+ * the place of word from stem on, and returns how many there are
+ */
+typedef unsigned (*lineComplete_t)
+	( char const *word,
+	  unsigned len,
+	  unsigned &stem,
+	  struct lineMatch_t *matches,
+	  unsigned max );
+
+/* lineedit.cpp */
+void lineInit(char const *historyPath, lineComplete_t complete);
+char const *lineRead(char const *prompt);
+void lineFinish(void);
+
+/*
+ * Requests to a devregs daemon (--serve) and their replies, see
+ * server.cpp. A client may send any number of requests before reading
+ * replies, which come back in order with the tag of their request.
+ * Registers are given by exact name, REG or REG.FIELD, or else by an
+ * address inside them. Values are in host order: clients are local.
+ */
+enum serverOp_e {
+	SERVER_READ,		// value of a register
+	SERVER_WRITE,		// value to the named field, or the bits of mask
+	SERVER_DECODE,		// value of a register and its fields
+	SERVER_SNAPSHOT,	// every register, as a snapshot file
+	SERVER_STATS,		// serverStats_t of each op
+	SERVER_OPS
+};
+
+struct serverRequest_t {
+	uint64_t	address ;	// if no name
+	uint32_t	tag ;
+	uint32_t	value ;
+	uint32_t	mask ;		// 0 for the whole register or field
+	uint16_t	op ;
+	uint16_t	namelen ;	// bytes of name following
+};
+
+struct serverReply_t {
+	uint64_t	address ;
+	uint32_t	tag ;
+	int32_t		status ;	// 0 or a negative errno
+	uint32_t	value ;		// read, or written
+	uint32_t	old ;		// before a write
+	uint32_t	length ;	// bytes of data following
+	uint16_t	width ;
+	uint16_t	namelen ;	// of the register, at the start of data
+};
+
+/* SERVER_DECODE data: the register name, then for each field */
+struct serverField_t {
+	uint8_t		startbit ;
+	uint8_t		bitcount ;
+	uint16_t	namelen ;	// bytes of name following
+};
+
+#define SERVER_BUCKETS	32		// latencies under 2^(i+1) ns
+
+struct serverStats_t {
+	uint64_t	count ;
+	uint64_t	total_ns ;
+	uint64_t	max_ns ;
+	uint64_t	buckets[SERVER_BUCKETS];
+};
+
+/* a growing buffer of requests or replies */
+struct serverBuf_t {
+	uint8_t		*data ;
+	size_t		 used ;
+	size_t		 size ;
+};
+
+/* server.cpp */
+int serverRun(char const *path, struct regdb_t const *defs, unsigned cpu);
+void serverPrintStats(FILE *f, struct serverStats_t const *stats);
+int serverConnect(char const *path);
+void serverRequest
+	( struct serverBuf_t &buf,
+	  unsigned op,
+	  char const *name,
+	  uint64_t address,
+	  uint32_t value,
+	  uint32_t mask,
+	  uint32_t tag );
+bool serverSend(int fd, struct serverBuf_t &buf);
+bool serverReceive(int fd, struct serverReply_t &reply, uint8_t const *&data);
+
+/* devregs.cpp */
+char *nextWord(char *&next);
+
+/* simbus.cpp */
+struct physmemBackend_t const *simbusOpen(char const *model);
+
+/* regdb.cpp */
+uint64_t regdbHash(void const *data, size_t len, uint64_t hash = 0xcbf29ce484222325ULL);
+bool regdbOpen(char const *dbpath, char const *srcpath, struct regdb_t &db);
+bool regdbWrite(struct regdb_t const &db, char const *srcpath, char const *dbpath);
+void regdbIndex(struct regdb_t &db, struct arena_t &arena);
+int regdbFindName(struct regdb_t const &db, char const *name, unsigned len, unsigned &slot);
+unsigned regdbAddrLowerBound(struct regdb_t const &db, uint64_t address);
+int regdbFindAddress(struct regdb_t const &db, uint64_t address);
+void regdbIndexNames(struct regdb_t &db, struct arena_t &arena);
+void regdbPrefixRange(struct regdb_t const &db, char const *prefix, unsigned len, unsigned &first, unsigned &last);
+uint64_t regdbRegsHash(struct regdb_t const &db);
+void regdbSubstringRange(struct regdb_t const &db, char const *pattern, unsigned len, unsigned &first, unsigned &last);
+
+#endif
@@ -0,0 +1,330 @@
+/*
+ * lineedit.cpp - line editing for the interactive mode
+ *
+ * Just enough of a line editor to not need readline, which isn't on
+ * every board: cursor movement, history (kept in ~/.devregs_history)
+ * and tab completion through a callback, so the candidates come from
+ * the database indexes already in memory. Input that isn't a terminal
+ * is read a line at a time with no editing.
+ *
+ * Keys: left/right, ^A/^E or home/end, backspace, delete, ^K/^U to
+ * kill to the end/start, up/down or ^P/^N for history, tab to complete
+ * (twice to list), ^C to drop the line and ^D on an empty line to end.
+ *
+ * (c) Copyright 2010 by Boundary Devices under GPLv2
+ *
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <termios.h>
+#include "devregs.h"
+
+#define LINE_MAXLEN	512
+#define LINE_HISTORY	1000		// lines kept
+#define LINE_MATCHES	64		// completions listed at most
+#define KEY_DELETE	0x100		// past the characters, see readKey()
+
+struct lineEditor_t {
+	lineComplete_t	 complete ;
+	char		*history_path ;
+	char		*history[LINE_HISTORY];	// oldest first
+	unsigned	 history_count ;
+	bool		 tty ;
+	struct termios	 saved ;
+	char const	*prompt ;
+	char		 buf[LINE_MAXLEN+1];
+	unsigned	 len ;
+	unsigned	 pos ;			// cursor
+	char		 pending[LINE_MAXLEN+1];	// line being edited while in history
+};
+
+static struct lineEditor_t editor ;
+
+static void addHistory(char const *line)
+{
+	if ((0 == *line)
+	    || (editor.history_count && (0 == strcmp(editor.history[editor.history_count-1],line))))
+		return ;
+	if (LINE_HISTORY == editor.history_count) {
+		free(editor.history[0]);
+		memmove(editor.history,editor.history+1,(LINE_HISTORY-1)*sizeof(editor.history[0]));
+		editor.history_count-- ;
+	}
+	editor.history[editor.history_count++] = strdup(line);
+}
+
+/*
+ * Set up for lineRead(), with history from and to historyPath (0 for
+ * none)
+ */
+void lineInit(char const *historyPath, lineComplete_t complete)
+{
+	editor.complete = complete ;
+	editor.tty = isatty(STDIN_FILENO) && (0 == tcgetattr(STDIN_FILENO,&editor.saved));
+	editor.history_path = historyPath ? strdup(historyPath) : 0 ;
+	FILE *fIn = historyPath ? fopen(historyPath, "r") : 0 ;
+	if (fIn) {
+		char inBuf[LINE_MAXLEN+2];
+		while (fgets(inBuf,sizeof(inBuf),fIn)) {
+			inBuf[strcspn(inBuf,"\n")] = '\0' ;
+			addHistory(inBuf);
+		}
+		fclose(fIn);
+	}
+}
+
+/*
+ * Save the history
+ */
+void lineFinish(void)
+{
+	FILE *fOut = editor.history_path ? fopen(editor.history_path, "w") : 0 ;
+	if (fOut) {
+		for (unsigned i = 0 ; i < editor.history_count ; i++)
+			fprintf(fOut, "%s\n", editor.history[i]);
+		fclose(fOut);
+	}
+	for (unsigned i = 0 ; i < editor.history_count ; i++)
+		free(editor.history[i]);
+	editor.history_count = 0 ;
+	free(editor.history_path);
+	editor.history_path = 0 ;
+}
+
+static void refresh(void)
+{
+	printf("\r%s%.*s\e[K", editor.prompt, editor.len, editor.buf);
+	if (editor.pos < editor.len)
+		printf("\e[%uD", editor.len-editor.pos);
+	fflush(stdout);
+}
+
+static void setLine(char const *line)
+{
+	editor.len = editor.pos = strlen(line);
+	memcpy(editor.buf,line,editor.len);
+}
+
+static void insert(char const *text, unsigned n)
+{
+	if (n > LINE_MAXLEN-editor.len)
+		n = LINE_MAXLEN-editor.len ;
+	memmove(editor.buf+editor.pos+n,editor.buf+editor.pos,editor.len-editor.pos);
+	memcpy(editor.buf+editor.pos,text,n);
+	editor.len += n ;
+	editor.pos += n ;
+}
+
+static void erase(unsigned from, unsigned to)
+{
+	memmove(editor.buf+from,editor.buf+to,editor.len-to);
+	editor.len -= to-from ;
+	if (editor.pos > to)
+		editor.pos -= to-from ;
+	else if (editor.pos > from)
+		editor.pos = from ;
+}
+
+/*
+ * Complete the word before the cursor as far as its candidates agree,
+ * or list them on a second tab that gets no further
+ */
+static void complete(bool again)
+{
+	unsigned start = editor.pos ;
+	while (start && !isspace(editor.buf[start-1]))
+		start-- ;
+	struct lineMatch_t matches[LINE_MATCHES];
+	unsigned stem = 0 ;
+	unsigned const count = editor.complete(editor.buf+start,editor.pos-start,stem,matches,LINE_MATCHES);
+	if (0 == count) {
+		printf("\a");
+		return ;
+	}
+	unsigned const shown = (count < LINE_MATCHES) ? count : LINE_MATCHES ;
+	unsigned common = matches[0].len ;
+	for (unsigned i = 1 ; (i < shown) && common ; i++) {
+		unsigned j = 0 ;
+		while ((j < common) && (j < matches[i].len)
+		       && (toupper(matches[i].text[j]) == toupper(matches[0].text[j])))
+			j++ ;
+		common = j ;
+	}
+	unsigned const typed = editor.pos-start-stem ;
+	if ((count == shown) && (common > typed)) {
+		erase(start+stem,editor.pos);
+		insert(matches[0].text,common);
+		return ;
+	}
+	if (!again || (1 == count)) {
+		printf("\a");
+		return ;
+	}
+	printf("\n");
+	for (unsigned i = 0 ; i < shown ; i++)
+		printf("%.*s%c", matches[i].len, matches[i].text, (7 == i%8) ? '\n' : '\t');
+	if (count > shown)
+		printf("... and %u more", count-shown);
+	printf("\n");
+}
+
+/*
+ * Read a key, folding the escape sequences of the arrow and editing
+ * keys into the control characters that do the same
+ */
+static int readKey(void)
+{
+	unsigned char c ;
+	if (1 != read(STDIN_FILENO,&c,1))
+		return -1 ;
+	if ('\e' != c)
+		return c ;
+	unsigned char seq[3];
+	if ((1 != read(STDIN_FILENO,seq,1)) || (('[' != seq[0]) && ('O' != seq[0]))
+	    || (1 != read(STDIN_FILENO,seq+1,1)))
+		return 0 ;
+	switch (seq[1]) {
+	case 'A': return 'P'-'@' ;
+	case 'B': return 'N'-'@' ;
+	case 'C': return 'F'-'@' ;
+	case 'D': return 'B'-'@' ;
+	case 'H': return 'A'-'@' ;
+	case 'F': return 'E'-'@' ;
+	}
+	if (isdigit(seq[1]) && (1 == read(STDIN_FILENO,seq+2,1)) && ('~' == seq[2])) {
+		if ('3' == seq[1])
+			return KEY_DELETE ;
+		if (('1' == seq[1]) || ('7' == seq[1]))
+			return 'A'-'@' ;
+		if (('4' == seq[1]) || ('8' == seq[1]))
+			return 'E'-'@' ;
+	}
+	return 0 ;
+}
+
+/*
+ * Edit a line on the terminal, returns false at the end of input
+ */
+static bool editLine(void)
+{
+	unsigned hpos = editor.history_count ;
+	int lastKey = 0 ;
+	refresh();
+	for (;;) {
+		int const key = readKey();
+		switch (key) {
+		case -1:
+			return false ;
+		case '\r':
+		case '\n':
+			printf("\n");
+			return true ;
+		case 'D'-'@':
+			if (0 == editor.len) {
+				printf("\n");
+				return false ;
+			}
+			/* fall through */
+		case KEY_DELETE:
+			if (editor.pos < editor.len)
+				erase(editor.pos,editor.pos+1);
+			break;
+		case 0x7f:
+		case 'H'-'@':
+			if (editor.pos)
+				erase(editor.pos-1,editor.pos);
+			break;
+		case 'C'-'@':
+			printf("^C\n");
+			editor.len = editor.pos = 0 ;
+			hpos = editor.history_count ;
+			break;
+		case 'A'-'@':
+			editor.pos = 0 ;
+			break;
+		case 'E'-'@':
+			editor.pos = editor.len ;
+			break;
+		case 'B'-'@':
+			if (editor.pos)
+				editor.pos-- ;
+			break;
+		case 'F'-'@':
+			if (editor.pos < editor.len)
+				editor.pos++ ;
+			break;
+		case 'K'-'@':
+			erase(editor.pos,editor.len);
+			break;
+		case 'U'-'@':
+			erase(0,editor.pos);
+			break;
+		case 'P'-'@':
+		case 'N'-'@':
+			if (hpos == editor.history_count) {
+				memcpy(editor.pending,editor.buf,editor.len);
+				editor.pending[editor.len] = '\0' ;
+			}
+			if (('P'-'@' == key) && hpos)
+				hpos-- ;
+			else if (('N'-'@' == key) && (hpos < editor.history_count))
+				hpos++ ;
+			setLine((hpos < editor.history_count) ? editor.history[hpos] : editor.pending);
+			break;
+		case '\t':
+			complete('\t' == lastKey);
+			break;
+		default:
+			if (isprint(key)) {
+				char const c = key ;
+				insert(&c,1);
+			}
+		}
+		lastKey = key ;
+		refresh();
+	}
+}
+
+/*
+ * Read a line with prompt, returns 0 at the end of input. The line
+ * stays valid until the next call.
+ */
+char const *lineRead(char const *prompt)
+{
+	editor.prompt = prompt ;
+	editor.len = editor.pos = 0 ;
+	if (!editor.tty) {
+		if (0 == fgets(editor.buf,sizeof(editor.buf),stdin))
+			return 0 ;
+		size_t const len = strcspn(editor.buf,"\n");
+		if (('\n' != editor.buf[len]) && !feof(stdin)) {
+			/* drop all of it rather than run the rest as another line */
+			int c ;
+			while ((EOF != (c = getchar())) && ('\n' != c))
+				;
+			fprintf(stderr, "line longer than %u characters ignored\n", LINE_MAXLEN);
+			editor.buf[0] = '\0' ;
+			return editor.buf ;
+		}
+		editor.buf[len] = '\0' ;
+		return editor.buf ;
+	}
+	struct termios raw = editor.saved ;
+	raw.c_lflag &= ~(ICANON|ECHO|ISIG|IEXTEN);
+	raw.c_iflag &= ~(IXON|ICRNL);
+	raw.c_cc[VMIN] = 1 ;
+	raw.c_cc[VTIME] = 0 ;
+	tcsetattr(STDIN_FILENO,TCSAFLUSH,&raw);
+	bool const ok = editLine();
+	tcsetattr(STDIN_FILENO,TCSAFLUSH,&editor.saved);
+	fflush(stdout);
+	if (!ok)
+		return 0 ;
+	editor.buf[editor.len] = '\0' ;
+	addHistory(editor.buf);
+	return editor.buf ;
+}
@@ -0,0 +1,466 @@
+/*
+ * physmem.cpp - access to physical memory
+ *
+ * Memory is reached through a backend: /dev/mem on a board, or a file
+ * or memfd standing in for physical memory at a base address so the
+ * whole tool can be run and measured off-target.
+ *
+ * Pages are mapped on first use and kept in a cache, so a dump which
+ * goes back and forth between peripherals maps each page once rather
+ * than every time the address moves to another page. Pages are found
+ * through a hash of the page address, and the least recently used one
+ * is unmapped when the cache is full.
+ *
+ * When the registers a command will touch are known up front, they are
+ * planned into regions instead: addresses are coalesced into runs of
+ * pages, joined across small gaps, and each run is mapped with a single
+ * mmap(). Accesses inside a region are served by offset into it, and
+ * anything else falls back to the page cache.
+ *
+ * (c) Copyright 2010 by Boundary Devices under GPLv2
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "devregs.h"
+
+#define MAPCACHE_PAGES		256
+#define MAPCACHE_BUCKETS	512	// power of 2
+#define MAPCACHE_NONE		-1
+#define PLAN_MAX_GAP		(64*1024)	// unused bytes mapped to join two regions
+
+struct mapEntry_t {
+	phys_addr_t	 page ;
+	char		*map ;
+	int		 hnext ;	// next entry in hash bucket
+	int		 prev ;		// more recently used
+	int		 next ;		// less recently used
+};
+
+static struct mapEntry_t entries[MAPCACHE_PAGES];
+static int buckets[MAPCACHE_BUCKETS];
+static int entry_count = 0 ;
+static int lru_head = MAPCACHE_NONE ;	// most recently used
+static int lru_tail = MAPCACHE_NONE ;
+static unsigned long page_size = 0 ;
+static struct physmemStats_t stats ;
+
+struct mapRegion_t {
+	phys_addr_t	 start ;	// page aligned
+	phys_addr_t	 end ;
+	char		*map ;
+};
+
+static struct mapRegion_t *regions = 0 ;	// sorted by address
+static unsigned region_count = 0 ;
+static __thread unsigned last_region = 0 ;	// per thread, as sampling groups use regions
+
+/*
+ * Both built-in backends map a file descriptor: /dev/mem at the
+ * physical address, or a file or memfd at its offset from mem_base.
+ */
+static int mem_fd = -1 ;
+static phys_addr_t mem_base = 0 ;
+static phys_addr_t mem_size = 0 ;	// 0 if unlimited
+
+static int getFd(void){
+	if( 0 > mem_fd ){
+		mem_fd = open("/dev/mem", O_RDWR | O_SYNC);
+		if (mem_fd<0) {
+			perror("/dev/mem");
+			exit(1);
+		}
+	}
+	return mem_fd ;
+}
+
+static void *fdMap(phys_addr_t start, size_t len)
+{
+	if (mem_size
+	    && ((start < mem_base) || (start - mem_base + (phys_addr_t)len > mem_size))) {
+		fprintf(stderr, "0x%08lx is outside of simulated memory\n", (unsigned long)start);
+		errno = EFAULT ;
+		return MAP_FAILED ;
+	}
+	return mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, getFd(), start - mem_base );
+}
+
+static void fdUnmap(void *map, size_t len)
+{
+	munmap(map,len);
+}
+
+static unsigned ptrRead(void volatile *ptr, phys_addr_t, unsigned width)
+{
+	if (1 == width)
+		return *(uint8_t volatile *)ptr ;
+	if (2 == width)
+		return *(uint16_t volatile *)ptr ;
+	return *(uint32_t volatile *)ptr ;
+}
+
+static void ptrWrite(void volatile *ptr, phys_addr_t, unsigned width, unsigned value)
+{
+	if (1 == width)
+		*(uint8_t volatile *)ptr = value ;
+	else if (2 == width)
+		*(uint16_t volatile *)ptr = value ;
+	else
+		*(uint32_t volatile *)ptr = value ;
+}
+
+static struct physmemBackend_t const devmemBackend = {
+	"devmem", fdMap, fdUnmap, ptrRead, ptrWrite, 0
+};
+
+static struct physmemBackend_t const fileBackend = {
+	"file", fdMap, fdUnmap, ptrRead, ptrWrite, 0
+};
+
+static struct physmemBackend_t const *backend = &devmemBackend ;
+
+/*
+ * Parses the optional "@BASE" of a backend spec
+ */
+static bool parseBase(char const *spec, char const *at)
+{
+	if (0 == at)
+		return true ;
+	char *end ;
+	mem_base = strtoull(at+1,&end,16);
+	if (('\0' == at[1]) || ('\0' != *end) || (mem_base & (sysconf(_SC_PAGESIZE)-1))) {
+		fprintf(stderr, "Invalid base address in '%s', use a page aligned 0xHEX\n", spec);
+		return false ;
+	}
+	return true ;
+}
+
+/*
+ * Select the backend to use:
+ *
+ *	devmem			- /dev/mem (the default)
+ *	file:PATH[@BASE]	- the contents of PATH at physical address BASE
+ *	memfd:SIZE[@BASE]	- SIZE bytes of zeroed memory at BASE
+ *	sim:MODEL		- simulated bus, see simbus.cpp
+ *
+ * Returns false after reporting an invalid spec.
+ */
+bool physmemSelect(char const *spec)
+{
+	if (0 == strcmp(spec,"devmem")) {
+		backend = &devmemBackend ;
+		return true ;
+	}
+	char const *at = strrchr(spec,'@');
+	if (0 == strncmp(spec,"file:",5)) {
+		char *path = strdup(spec+5);
+		if (at)
+			path[at-spec-5] = '\0' ;
+		struct stat st ;
+		int fd = open(path, O_RDWR);
+		if ((0 > fd) || (0 != fstat(fd,&st))) {
+			perror(path);
+			free(path);
+			return false ;
+		}
+		free(path);
+		if (!parseBase(spec,at)) {
+			close(fd);
+			return false ;
+		}
+		mem_fd = fd ;
+		mem_size = st.st_size ;
+		backend = &fileBackend ;
+		return true ;
+	}
+	if (0 == strncmp(spec,"memfd:",6)) {
+		char *end ;
+		unsigned long long size = strtoull(spec+6,&end,0);
+		if ((0 == size) || (end != (at ? at : spec+strlen(spec)))) {
+			fprintf(stderr, "Invalid size in '%s'\n", spec);
+			return false ;
+		}
+		if (!parseBase(spec,at))
+			return false ;
+#ifdef SYS_memfd_create
+		int fd = syscall(SYS_memfd_create, "devregs", 0);
+#else
+		int fd = -1 ;
+		errno = ENOSYS ;
+#endif
+		if ((0 > fd) || (0 != ftruncate(fd,size))) {
+			perror("memfd");
+			return false ;
+		}
+		mem_fd = fd ;
+		mem_size = size ;
+		backend = &fileBackend ;
+		return true ;
+	}
+	if (0 == strncmp(spec,"sim:",4)) {
+		struct physmemBackend_t const *sim = simbusOpen(spec+4);
+		if (0 == sim)
+			return false ;
+		backend = sim ;
+		return true ;
+	}
+	fprintf(stderr, "Unknown backend '%s'\n", spec);
+	return false ;
+}
+
+struct physmemBackend_t const *physmemBackend(void)
+{
+	return backend ;
+}
+
+static unsigned bucketOf(phys_addr_t page)
+{
+	uint64_t const pfn = (uint64_t)page / page_size ;
+	return (unsigned)((pfn * 0x9e3779b97f4a7c15ULL) >> 32) & (MAPCACHE_BUCKETS-1);
+}
+
+static void lruUnlink(int idx)
+{
+	struct mapEntry_t &e = entries[idx];
+	if (MAPCACHE_NONE != e.prev)
+		entries[e.prev].next = e.next ;
+	else
+		lru_head = e.next ;
+	if (MAPCACHE_NONE != e.next)
+		entries[e.next].prev = e.prev ;
+	else
+		lru_tail = e.prev ;
+}
+
+static void lruPush(int idx)
+{
+	struct mapEntry_t &e = entries[idx];
+	e.prev = MAPCACHE_NONE ;
+	e.next = lru_head ;
+	if (MAPCACHE_NONE != lru_head)
+		entries[lru_head].prev = idx ;
+	else
+		lru_tail = idx ;
+	lru_head = idx ;
+}
+
+static void hashRemove(int idx)
+{
+	int *link = &buckets[bucketOf(entries[idx].page)];
+	while (*link != idx)
+		link = &entries[*link].hnext ;
+	*link = entries[idx].hnext ;
+}
+
+/*
+ * Take an entry for a new page: a free one, or the least recently
+ * used after unmapping it
+ */
+static int allocEntry(void)
+{
+	if (entry_count < MAPCACHE_PAGES)
+		return entry_count++ ;
+	int const idx = lru_tail ;
+	lruUnlink(idx);
+	hashRemove(idx);
+	backend->unmap(entries[idx].map,page_size);
+	stats.unmaps++ ;
+	return idx ;
+}
+
+static char *mapPage(phys_addr_t page)
+{
+	unsigned const bucket = bucketOf(page);
+	for (int idx = buckets[bucket] ; MAPCACHE_NONE != idx ; idx = entries[idx].hnext) {
+		if (entries[idx].page == page) {
+			if (idx != lru_head) {
+				lruUnlink(idx);
+				lruPush(idx);
+			}
+			stats.hits++ ;
+			return entries[idx].map ;
+		}
+	}
+	void *map = backend->map(page,page_size);
+	if( MAP_FAILED == map ){
+		perror("mmap");
+		exit(1);
+	}
+	stats.maps++ ;
+	int const idx = allocEntry();
+	struct mapEntry_t &e = entries[idx];
+	e.page = page ;
+	e.map = (char *)map ;
+	e.hnext = buckets[bucket];
+	buckets[bucket] = idx ;
+	lruPush(idx);
+	return e.map ;
+}
+
+static void physmemInit(void)
+{
+	if (0 == page_size) {
+		page_size = sysconf(_SC_PAGESIZE);
+		for (unsigned i = 0 ; i < MAPCACHE_BUCKETS ; i++)
+			buckets[i] = MAPCACHE_NONE ;
+	}
+}
+
+static int compareAddr(void const *lhs, void const *rhs)
+{
+	phys_addr_t const l = *(phys_addr_t const *)lhs ;
+	phys_addr_t const r = *(phys_addr_t const *)rhs ;
+	return (l < r) ? -1 : (l > r);
+}
+
+/*
+ * Map the regions covering addrs (sorted in place). Regions that
+ * can't be mapped, e.g. because /dev/mem refuses a page in a gap,
+ * are dropped and their registers mapped page by page.
+ */
+void physmemPlan(phys_addr_t *addrs, unsigned count)
+{
+	physmemInit();
+	if (0 == count)
+		return ;
+	qsort(addrs,count,sizeof(addrs[0]),compareAddr);
+	unsigned max = 1 ;
+	for (unsigned i = 1 ; i < count ; i++) {
+		if (addrs[i] - addrs[i-1] > PLAN_MAX_GAP)
+			max++ ;
+	}
+	regions = (struct mapRegion_t *)realloc(regions,(region_count+max)*sizeof(regions[0]));
+	if (0 == regions) {
+		perror("physmemPlan");
+		exit(1);
+	}
+	phys_addr_t const mask = page_size-1 ;
+	unsigned i = 0 ;
+	while (i < count) {
+		phys_addr_t const start = addrs[i] & ~mask ;
+		phys_addr_t end = (addrs[i] | mask) + 1 ;
+		while ((++i < count) && (addrs[i] < end + PLAN_MAX_GAP))
+			end = (addrs[i] | mask) + 1 ;
+
+		stats.maps++ ;
+		void *map = backend->map(start,end-start);
+		if (MAP_FAILED == map)
+			continue;
+		struct mapRegion_t &r = regions[region_count++];
+		r.start = start ;
+		r.end = end ;
+		r.map = (char *)map ;
+		stats.regions++ ;
+	}
+	/* keep regions from earlier plans in order too */
+	for (unsigned j = 1 ; j < region_count ; j++) {
+		struct mapRegion_t const r = regions[j];
+		unsigned k = j ;
+		while ((k > 0) && (regions[k-1].start > r.start)) {
+			regions[k] = regions[k-1];
+			k-- ;
+		}
+		regions[k] = r ;
+	}
+}
+
+/*
+ * Mapped address of addr if it is inside a planned region, else 0
+ */
+static char *regionPtr(phys_addr_t addr)
+{
+	struct mapRegion_t const *r = regions+last_region ;
+	if ((addr < r->start) || (addr >= r->end)) {
+		unsigned lo = 0, hi = region_count ;
+		while (lo < hi) {
+			unsigned const mid = lo + (hi-lo)/2 ;
+			if (regions[mid].end <= addr)
+				lo = mid+1 ;
+			else
+				hi = mid ;
+		}
+		if ((lo == region_count) || (addr < regions[lo].start))
+			return 0 ;
+		last_region = lo ;
+		r = regions+lo ;
+	}
+	__atomic_fetch_add(&stats.hits,1,__ATOMIC_RELAXED);
+	return r->map + (addr - r->start);
+}
+
+static unsigned volatile *getReg(phys_addr_t addr){
+	physmemInit();
+	if (region_count) {
+		char *p = regionPtr(addr);
+		if (p)
+			return (unsigned volatile *)p ;
+	}
+	unsigned offs = addr & (page_size-1);
+	phys_addr_t page = addr - offs;
+	char *map ;
+	if ((MAPCACHE_NONE != lru_head) && (entries[lru_head].page == page)) {
+		stats.hits++ ;
+		map = entries[lru_head].map ;
+	} else
+		map = mapPage(page);
+	return (unsigned volatile *)(map+offs);
+}
+
+/*
+ * Mapped address of a register for callers that go on accessing it
+ * through the backend, e.g. to sample it: it is planned into a region
+ * if it isn't in one already, and regions stay mapped.
+ */
+void volatile *physMap(phys_addr_t addr)
+{
+	physmemInit();
+	char *p = region_count ? regionPtr(addr) : 0 ;
+	if (0 == p) {
+		physmemPlan(&addr,1);
+		p = regionPtr(addr);
+	}
+	if (0 == p) {
+		perror("mmap");
+		exit(1);
+	}
+	return p ;
+}
+
+/*
+ * Mapped address of addr if a plan put it in a region, else 0
+ */
+void volatile *physRegion(phys_addr_t addr)
+{
+	return region_count ? regionPtr(addr) : 0 ;
+}
+
+unsigned physRead(phys_addr_t addr, unsigned width)
+{
+	return backend->read(getReg(addr),addr,width);
+}
+
+void physWrite(phys_addr_t addr, unsigned width, unsigned value)
+{
+	backend->write(getReg(addr),addr,width,value);
+}
+
+struct physmemStats_t const &physmemStats(void)
+{
+	return stats ;
+}
+
+void physmemPrintStats(FILE *f)
+{
+	fprintf(f, "%lu mmap calls (%lu regions), %lu munmap calls, %lu accesses to mapped pages\n",
+		stats.maps, stats.regions, stats.unmaps, stats.hits);
+	if (backend->report)
+		backend->report(f);
+}
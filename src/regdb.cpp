@@ -0,0 +1,714 @@
+/*
+ * regdb.cpp - compiled register database
+ *
+ * A compiled database holds the register, field and string tables of
+ * a .dat file in the layout described in devregs.h. It is mapped
+ * read-only and used in place, so loading it costs an open(), an
+ * mmap() and a pass of bounds checks over the records instead of a
+ * parse of the text file.
+ *
+ * The header records the size, modification time and hash of the
+ * .dat file it was compiled from. If the .dat file is still present
+ * and doesn't match, the compiled database is rejected as stale and
+ * the caller falls back to parsing the text.
+ *
+ * (c) Copyright 2010 by Boundary Devices under GPLv2
+ *
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "devregs.h"
+
+#define REGDB_ALIGN 8
+#define REGDB_MAX_SECTIONS 8
+
+/*
+ * 64-bit FNV-1a
+ */
+uint64_t regdbHash(void const *data, size_t len, uint64_t hash)
+{
+	unsigned char const *p = (unsigned char const *)data ;
+	while (len--) {
+		hash ^= *p++ ;
+		hash *= 0x100000001b3ULL ;
+	}
+	return hash ;
+}
+
+/*
+ * Hash of the addresses, widths and names of the registers in a
+ * database, whether it was parsed or compiled, to tell whether a
+ * snapshot was taken with the same register definitions
+ */
+uint64_t regdbRegsHash(struct regdb_t const &db)
+{
+	uint64_t hash = regdbHash(0,0);
+	for (unsigned i = 0 ; i < db.reg_count ; i++) {
+		struct regdb_reg_t const &r = db.regs[i];
+		uint64_t const address = r.address ;
+		uint32_t const width = r.width ;
+		hash = regdbHash(&address,sizeof(address),hash);
+		hash = regdbHash(&width,sizeof(width),hash);
+		hash = regdbHash(db.strings+r.name,r.namelen,hash);
+	}
+	return hash ;
+}
+
+static bool hashFile(char const *path, uint64_t &hash)
+{
+	int fd = open(path, O_RDONLY);
+	if (0 > fd)
+		return false ;
+	struct stat st ;
+	bool rval = false ;
+	if (0 == fstat(fd,&st)) {
+		if (0 == st.st_size) {
+			hash = regdbHash(0,0);
+			rval = true ;
+		} else {
+			void *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (MAP_FAILED != map) {
+				hash = regdbHash(map,st.st_size);
+				munmap(map,st.st_size);
+				rval = true ;
+			}
+		}
+	}
+	close(fd);
+	return rval ;
+}
+
+static bool sourceMatches(struct regdb_header_t const *hdr, char const *srcpath)
+{
+	struct stat st ;
+	if (0 != stat(srcpath,&st))
+		return true ; // nothing to compare against
+	if ((uint64_t)st.st_size != hdr->src_size)
+		return false ;
+	if ((int64_t)st.st_mtime == hdr->src_mtime)
+		return true ;
+	/* e.g. installed without preserving timestamps */
+	uint64_t hash ;
+	return hashFile(srcpath,hash) && (hash == hdr->src_hash);
+}
+
+/*
+ * Check every record once, so lookups and display can trust the name
+ * offsets, field ranges and widths without checks of their own
+ */
+static bool recordsValid(struct regdb_t const &db)
+{
+	for (unsigned i = 0 ; i < db.reg_count ; i++) {
+		struct regdb_reg_t const &r = db.regs[i];
+		if ((r.name >= db.string_size) || (r.namelen > db.string_size-r.name)
+		    || (r.field_first > db.field_count) || (r.field_count > db.field_count-r.field_first)
+		    || ((1 != r.width) && (2 != r.width) && (4 != r.width)))
+			return false ;
+	}
+	for (unsigned i = 0 ; i < db.field_count ; i++) {
+		struct regdb_field_t const &f = db.fields[i];
+		if ((f.name >= db.string_size) || (f.namelen > db.string_size-f.name)
+		    || (0 == f.bitcount) || (f.startbit+f.bitcount > 32))
+			return false ;
+	}
+	/* a probe for a name that isn't there ends at an empty slot */
+	bool empty = false ;
+	for (unsigned i = 0 ; i < db.name_hash_size ; i++) {
+		if (db.name_hash[i] > db.reg_count)
+			return false ;
+		empty |= (0 == db.name_hash[i]);
+	}
+	return empty ;
+}
+
+bool regdbOpen(char const *dbpath, char const *srcpath, struct regdb_t &db)
+{
+	int fd = open(dbpath, O_RDONLY);
+	if (0 > fd)
+		return false ;
+	struct stat st ;
+	if ((0 != fstat(fd,&st)) || ((size_t)st.st_size < sizeof(struct regdb_header_t))) {
+		close(fd);
+		return false ;
+	}
+	size_t const size = st.st_size ;
+	void *map = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == map)
+		return false ;
+
+	char const *base = (char const *)map ;
+	struct regdb_header_t const *hdr = (struct regdb_header_t const *)base ;
+	if ((0 == memcmp(hdr->magic,REGDB_MAGIC,sizeof(hdr->magic)))
+	    && (REGDB_BYTE_ORDER != hdr->byte_order)) {
+		fprintf(stderr, "%s: compiled with another byte order, using %s\n", dbpath, srcpath);
+		munmap(map,size);
+		return false ;
+	}
+	if ((0 != memcmp(hdr->magic,REGDB_MAGIC,sizeof(hdr->magic)))
+	    ||
+	    (REGDB_VERSION != hdr->version)
+	    ||
+	    (hdr->section_count > (size-sizeof(*hdr))/sizeof(struct regdb_section_t))) {
+		fprintf(stderr, "%s: not a devregs database\n", dbpath);
+		munmap(map,size);
+		return false ;
+	}
+	if (!sourceMatches(hdr,srcpath)) {
+		fprintf(stderr, "%s: stale, using %s\n", dbpath, srcpath);
+		munmap(map,size);
+		return false ;
+	}
+
+	struct regdb_t out ;
+	memset(&out,0,sizeof(out));
+	struct regdb_section_t const *sect = (struct regdb_section_t const *)(hdr+1);
+	for (unsigned i = 0 ; i < hdr->section_count ; i++, sect++) {
+		if ((sect->offset > size)
+		    ||
+		    (sect->size > size-sect->offset)
+		    ||
+		    (0 != (sect->offset % REGDB_ALIGN))) {
+			fprintf(stderr, "%s: section %u out of bounds\n", dbpath, i);
+			munmap(map,size);
+			return false ;
+		}
+		void const *data = base+sect->offset ;
+		switch (sect->type) {
+		case REGDB_REGS:
+			if (sect->size / sizeof(struct regdb_reg_t) < sect->count)
+				break;
+			out.regs = (struct regdb_reg_t const *)data ;
+			out.reg_count = sect->count ;
+			continue;
+		case REGDB_FIELDS:
+			if (sect->size / sizeof(struct regdb_field_t) < sect->count)
+				break;
+			out.fields = (struct regdb_field_t const *)data ;
+			out.field_count = sect->count ;
+			continue;
+		case REGDB_STRINGS:
+			if ((0 == sect->size) || ('\0' != base[sect->offset+sect->size-1]))
+				break;
+			out.strings = (char const *)data ;
+			out.string_size = sect->size ;
+			continue;
+		case REGDB_ADDRINDEX:
+			if (0 == out.regs) {
+				fprintf(stderr, "%s: address index before registers\n", dbpath);
+				break;
+			}
+			if ((sect->size / sizeof(uint32_t) < sect->count)
+			    || (out.reg_count != sect->count))
+				break;
+			out.addr_index = (uint32_t const *)data ;
+			for (unsigned j = 0 ; j < sect->count ; j++) {
+				if (out.addr_index[j] >= out.reg_count) {
+					out.addr_index = 0 ;
+					break;
+				}
+			}
+			if (0 == out.addr_index)
+				break;
+			continue;
+		case REGDB_NAMEINDEX:
+			if ((0 == out.regs)
+			    || (sect->size / sizeof(uint32_t) < sect->count)
+			    || (out.reg_count != sect->count))
+				break;
+			out.name_index = (uint32_t const *)data ;
+			for (unsigned j = 0 ; j < sect->count ; j++) {
+				if (out.name_index[j] >= out.reg_count) {
+					out.name_index = 0 ;
+					break;
+				}
+			}
+			if (0 == out.name_index)
+				break;
+			continue;
+		case REGDB_SUFFIXES:
+			if ((0 == out.regs)
+			    || (sect->size / sizeof(struct regdb_suffix_t) < sect->count))
+				break;
+			out.suffixes = (struct regdb_suffix_t const *)data ;
+			out.suffix_count = sect->count ;
+			for (unsigned j = 0 ; j < sect->count ; j++) {
+				if ((out.suffixes[j].reg >= out.reg_count)
+				    || (out.suffixes[j].offset >= out.regs[out.suffixes[j].reg].namelen)) {
+					out.suffixes = 0 ;
+					break;
+				}
+			}
+			if (0 == out.suffixes)
+				break;
+			continue;
+		case REGDB_NAMEHASH:
+			if ((sect->size / sizeof(uint32_t) < sect->count)
+			    || (0 == sect->count)
+			    || (0 != (sect->count & (sect->count-1))))
+				break;
+			out.name_hash = (uint32_t const *)data ;
+			out.name_hash_size = sect->count ;
+			continue;
+		default:
+			continue; // newer section type
+		}
+		fprintf(stderr, "%s: invalid section %u\n", dbpath, i);
+		munmap(map,size);
+		return false ;
+	}
+	if ((0 == out.regs) || (0 == out.fields) || (0 == out.strings)) {
+		fprintf(stderr, "%s: missing tables\n", dbpath);
+		munmap(map,size);
+		return false ;
+	}
+	if (!recordsValid(out)) {
+		fprintf(stderr, "%s: invalid records, using %s\n", dbpath, srcpath);
+		munmap(map,size);
+		return false ;
+	}
+	db = out ;
+	return true ;
+}
+
+static uint32_t nameHash(char const *name, unsigned len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL ;
+	while (len--) {
+		hash ^= (unsigned char)tolower(*name++);
+		hash *= 0x100000001b3ULL ;
+	}
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/*
+ * Open-addressed hash of case-folded register names. Registers with
+ * the same name sit along one probe chain in table order.
+ */
+static void buildNameHash(struct regdb_t &db, struct arena_t &arena)
+{
+	unsigned size = 64 ;
+	while (size < 2*db.reg_count)
+		size *= 2 ;
+	uint32_t *slots = (uint32_t *)arenaAlloc(arena,size*sizeof(slots[0]));
+	memset(slots,0,size*sizeof(slots[0]));
+	for (unsigned i = 0 ; i < db.reg_count ; i++) {
+		struct regdb_reg_t const &r = db.regs[i];
+		unsigned slot = nameHash(db.strings+r.name,r.namelen) & (size-1);
+		while (slots[slot])
+			slot = (slot+1) & (size-1);
+		slots[slot] = i+1 ;
+	}
+	db.name_hash = slots ;
+	db.name_hash_size = size ;
+}
+
+struct addrSort_t {
+	uint64_t	address ;
+	uint32_t	index ;
+};
+
+static int compareAddr(void const *lhs, void const *rhs)
+{
+	struct addrSort_t const *l = (struct addrSort_t const *)lhs ;
+	struct addrSort_t const *r = (struct addrSort_t const *)rhs ;
+	if (l->address != r->address)
+		return (l->address < r->address) ? -1 : 1 ;
+	return (l->index < r->index) ? -1 : (l->index > r->index);
+}
+
+/*
+ * Register indexes sorted by address, and by table order within an
+ * address
+ */
+static void buildAddrIndex(struct regdb_t &db, struct arena_t &arena)
+{
+	struct addrSort_t *sorted = (struct addrSort_t *)malloc(db.reg_count*sizeof(sorted[0])+1);
+	for (unsigned i = 0 ; i < db.reg_count ; i++) {
+		sorted[i].address = db.regs[i].address ;
+		sorted[i].index = i ;
+	}
+	qsort(sorted,db.reg_count,sizeof(sorted[0]),compareAddr);
+	uint32_t *index = (uint32_t *)arenaAlloc(arena,db.reg_count*sizeof(index[0]));
+	for (unsigned i = 0 ; i < db.reg_count ; i++)
+		index[i] = sorted[i].index ;
+	free(sorted);
+	db.addr_index = index ;
+}
+
+/*
+ * Build whichever indexes the database doesn't already have
+ */
+void regdbIndex(struct regdb_t &db, struct arena_t &arena)
+{
+	if (0 == db.name_hash)
+		buildNameHash(db,arena);
+	if (0 == db.addr_index)
+		buildAddrIndex(db,arena);
+}
+
+/*
+ * Position in the address index of the first register at or above
+ * address
+ */
+unsigned regdbAddrLowerBound(struct regdb_t const &db, uint64_t address)
+{
+	unsigned lo = 0 ;
+	unsigned hi = db.reg_count ;
+	while (lo < hi) {
+		unsigned const mid = lo + (hi-lo)/2 ;
+		if (db.regs[db.addr_index[mid]].address < address)
+			lo = mid+1 ;
+		else
+			hi = mid ;
+	}
+	return lo ;
+}
+
+/*
+ * Register at address, or failing that the register whose width
+ * covers it. Returns the register index or -1.
+ */
+int regdbFindAddress(struct regdb_t const &db, uint64_t address)
+{
+	unsigned pos = regdbAddrLowerBound(db,address);
+	if ((pos < db.reg_count) && (db.regs[db.addr_index[pos]].address == address))
+		return db.addr_index[pos];
+	/* registers are at most 4 bytes wide, so look back that far */
+	while (pos-- > 0) {
+		struct regdb_reg_t const &r = db.regs[db.addr_index[pos]];
+		if (r.address + 4 <= address)
+			break;
+		if (address < r.address + r.width)
+			return db.addr_index[pos];
+	}
+	return -1 ;
+}
+
+/*
+ * Exact, case-insensitive lookup of a register name. Start with slot
+ * set to ~0U and call again with the same slot for further registers
+ * of the same name. Returns the register index or -1.
+ */
+int regdbFindName(struct regdb_t const &db, char const *name, unsigned len, unsigned &slot)
+{
+	unsigned const mask = db.name_hash_size-1 ;
+	if (~0U == slot)
+		slot = nameHash(name,len) & mask ;
+	else
+		slot = (slot+1) & mask ;
+	for (unsigned probes = 0 ; db.name_hash[slot] && (probes < db.name_hash_size) ; probes++) {
+		unsigned const idx = db.name_hash[slot]-1 ;
+		if (idx < db.reg_count) {
+			struct regdb_reg_t const &r = db.regs[idx];
+			if ((r.namelen == len) && (0 == strncasecmp(db.strings+r.name,name,len)))
+				return idx ;
+		}
+		slot = (slot+1) & mask ;
+	}
+	return -1 ;
+}
+
+/*
+ * Case-insensitive ordering of names
+ */
+static int foldCompare(char const *lhs, unsigned llen, char const *rhs, unsigned rlen)
+{
+	unsigned const len = (llen < rlen) ? llen : rlen ;
+	for (unsigned i = 0 ; i < len ; i++) {
+		int const diff = tolower((unsigned char)lhs[i]) - tolower((unsigned char)rhs[i]);
+		if (diff)
+			return diff ;
+	}
+	return (llen < rlen) ? -1 : (llen > rlen);
+}
+
+/*
+ * Compares the start of a name with a pattern: 0 if the name begins
+ * with the pattern
+ */
+static int prefixCompare(char const *name, unsigned namelen, char const *pattern, unsigned len)
+{
+	return foldCompare(name, (namelen < len) ? namelen : len, pattern, len);
+}
+
+struct nameSort_t {
+	char const	*name ;
+	unsigned	 namelen ;
+	uint32_t	 reg ;
+	uint32_t	 offset ;
+};
+
+static int compareNames(void const *lhs, void const *rhs)
+{
+	struct nameSort_t const *l = (struct nameSort_t const *)lhs ;
+	struct nameSort_t const *r = (struct nameSort_t const *)rhs ;
+	int const diff = foldCompare(l->name,l->namelen,r->name,r->namelen);
+	if (diff)
+		return diff ;
+	return (l->reg < r->reg) ? -1 : (l->reg > r->reg);
+}
+
+/*
+ * Register names in case-insensitive order and a suffix array over
+ * all of the names, so that prefix and substring matches are found
+ * by binary search instead of by comparing every name.
+ */
+void regdbIndexNames(struct regdb_t &db, struct arena_t &arena)
+{
+	if (0 == db.name_index) {
+		struct nameSort_t *sorted = (struct nameSort_t *)malloc(db.reg_count*sizeof(sorted[0])+1);
+		for (unsigned i = 0 ; i < db.reg_count ; i++) {
+			sorted[i].name = db.strings+db.regs[i].name ;
+			sorted[i].namelen = db.regs[i].namelen ;
+			sorted[i].reg = i ;
+			sorted[i].offset = 0 ;
+		}
+		qsort(sorted,db.reg_count,sizeof(sorted[0]),compareNames);
+		uint32_t *index = (uint32_t *)arenaAlloc(arena,db.reg_count*sizeof(index[0]));
+		for (unsigned i = 0 ; i < db.reg_count ; i++)
+			index[i] = sorted[i].reg ;
+		free(sorted);
+		db.name_index = index ;
+	}
+	if (0 == db.suffixes) {
+		unsigned count = 0 ;
+		for (unsigned i = 0 ; i < db.reg_count ; i++)
+			count += db.regs[i].namelen ;
+		struct nameSort_t *sorted = (struct nameSort_t *)malloc(count*sizeof(sorted[0])+1);
+		struct nameSort_t *next = sorted ;
+		for (unsigned i = 0 ; i < db.reg_count ; i++) {
+			struct regdb_reg_t const &r = db.regs[i];
+			for (unsigned offs = 0 ; offs < r.namelen ; offs++, next++) {
+				next->name = db.strings+r.name+offs ;
+				next->namelen = r.namelen-offs ;
+				next->reg = i ;
+				next->offset = offs ;
+			}
+		}
+		qsort(sorted,count,sizeof(sorted[0]),compareNames);
+		struct regdb_suffix_t *suffixes = (struct regdb_suffix_t *)arenaAlloc(arena,count*sizeof(suffixes[0]));
+		for (unsigned i = 0 ; i < count ; i++) {
+			suffixes[i].reg = sorted[i].reg ;
+			suffixes[i].offset = sorted[i].offset ;
+		}
+		free(sorted);
+		db.suffixes = suffixes ;
+		db.suffix_count = count ;
+	}
+}
+
+/*
+ * Range [first,last) of the name index holding names which begin
+ * with prefix
+ */
+void regdbPrefixRange(struct regdb_t const &db, char const *prefix, unsigned len, unsigned &first, unsigned &last)
+{
+	unsigned lo = 0, hi = db.reg_count ;
+	while (lo < hi) {
+		unsigned const mid = lo + (hi-lo)/2 ;
+		struct regdb_reg_t const &r = db.regs[db.name_index[mid]];
+		if (prefixCompare(db.strings+r.name,r.namelen,prefix,len) < 0)
+			lo = mid+1 ;
+		else
+			hi = mid ;
+	}
+	first = lo ;
+	hi = db.reg_count ;
+	while (lo < hi) {
+		unsigned const mid = lo + (hi-lo)/2 ;
+		struct regdb_reg_t const &r = db.regs[db.name_index[mid]];
+		if (prefixCompare(db.strings+r.name,r.namelen,prefix,len) <= 0)
+			lo = mid+1 ;
+		else
+			hi = mid ;
+	}
+	last = lo ;
+}
+
+/*
+ * Range [first,last) of the suffix array holding suffixes which begin
+ * with pattern. A name containing the pattern more than once appears
+ * more than once.
+ */
+void regdbSubstringRange(struct regdb_t const &db, char const *pattern, unsigned len, unsigned &first, unsigned &last)
+{
+	unsigned lo = 0, hi = db.suffix_count ;
+	while (lo < hi) {
+		unsigned const mid = lo + (hi-lo)/2 ;
+		struct regdb_suffix_t const &sfx = db.suffixes[mid];
+		struct regdb_reg_t const &r = db.regs[sfx.reg];
+		if (prefixCompare(db.strings+r.name+sfx.offset,r.namelen-sfx.offset,pattern,len) < 0)
+			lo = mid+1 ;
+		else
+			hi = mid ;
+	}
+	first = lo ;
+	hi = db.suffix_count ;
+	while (lo < hi) {
+		unsigned const mid = lo + (hi-lo)/2 ;
+		struct regdb_suffix_t const &sfx = db.suffixes[mid];
+		struct regdb_reg_t const &r = db.regs[sfx.reg];
+		if (prefixCompare(db.strings+r.name+sfx.offset,r.namelen-sfx.offset,pattern,len) <= 0)
+			lo = mid+1 ;
+		else
+			hi = mid ;
+	}
+	last = lo ;
+}
+
+/*
+ * Interned string pool used while writing: each distinct name is
+ * stored once, NUL-terminated.
+ */
+struct stringPool_t {
+	char		*data ;
+	unsigned	 size ;
+	unsigned	 alloc ;
+	uint32_t	*slots ;	// offset+1 of string, 0 if empty
+	unsigned	 slotmask ;
+};
+
+static uint32_t intern(struct stringPool_t &pool, char const *s, unsigned len)
+{
+	unsigned slot = (unsigned)regdbHash(s,len) & pool.slotmask ;
+	while (pool.slots[slot]) {
+		char const *p = pool.data+pool.slots[slot]-1 ;
+		if ((0 == memcmp(p,s,len)) && ('\0' == p[len]))
+			return pool.slots[slot]-1 ;
+		slot = (slot+1) & pool.slotmask ;
+	}
+	if (pool.size+len+1 > pool.alloc) {
+		while (pool.size+len+1 > pool.alloc)
+			pool.alloc *= 2 ;
+		pool.data = (char *)realloc(pool.data,pool.alloc);
+	}
+	uint32_t const offs = pool.size ;
+	memcpy(pool.data+offs,s,len);
+	pool.data[offs+len] = '\0' ;
+	pool.size += len+1 ;
+	pool.slots[slot] = offs+1 ;
+	return offs ;
+}
+
+static bool writeAligned(FILE *fOut, void const *data, size_t len)
+{
+	static char const zeros[REGDB_ALIGN] = {0};
+	size_t const pad = (REGDB_ALIGN - (len % REGDB_ALIGN)) % REGDB_ALIGN ;
+	return (len == fwrite(data,1,len,fOut))
+		&& (pad == fwrite(zeros,1,pad,fOut));
+}
+
+static uint32_t alignUp(size_t len)
+{
+	return (uint32_t)((len + REGDB_ALIGN - 1) & ~(size_t)(REGDB_ALIGN-1));
+}
+
+static void addSection
+	( struct regdb_section_t *sections,
+	  void const **data,
+	  uint32_t &count,
+	  uint32_t type,
+	  uint32_t records,
+	  void const *ptr,
+	  size_t size )
+{
+	sections[count].type = type ;
+	sections[count].count = records ;
+	sections[count].offset = 0 ;
+	sections[count].size = size ;
+	data[count++] = ptr ;
+}
+
+bool regdbWrite(struct regdb_t const &db, char const *srcpath, char const *dbpath)
+{
+	struct regdb_header_t hdr ;
+	memset(&hdr,0,sizeof(hdr));
+	memcpy(hdr.magic,REGDB_MAGIC,sizeof(hdr.magic));
+	hdr.byte_order = REGDB_BYTE_ORDER ;
+	hdr.version = REGDB_VERSION ;
+	struct stat st ;
+	if ((0 != stat(srcpath,&st)) || !hashFile(srcpath,hdr.src_hash)) {
+		perror(srcpath);
+		return false ;
+	}
+	hdr.src_size = st.st_size ;
+	hdr.src_mtime = st.st_mtime ;
+
+	struct stringPool_t pool ;
+	pool.alloc = 4096 ;
+	pool.size = 0 ;
+	pool.data = (char *)malloc(pool.alloc);
+	unsigned slots = 64 ;
+	while (slots < 2*(db.reg_count+db.field_count))
+		slots *= 2 ;
+	pool.slots = (uint32_t *)calloc(slots,sizeof(pool.slots[0]));
+	pool.slotmask = slots-1 ;
+
+	struct regdb_reg_t *regs = (struct regdb_reg_t *)malloc(db.reg_count*sizeof(regs[0])+1);
+	for (unsigned i = 0 ; i < db.reg_count ; i++) {
+		regs[i] = db.regs[i];
+		regs[i].name = intern(pool,db.strings+db.regs[i].name,db.regs[i].namelen);
+	}
+	struct regdb_field_t *fields = (struct regdb_field_t *)malloc(db.field_count*sizeof(fields[0])+1);
+	for (unsigned i = 0 ; i < db.field_count ; i++) {
+		fields[i] = db.fields[i];
+		fields[i].name = intern(pool,db.strings+db.fields[i].name,db.fields[i].namelen);
+	}
+
+	struct regdb_section_t sections[REGDB_MAX_SECTIONS];
+	void const *data[REGDB_MAX_SECTIONS];
+	addSection(sections,data,hdr.section_count,REGDB_REGS,db.reg_count,regs,db.reg_count*sizeof(regs[0]));
+	addSection(sections,data,hdr.section_count,REGDB_FIELDS,db.field_count,fields,db.field_count*sizeof(fields[0]));
+	addSection(sections,data,hdr.section_count,REGDB_STRINGS,0,pool.data,pool.size);
+	addSection(sections,data,hdr.section_count,REGDB_NAMEHASH,db.name_hash_size,db.name_hash,db.name_hash_size*sizeof(db.name_hash[0]));
+	addSection(sections,data,hdr.section_count,REGDB_ADDRINDEX,db.reg_count,db.addr_index,db.reg_count*sizeof(db.addr_index[0]));
+	if (db.name_index)
+		addSection(sections,data,hdr.section_count,REGDB_NAMEINDEX,db.reg_count,db.name_index,db.reg_count*sizeof(db.name_index[0]));
+	if (db.suffixes)
+		addSection(sections,data,hdr.section_count,REGDB_SUFFIXES,db.suffix_count,db.suffixes,db.suffix_count*sizeof(db.suffixes[0]));
+
+	uint32_t offset = alignUp(sizeof(hdr)+hdr.section_count*sizeof(sections[0]));
+	for (unsigned i = 0 ; i < hdr.section_count ; i++) {
+		sections[i].offset = offset ;
+		offset += alignUp(sections[i].size);
+	}
+
+	/* write to a temporary and rename so readers never see a partial file */
+	unsigned const pathlen = strlen(dbpath);
+	char *tmpname = (char *)malloc(pathlen+5);
+	memcpy(tmpname,dbpath,pathlen);
+	strcpy(tmpname+pathlen,".tmp");
+	bool rval = false ;
+	FILE *fOut = fopen(tmpname,"wb");
+	if (fOut) {
+		rval = (1 == fwrite(&hdr,sizeof(hdr),1,fOut))
+			&& writeAligned(fOut,sections,hdr.section_count*sizeof(sections[0]));
+		for (unsigned i = 0 ; rval && (i < hdr.section_count) ; i++)
+			rval = writeAligned(fOut,data[i],sections[i].size);
+		if (0 != fclose(fOut))
+			rval = false ;
+		if (rval && (0 != rename(tmpname,dbpath)))
+			rval = false ;
+		if (!rval) {
+			perror(dbpath);
+			unlink(tmpname);
+		}
+	} else
+		perror(tmpname);
+
+	free(tmpname);
+	free(fields);
+	free(regs);
+	free(pool.slots);
+	free(pool.data);
+	return rval ;
+}
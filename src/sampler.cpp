@@ -0,0 +1,655 @@
+/*
+ * sampler.cpp - polling registers at a high rate
+ *
+ * Running devregs in a loop costs a process start, a database parse
+ * and fresh mappings per sample. Here the registers are resolved once
+ * to pointers into mappings that stay for the life of the process, so
+ * a pass of a sampling loop is nothing but the reads. What the loops
+ * record goes into a ring buffer allocated up front, and is formatted
+ * by the caller outside of the loop.
+ *
+ * The clock is only read when there is something to timestamp, and
+ * every so many passes to see whether the ring is due to be drained.
+ *
+ * Loops run flat out unless given a period, in which case each pass
+ * starts on a clock_nanosleep() to an absolute deadline and the actual
+ * intervals are kept as a histogram of 1us buckets for reporting
+ * jitter. For the least of it, the sampling thread can be pinned to a
+ * CPU and run SCHED_FIFO with its memory locked (sampleRealtime()).
+ *
+ * (c) Copyright 2010 by Boundary Devices under GPLv2
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include "devregs.h"
+
+#define DRAIN_PASSES	256		// passes between looks at the clock
+#define DRAIN_NS	20000000	// most time between drains
+#define HISTOGRAM_TABLE	4096		// initial size of a histogram hash table
+#define PACE_BUCKETS	65536		// 1us interval buckets, the last is for longer
+#define STACK_PREFAULT	(64*1024)
+
+volatile sig_atomic_t sample_stop = 0 ;
+
+static unsigned (*readFn)(void volatile *ptr, phys_addr_t addr, unsigned width);
+
+/* pacing of the calling thread, 0 to run flat out */
+static __thread struct samplePace_t *pace = 0 ;
+
+static void onSignal(int)
+{
+	sample_stop = 1 ;
+}
+
+/*
+ * Have ^C or a kill end sampling, rather than the process
+ */
+void sampleStopOnSignal(void)
+{
+	signal(SIGINT,onSignal);
+	signal(SIGTERM,onSignal);
+}
+
+/*
+ * Set sample_stop after ns, with a timer so sampling loops don't have
+ * to watch the clock
+ */
+void sampleStopAfter(uint64_t ns)
+{
+	struct itimerval it ;
+	memset(&it,0,sizeof(it));
+	it.it_value.tv_sec = ns/1000000000 ;
+	it.it_value.tv_usec = (ns%1000000000)/1000 ;
+	if ((0 == it.it_value.tv_sec) && (0 == it.it_value.tv_usec))
+		it.it_value.tv_usec = 1 ;
+	signal(SIGALRM,onSignal);
+	setitimer(ITIMER_REAL,&it,0);
+}
+
+uint64_t sampleNow(void)
+{
+	struct timespec ts ;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec ;
+}
+
+/*
+ * Start each pass of the sampling loops run by the calling thread ns
+ * after the previous one, keeping track of the intervals in p
+ */
+void samplePeriod(struct samplePace_t &p, uint64_t ns)
+{
+	memset(&p,0,sizeof(p));
+	p.period_ns = ns ;
+	p.min = ~0ULL ;
+	p.intervals = (uint64_t *)malloc(PACE_BUCKETS*sizeof(p.intervals[0]));
+	if (0 == p.intervals) {
+		perror("samplePeriod");
+		exit(1);
+	}
+	memset(p.intervals,0,PACE_BUCKETS*sizeof(p.intervals[0]));
+	pace = &p ;
+}
+
+/*
+ * Wait for the start of the next period and account for the interval
+ * since the last. If a pass overran, the periods it covered are
+ * skipped rather than run back to back.
+ */
+static void samplePace(struct samplePace_t &p)
+{
+	if (0 == p.next_wake)
+		p.next_wake = sampleNow();
+	struct timespec const ts = { (time_t)(p.next_wake/1000000000), (long)(p.next_wake%1000000000) };
+	while ((EINTR == clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,0)) && !sample_stop)
+		;
+	uint64_t const now = sampleNow();
+	if (p.last_wake) {
+		uint64_t const interval = now-p.last_wake ;
+		uint64_t const bucket = interval/1000 ;
+		p.intervals[(bucket < PACE_BUCKETS) ? bucket : PACE_BUCKETS-1]++ ;
+		p.count++ ;
+		p.sum += interval ;
+		if (interval < p.min)
+			p.min = interval ;
+		if (interval > p.max)
+			p.max = interval ;
+	}
+	p.last_wake = now ;
+	p.next_wake += p.period_ns ;
+	if (p.next_wake <= now) {
+		uint64_t const skip = (now-p.next_wake)/p.period_ns + 1 ;
+		p.missed += skip ;
+		p.next_wake += skip*p.period_ns ;
+	}
+}
+
+/*
+ * Report the sampling intervals achieved with a period
+ */
+void samplePrintPacing(FILE *f, struct samplePace_t const &p)
+{
+	if ((0 == p.period_ns) || (0 == p.count))
+		return ;
+	uint64_t const p99 = p.count - p.count/100 ;
+	uint64_t seen = 0 ;
+	unsigned bucket = 0 ;
+	while ((bucket < PACE_BUCKETS-1) && ((seen += p.intervals[bucket]) < p99))
+		bucket++ ;
+	double const p99us = (bucket < PACE_BUCKETS-1) ? bucket+1 : p.max/1000.0 ;
+	fprintf(f, "period %.3f us: %llu intervals, min %.3f avg %.3f max %.3f p99 <= %.0f us, %llu periods missed\n",
+		p.period_ns/1000.0, (unsigned long long)p.count,
+		p.min/1000.0, (double)p.sum/p.count/1000.0,
+		p.max/1000.0, p99us, (unsigned long long)p.missed);
+}
+
+/*
+ * Pin the calling thread to cpu (unless negative) and run it SCHED_FIFO
+ * at priority (unless 0), with all memory locked and some stack faulted
+ * in, so sampling isn't held up by the scheduler or page faults. Call
+ * once the buffers for sampling are allocated. Returns false after
+ * reporting an error.
+ */
+bool sampleRealtime(int cpu, int priority)
+{
+	if (0 <= cpu) {
+		cpu_set_t set ;
+		CPU_ZERO(&set);
+		CPU_SET(cpu,&set);
+		if (0 != sched_setaffinity(0,sizeof(set),&set)) {
+			perror("sched_setaffinity");
+			return false ;
+		}
+	}
+	if (0 != mlockall(MCL_CURRENT|MCL_FUTURE)) {
+		perror("mlockall");
+		return false ;
+	}
+	char volatile stack[STACK_PREFAULT];
+	for (unsigned i = 0 ; i < sizeof(stack) ; i += 256)
+		stack[i] = 0 ;
+	if (priority) {
+		struct sched_param param ;
+		memset(&param,0,sizeof(param));
+		param.sched_priority = priority ;
+		if (0 != sched_setscheduler(0,SCHED_FIFO,&param)) {
+			perror("sched_setscheduler");
+			return false ;
+		}
+	}
+	return true ;
+}
+
+/*
+ * Map the registers, all at once so neighbours share regions, and
+ * fill in their pointers
+ */
+void samplePrepare(struct sampleReg_t *regs, unsigned count)
+{
+	/* plan only those not in a region yet, e.g. on a repeated poll */
+	phys_addr_t *addrs = (phys_addr_t *)malloc((count+1)*sizeof(addrs[0]));
+	if (0 == addrs) {
+		perror("samplePrepare");
+		exit(1);
+	}
+	unsigned unmapped = 0 ;
+	for (unsigned i = 0 ; i < count ; i++) {
+		regs[i].ptr = physRegion(regs[i].address);
+		if (0 == regs[i].ptr)
+			addrs[unmapped++] = regs[i].address ;
+	}
+	physmemPlan(addrs,unmapped);
+	free(addrs);
+	for (unsigned i = 0 ; i < count ; i++) {
+		if (0 == regs[i].ptr)
+			regs[i].ptr = physMap(regs[i].address);
+	}
+	readFn = physmemBackend()->read ;
+}
+
+void sampleOnce(struct sampleReg_t const *regs, unsigned count, uint32_t *values)
+{
+	for (unsigned i = 0 ; i < count ; i++)
+		values[i] = readFn(regs[i].ptr,regs[i].address,regs[i].width);
+}
+
+/*
+ * Allocate a ring of at least minSize samples and touch all of it, so
+ * sampling doesn't take page faults
+ */
+void sampleRingInit(struct sampleRing_t &ring, unsigned minSize)
+{
+	unsigned size = 1024 ;
+	while (size < minSize)
+		size *= 2 ;
+	ring.samples = (struct sample_t *)malloc(size*sizeof(ring.samples[0]));
+	if (0 == ring.samples) {
+		perror("sampleRingInit");
+		exit(1);
+	}
+	memset(ring.samples,0,size*sizeof(ring.samples[0]));
+	ring.mask = size-1 ;
+	ring.head = ring.tail = 0 ;
+	ring.dropped = 0 ;
+	ring.watermark = 0 ;
+}
+
+/*
+ * Poll the registers until sample_stop is set, recording the value of
+ * a register in the ring whenever one of its mask bits changes. values
+ * holds the last value recorded for each register, starting with what
+ * the caller read. The ring is handed to drain when it is half full or
+ * has held samples for a while, and at the end.
+ *
+ * The ring needs room for twice the number of registers. Returns the
+ * number of passes made.
+ */
+uint64_t sampleWatch
+	( struct sampleReg_t const *regs,
+	  unsigned count,
+	  uint32_t *values,
+	  struct sampleRing_t &ring,
+	  sampleDrain_t drain,
+	  void *ctx )
+{
+	uint64_t passes = 0 ;
+	uint64_t lastDrain = sampleNow();
+	unsigned const half = (ring.mask+1)/2 ;
+	while (!sample_stop) {
+		if (pace)
+			samplePace(*pace);
+		uint64_t now = 0 ;
+		for (unsigned i = 0 ; i < count ; i++) {
+			struct sampleReg_t const &r = regs[i];
+			unsigned const v = readFn(r.ptr,r.address,r.width);
+			if (0 == ((v ^ values[i]) & r.mask))
+				continue;
+			if (0 == now)
+				now = sampleNow();
+			struct sample_t &s = ring.samples[ring.head++ & ring.mask];
+			s.ns = now ;
+			s.reg = i ;
+			s.value = v ;
+			values[i] = v ;
+		}
+		if (0 != (++passes % DRAIN_PASSES) && (ring.head-ring.tail < half))
+			continue;
+		if (ring.head == ring.tail)
+			continue;
+		if (0 == now)
+			now = sampleNow();
+		if ((ring.head-ring.tail >= half) || (now-lastDrain >= DRAIN_NS)) {
+			drain(ring,ctx);
+			lastDrain = now ;
+		}
+	}
+	if (ring.head != ring.tail)
+		drain(ring,ctx);
+	return passes ;
+}
+
+/*
+ * As sampleWatch(), for a consumer on another thread: the samples of a
+ * pass are published with a release store of head, and room is checked
+ * against an acquire load of tail. A change that finds the ring full
+ * is left pending rather than stall sampling, and is recorded on a
+ * later pass since values keeps what was last recorded. It's counted
+ * as dropped only once lost, when a newer change replaces it or
+ * sampling stops first. Samples are for register base+i.
+ *
+ * After publishing, the ring's watermark is moved up to tell a consumer
+ * merging several rings that no sample older than that is to come:
+ * when paced, to the start of the next pass before sleeping until it,
+ * so a slow group doesn't hold back the others for its whole period,
+ * else to the time now every so many passes.
+ */
+uint64_t sampleStream
+	( struct sampleReg_t const *regs,
+	  unsigned count,
+	  unsigned base,
+	  uint32_t *values,
+	  struct sampleRing_t &ring )
+{
+	uint64_t passes = 0 ;
+	unsigned head = ring.head ;
+	/* the last value read of each register, recorded or pending */
+	uint32_t *seen = (uint32_t *)malloc((count+1)*sizeof(seen[0]));
+	if (0 == seen) {
+		perror("sampleStream");
+		return 0 ;
+	}
+	memcpy(seen,values,count*sizeof(seen[0]));
+	while (!sample_stop) {
+		if (pace) {
+			samplePace(*pace);
+			/* woken early, before the watermark */
+			if (sample_stop)
+				break ;
+		}
+		uint64_t now = 0 ;
+		for (unsigned i = 0 ; i < count ; i++) {
+			struct sampleReg_t const &r = regs[i];
+			unsigned const v = readFn(r.ptr,r.address,r.width);
+			if ((v ^ seen[i]) & r.mask) {
+				/* replacing a change that's still pending */
+				if ((seen[i] ^ values[i]) & r.mask)
+					ring.dropped++ ;
+				seen[i] = v ;
+			}
+			if (0 == ((v ^ values[i]) & r.mask))
+				continue;
+			if (head - __atomic_load_n(&ring.tail,__ATOMIC_ACQUIRE) > ring.mask)
+				continue;
+			if (0 == now)
+				now = sampleNow();
+			struct sample_t &s = ring.samples[head++ & ring.mask];
+			s.ns = now ;
+			s.reg = base+i ;
+			s.value = v ;
+			values[i] = v ;
+		}
+		if (now)
+			__atomic_store_n(&ring.head,head,__ATOMIC_RELEASE);
+		passes++ ;
+		if (pace)
+			__atomic_store_n(&ring.watermark,pace->next_wake,__ATOMIC_RELEASE);
+		else if (0 == passes % DRAIN_PASSES)
+			__atomic_store_n(&ring.watermark,sampleNow(),__ATOMIC_RELEASE);
+	}
+	for (unsigned i = 0 ; i < count ; i++) {
+		if ((seen[i] ^ values[i]) & regs[i].mask)
+			ring.dropped++ ;
+	}
+	free(seen);
+	return passes ;
+}
+
+static void *groupThread(void *arg)
+{
+	struct sampleGroup_t &g = *(struct sampleGroup_t *)arg ;
+	if (g.period_ns)
+		samplePeriod(g.pace,g.period_ns);
+	if ((g.priority || (0 <= g.cpu)) && !sampleRealtime(g.cpu,g.priority)) {
+		g.failed = true ;
+		sample_stop = 1 ;
+		return 0 ;
+	}
+	g.passes = sampleStream(g.regs,g.count,g.base,g.values,g.ring);
+	return 0 ;
+}
+
+/*
+ * Start a thread sampling the group into its ring, with its own period,
+ * CPU and priority. The registers need to be prepared and the ring set
+ * up. Returns false after reporting an error.
+ */
+bool sampleGroupStart(struct sampleGroup_t &g)
+{
+	g.passes = 0 ;
+	g.failed = false ;
+	int const err = pthread_create(&g.thread,0,groupThread,&g);
+	if (err) {
+		fprintf(stderr, "unable to start sampling thread: %s\n", strerror(err));
+		return false ;
+	}
+	return true ;
+}
+
+/*
+ * Wait for the thread of a group to end, once sample_stop is set.
+ * Returns false if it failed to start sampling.
+ */
+bool sampleGroupJoin(struct sampleGroup_t &g)
+{
+	pthread_join(g.thread,0);
+	return !g.failed ;
+}
+
+static bool triggerFires(struct trigger_t const &t, unsigned v, unsigned prev)
+{
+	v = (v >> t.shift) & t.mask ;
+	switch (t.op) {
+	case TRIGGER_EQ:
+		return v == t.value ;
+	case TRIGGER_NE:
+		return v != t.value ;
+	case TRIGGER_BECOMES:
+		return (v == t.value) && (((prev >> t.shift) & t.mask) != t.value) ;
+	case TRIGGER_CHANGE:
+		return v != ((prev >> t.shift) & t.mask) ;
+	}
+	return false ;
+}
+
+/*
+ * Rotate the rows of a capture so the oldest comes first
+ */
+static void unwrapRows(struct sampleCapture_t &cap, unsigned count, unsigned next, unsigned size)
+{
+	if (cap.taken < size) {
+		cap.rows = cap.taken ;
+		return ;
+	}
+	cap.rows = size ;
+	uint64_t *ns = (uint64_t *)malloc(size*sizeof(ns[0]));
+	uint32_t *values = (uint32_t *)malloc((size_t)size*count*sizeof(values[0]));
+	unsigned const tail = size-next ;
+	memcpy(ns,cap.ns+next,tail*sizeof(ns[0]));
+	memcpy(ns+tail,cap.ns,next*sizeof(ns[0]));
+	memcpy(values,cap.values+(size_t)next*count,(size_t)tail*count*sizeof(values[0]));
+	memcpy(values+(size_t)tail*count,cap.values,(size_t)next*count*sizeof(values[0]));
+	free(cap.ns);
+	free(cap.values);
+	cap.ns = ns ;
+	cap.values = values ;
+}
+
+/*
+ * Sample the registers into a ring of pre+1+post rows until the
+ * trigger fires, then for post more rows, like a logic analyzer. The
+ * rows are allocated and touched before sampling starts.
+ *
+ * Returns false if sample_stop was set before the trigger fired, with
+ * the last rows sampled in the capture all the same.
+ */
+bool sampleTrigger
+	( struct sampleReg_t const *regs,
+	  unsigned count,
+	  struct trigger_t const &trigger,
+	  unsigned pre,
+	  unsigned post,
+	  struct sampleCapture_t &cap )
+{
+	unsigned const size = pre+1+post ;
+	cap.ns = (uint64_t *)malloc(size*sizeof(cap.ns[0]));
+	cap.values = (uint32_t *)malloc((size_t)size*count*sizeof(cap.values[0]));
+	if ((0 == cap.ns) || (0 == cap.values)) {
+		perror("sampleTrigger");
+		exit(1);
+	}
+	memset(cap.ns,0,size*sizeof(cap.ns[0]));
+	memset(cap.values,0,(size_t)size*count*sizeof(cap.values[0]));
+
+	struct sampleReg_t const &treg = regs[trigger.reg];
+	unsigned prev = readFn(treg.ptr,treg.address,treg.width);
+	unsigned next = 0 ;
+	uint64_t fired = 0 ;
+	uint64_t end = ~0ULL ;
+	for (cap.taken = 0 ; (cap.taken < end) && !sample_stop ; cap.taken++) {
+		if (pace)
+			samplePace(*pace);
+		uint32_t *row = cap.values+(size_t)next*count ;
+		cap.ns[next] = sampleNow();
+		for (unsigned i = 0 ; i < count ; i++)
+			row[i] = readFn(regs[i].ptr,regs[i].address,regs[i].width);
+		if (++next == size)
+			next = 0 ;
+		if ((~0ULL == end) && triggerFires(trigger,row[trigger.reg],prev)) {
+			fired = cap.taken ;
+			end = cap.taken+1+post ;
+		}
+		prev = row[trigger.reg];
+	}
+	unwrapRows(cap,count,next,size);
+	if (~0ULL == end) {
+		cap.trigger = cap.rows ;
+		return false ;
+	}
+	cap.trigger = cap.rows-(cap.taken-fired);
+	return true ;
+}
+
+/*
+ * Poll a register until the trigger fires, leaving its value in value.
+ * Returns false if timeout_ns passed or sample_stop was set first.
+ */
+bool samplePoll
+	( struct sampleReg_t const &reg,
+	  struct trigger_t const &trigger,
+	  uint64_t timeout_ns,
+	  unsigned &value )
+{
+	uint64_t const end = sampleNow()+timeout_ns ;
+	unsigned prev = value = readFn(reg.ptr,reg.address,reg.width);
+	for (uint64_t passes = 1 ; !sample_stop ; passes++) {
+		value = readFn(reg.ptr,reg.address,reg.width);
+		if (triggerFires(trigger,value,prev))
+			return true ;
+		prev = value ;
+		if ((0 == passes % DRAIN_PASSES) && (sampleNow() >= end))
+			break ;
+	}
+	return false ;
+}
+
+void histogramInit(struct histogram_t &h, unsigned shift, unsigned bitcount)
+{
+	h.shift = shift ;
+	h.mask = 0xffffffff >> (32-bitcount);
+	h.counts = 0 ;
+	h.table = 0 ;
+	h.table_mask = 0 ;
+	h.used = 0 ;
+	if (bitcount <= HISTOGRAM_DENSE_BITS) {
+		/* touched now rather than faulted in while sampling */
+		h.counts = (uint64_t *)malloc((h.mask+1)*sizeof(h.counts[0]));
+		if (h.counts)
+			memset(h.counts,0,(h.mask+1)*sizeof(h.counts[0]));
+	} else {
+		h.table = (struct histEntry_t *)calloc(HISTOGRAM_TABLE,sizeof(h.table[0]));
+		h.table_mask = HISTOGRAM_TABLE-1 ;
+	}
+	if ((0 == h.counts) && (0 == h.table)) {
+		perror("histogramInit");
+		exit(1);
+	}
+}
+
+static struct histEntry_t *histogramSlot(struct histEntry_t *table, unsigned mask, uint32_t value)
+{
+	/* the top bits of the product depend on all of the value */
+	unsigned slot = (uint32_t)(value * 0x9e3779b1u) >> (32 - __builtin_popcount(mask)) ;
+	while (table[slot].count && (table[slot].value != value))
+		slot = (slot+1) & mask ;
+	return table+slot ;
+}
+
+/*
+ * Double the hash table once it is three quarters full
+ */
+static void histogramGrow(struct histogram_t &h)
+{
+	unsigned const size = 2*(h.table_mask+1);
+	struct histEntry_t *table = (struct histEntry_t *)calloc(size,sizeof(table[0]));
+	if (0 == table) {
+		perror("histogramGrow");
+		exit(1);
+	}
+	for (unsigned i = 0 ; i <= h.table_mask ; i++) {
+		if (h.table[i].count)
+			*histogramSlot(table,size-1,h.table[i].value) = h.table[i];
+	}
+	free(h.table);
+	h.table = table ;
+	h.table_mask = size-1 ;
+}
+
+/*
+ * Count the values of the field until sample_stop is set, returns the
+ * number of samples
+ */
+uint64_t sampleHistogram(struct sampleReg_t const &reg, struct histogram_t &h)
+{
+	uint64_t samples = 0 ;
+	unsigned const shift = h.shift ;
+	unsigned const mask = h.mask ;
+	if (h.counts) {
+		uint64_t *counts = h.counts ;
+		while (!sample_stop) {
+			if (pace)
+				samplePace(*pace);
+			counts[(readFn(reg.ptr,reg.address,reg.width) >> shift) & mask]++ ;
+			samples++ ;
+		}
+		return samples ;
+	}
+	while (!sample_stop) {
+		if (pace)
+			samplePace(*pace);
+		uint32_t const v = (readFn(reg.ptr,reg.address,reg.width) >> shift) & mask ;
+		struct histEntry_t *e = histogramSlot(h.table,h.table_mask,v);
+		if (0 == e->count++) {
+			e->value = v ;
+			if (++h.used > 3*(h.table_mask+1)/4)
+				histogramGrow(h);
+		}
+		samples++ ;
+	}
+	return samples ;
+}
+
+static int compareHistEntry(void const *lhs, void const *rhs)
+{
+	uint32_t const l = ((struct histEntry_t const *)lhs)->value ;
+	uint32_t const r = ((struct histEntry_t const *)rhs)->value ;
+	return (l < r) ? -1 : (l > r);
+}
+
+/*
+ * The values seen and their counts in order of value, in an array to
+ * be freed by the caller. Returns the number of values.
+ */
+unsigned histogramValues(struct histogram_t const &h, struct histEntry_t *&values)
+{
+	unsigned n = 0 ;
+	if (h.counts) {
+		for (unsigned v = 0 ; v <= h.mask ; v++)
+			n += (0 != h.counts[v]);
+		values = (struct histEntry_t *)malloc((n+1)*sizeof(values[0]));
+		n = 0 ;
+		for (unsigned v = 0 ; v <= h.mask ; v++) {
+			if (h.counts[v]) {
+				values[n].value = v ;
+				values[n++].count = h.counts[v];
+			}
+		}
+		return n ;
+	}
+	values = (struct histEntry_t *)malloc((h.used+1)*sizeof(values[0]));
+	for (unsigned i = 0 ; i <= h.table_mask ; i++) {
+		if (h.table[i].count)
+			values[n++] = h.table[i];
+	}
+	qsort(values,n,sizeof(values[0]),compareHistEntry);
+	return n ;
+}
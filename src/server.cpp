@@ -0,0 +1,578 @@
+/*
+ * server.cpp - register access daemon on a Unix domain socket
+ *
+ * Monitoring processes that each run devregs pay for CPU detection,
+ * the database and fresh mappings every time. The daemon (--serve)
+ * does that once and answers small binary requests (see devregs.h)
+ * from any number of local clients, such as devregs --connect.
+ *
+ * Each client gets a thread. Requests are handled in the order they
+ * arrive and their replies are gathered until the client has no more
+ * requests waiting, so a client that pipelines many requests gets its
+ * replies in few writes.
+ *
+ * Every register of the database is resolved to its mapping up front,
+ * and requests only read tables that no longer change, so reads take
+ * no lock at all. Writes are read-modify-write and take one of a set
+ * of locks picked by address, so they only ever wait for writes that
+ * may be to the same register, and never hold up reads.
+ *
+ * Latency counters are kept per kind of request, from the request
+ * being taken from the input to its reply being ready, and can be
+ * asked for like anything else (SERVER_STATS).
+ *
+ * (c) Copyright 2010 by Boundary Devices under GPLv2
+ *
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "devregs.h"
+
+#define SERVER_INBUF		65536
+#define SERVER_WRITE_LOCKS	64		// power of 2
+#define SERVER_MAXNAME		255
+#define SERVER_BACKLOG		16
+#define SERVER_MAXREPLY		(64<<20)	// well above a full snapshot
+
+struct server_t {
+	struct regdb_t const		 *defs ;
+	unsigned			  cpu ;
+	struct physmemBackend_t const	 *backend ;
+	void volatile			**ptrs ;	// mapping of each register
+	pthread_mutex_t			  write_locks[SERVER_WRITE_LOCKS];
+	struct serverStats_t		  stats[SERVER_OPS];
+};
+
+static struct server_t server ;
+
+static void *outAlloc(struct serverBuf_t &out, size_t len)
+{
+	if (out.used + len > out.size) {
+		while (out.used + len > out.size)
+			out.size = out.size ? 2*out.size : SERVER_INBUF ;
+		out.data = (uint8_t *)realloc(out.data,out.size);
+		if (0 == out.data) {
+			perror("server");
+			exit(1);
+		}
+	}
+	void *p = out.data+out.used ;
+	out.used += len ;
+	return p ;
+}
+
+static void outPut(struct serverBuf_t &out, void const *data, size_t len)
+{
+	memcpy(outAlloc(out,len),data,len);
+}
+
+static bool writeAll(int fd, void const *data, size_t len)
+{
+	uint8_t const *p = (uint8_t const *)data ;
+	while (len) {
+		ssize_t const n = write(fd,p,len);
+		if ((0 > n) && (EINTR == errno))
+			continue;
+		if (0 >= n)
+			return false ;
+		p += n ;
+		len -= n ;
+	}
+	return true ;
+}
+
+static void countLatency(unsigned op, uint64_t ns)
+{
+	struct serverStats_t &s = server.stats[op];
+	unsigned bucket = 0 ;
+	while ((bucket < SERVER_BUCKETS-1) && (ns >> (bucket+1)))
+		bucket++ ;
+	__atomic_fetch_add(&s.count,1,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&s.total_ns,ns,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&s.buckets[bucket],1,__ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&s.max_ns,__ATOMIC_RELAXED);
+	while ((ns > max)
+	       && !__atomic_compare_exchange_n(&s.max_ns,&max,ns,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * The register a request is for: REG[.FIELD] by exact name, or the
+ * register holding address. Returns its index or a negative errno, and
+ * the field if one is named.
+ */
+static int findReg
+	( struct serverRequest_t const &req,
+	  char const *name,
+	  struct regdb_field_t const *&field )
+{
+	struct regdb_t const &defs = *server.defs ;
+	field = 0 ;
+	char const *dot = req.namelen ? (char const *)memchr(name,'.',req.namelen) : 0 ;
+	unsigned const len = dot ? dot-name : req.namelen ;
+	unsigned slot = ~0U ;
+	int const idx = len ? regdbFindName(defs,name,len,slot) : regdbFindAddress(defs,req.address);
+	if (0 > idx)
+		return -ENOENT ;
+	if (dot) {
+		unsigned const flen = req.namelen-len-1 ;
+		struct regdb_reg_t const &r = defs.regs[idx];
+		for (unsigned i = 0 ; (i < r.field_count) && !field ; i++) {
+			struct regdb_field_t const &f = defs.fields[r.field_first+i];
+			if ((f.namelen == flen) && (0 == strncasecmp(defs.strings+f.name,dot+1,flen)))
+				field = &f ;
+		}
+		if (0 == field)
+			return -ENOENT ;
+	}
+	return server.ptrs[idx] ? idx : -ENXIO ;
+}
+
+static uint32_t fieldBits(unsigned startbit, unsigned bitcount)
+{
+	return (0xffffffff >> (32-bitcount)) << startbit ;
+}
+
+/*
+ * Append the reply to req, returns its offset in out
+ */
+static size_t putReply
+	( struct serverBuf_t &out,
+	  struct serverRequest_t const &req,
+	  int status,
+	  uint32_t length )
+{
+	struct serverReply_t reply ;
+	memset(&reply,0,sizeof(reply));
+	reply.tag = req.tag ;
+	reply.status = status ;
+	reply.length = length ;
+	size_t const at = out.used ;
+	outPut(out,&reply,sizeof(reply));
+	return at ;
+}
+
+static struct serverReply_t *replyAt(struct serverBuf_t &out, size_t at)
+{
+	return (struct serverReply_t *)(out.data+at);
+}
+
+/*
+ * Append the reply to req for register idx, with its name as data, or
+ * an error if idx is a negative errno. Returns its offset in out.
+ */
+static size_t regReply
+	( struct serverBuf_t &out,
+	  struct serverRequest_t const &req,
+	  int idx )
+{
+	if (0 > idx)
+		return putReply(out,req,idx,0);
+	struct regdb_reg_t const &r = server.defs->regs[idx];
+	size_t const at = putReply(out,req,0,r.namelen);
+	struct serverReply_t *reply = replyAt(out,at);
+	reply->address = r.address ;
+	reply->width = r.width ;
+	reply->namelen = r.namelen ;
+	outPut(out,server.defs->strings+r.name,r.namelen);
+	return at ;
+}
+
+static void serveRead(struct serverBuf_t &out, struct serverRequest_t const &req, char const *name)
+{
+	struct regdb_field_t const *field ;
+	int const idx = findReg(req,name,field);
+	size_t const at = regReply(out,req,idx);
+	if (0 <= idx) {
+		struct regdb_reg_t const &r = server.defs->regs[idx];
+		replyAt(out,at)->value = server.backend->read(server.ptrs[idx],r.address,r.width);
+	}
+}
+
+static void serveWrite(struct serverBuf_t &out, struct serverRequest_t const &req, char const *name)
+{
+	struct regdb_field_t const *field ;
+	int idx = findReg(req,name,field);
+	uint32_t mask = 0, value = req.value ;
+	if ((0 <= idx) && (0 == req.namelen) && (req.address != server.defs->regs[idx].address)) {
+		/* only reads may address a register by a byte inside it */
+		idx = -EINVAL ;
+	} else if (0 <= idx) {
+		struct regdb_reg_t const &r = server.defs->regs[idx];
+		uint32_t const all = fieldBits(0,8*r.width);
+		if (field) {
+			mask = fieldBits(field->startbit,field->bitcount);
+			if (value > (mask >> field->startbit))
+				idx = -EINVAL ;
+			value <<= field->startbit ;
+		} else {
+			mask = req.mask ? req.mask : all ;
+			if ((mask & ~all) || (value & ~mask))
+				idx = -EINVAL ;
+		}
+	}
+	size_t const at = regReply(out,req,idx);
+	if (0 > idx)
+		return ;
+	struct regdb_reg_t const &r = server.defs->regs[idx];
+	void volatile *ptr = server.ptrs[idx];
+	pthread_mutex_t *lock = server.write_locks + ((r.address >> 2) & (SERVER_WRITE_LOCKS-1));
+	pthread_mutex_lock(lock);
+	uint32_t const old = server.backend->read(ptr,r.address,r.width);
+	value = (old & ~mask) | value ;
+	server.backend->write(ptr,r.address,r.width,value);
+	pthread_mutex_unlock(lock);
+	struct serverReply_t *reply = replyAt(out,at);
+	reply->old = old ;
+	reply->value = value ;
+}
+
+/*
+ * A read, with the fields of the register following its name
+ */
+static void serveDecode(struct serverBuf_t &out, struct serverRequest_t const &req, char const *name)
+{
+	struct regdb_field_t const *field ;
+	int const idx = findReg(req,name,field);
+	size_t const at = regReply(out,req,idx);
+	if (0 > idx)
+		return ;
+	struct regdb_t const &defs = *server.defs ;
+	struct regdb_reg_t const &r = defs.regs[idx];
+	uint32_t const value = server.backend->read(server.ptrs[idx],r.address,r.width);
+	uint32_t length = r.namelen ;
+	for (unsigned i = 0 ; i < r.field_count ; i++) {
+		struct regdb_field_t const &f = defs.fields[r.field_first+i];
+		if (field && (field != &f))
+			continue;
+		struct serverField_t sf ;
+		sf.startbit = f.startbit ;
+		sf.bitcount = f.bitcount ;
+		sf.namelen = f.namelen ;
+		outPut(out,&sf,sizeof(sf));
+		outPut(out,defs.strings+f.name,f.namelen);
+		length += sizeof(sf)+f.namelen ;
+	}
+	struct serverReply_t *reply = replyAt(out,at);
+	reply->value = value ;
+	reply->length = length ;
+}
+
+/*
+ * Every register of the database, read in address order, as the data
+ * of a snapshot file. Those that couldn't be mapped read as 0.
+ */
+static void serveSnapshot(struct serverBuf_t &out, struct serverRequest_t const &req)
+{
+	struct regdb_t const &defs = *server.defs ;
+	unsigned const count = defs.reg_count ;
+	size_t const length = sizeof(struct snapshot_header_t)
+			      + count*(sizeof(struct snapshot_reg_t)+sizeof(uint32_t));
+	putReply(out,req,0,length);
+	struct snapshot_header_t *header = (struct snapshot_header_t *)outAlloc(out,length);
+	struct snapshot_reg_t *recs = (struct snapshot_reg_t *)(header+1);
+	uint32_t *values = (uint32_t *)(recs+count);
+	memset(header,0,sizeof(*header));
+	memcpy(header->magic,SNAPSHOT_MAGIC,sizeof(header->magic));
+	header->version = SNAPSHOT_VERSION ;
+	header->byte_order = SNAPSHOT_BYTE_ORDER ;
+	header->cpu = server.cpu ;
+	header->reg_count = count ;
+	header->db_hash = regdbRegsHash(defs);
+	struct timespec now ;
+	clock_gettime(CLOCK_REALTIME,&now);
+	header->time_ns = (int64_t)now.tv_sec*1000000000 + now.tv_nsec ;
+	uint64_t const start = sampleNow();
+	for (unsigned i = 0 ; i < count ; i++) {
+		unsigned const idx = defs.addr_index[i];
+		struct regdb_reg_t const &r = defs.regs[idx];
+		values[idx] = server.ptrs[idx]
+			      ? server.backend->read(server.ptrs[idx],r.address,r.width) : 0 ;
+	}
+	header->capture_ns = sampleNow()-start ;
+	for (unsigned i = 0 ; i < count ; i++) {
+		recs[i].address = defs.regs[i].address ;
+		recs[i].width = defs.regs[i].width ;
+		recs[i].reg = i ;
+	}
+}
+
+static void serveStats(struct serverBuf_t &out, struct serverRequest_t const &req)
+{
+	putReply(out,req,0,sizeof(server.stats));
+	struct serverStats_t *stats = (struct serverStats_t *)outAlloc(out,sizeof(server.stats));
+	for (unsigned op = 0 ; op < SERVER_OPS ; op++) {
+		struct serverStats_t const &s = server.stats[op];
+		stats[op].count = __atomic_load_n(&s.count,__ATOMIC_RELAXED);
+		stats[op].total_ns = __atomic_load_n(&s.total_ns,__ATOMIC_RELAXED);
+		stats[op].max_ns = __atomic_load_n(&s.max_ns,__ATOMIC_RELAXED);
+		for (unsigned b = 0 ; b < SERVER_BUCKETS ; b++)
+			stats[op].buckets[b] = __atomic_load_n(&s.buckets[b],__ATOMIC_RELAXED);
+	}
+}
+
+static void serveRequest(struct serverBuf_t &out, struct serverRequest_t const &req, char const *name)
+{
+	uint64_t const start = sampleNow();
+	switch (req.op) {
+	case SERVER_READ:
+		serveRead(out,req,name);
+		break;
+	case SERVER_WRITE:
+		serveWrite(out,req,name);
+		break;
+	case SERVER_DECODE:
+		serveDecode(out,req,name);
+		break;
+	case SERVER_SNAPSHOT:
+		serveSnapshot(out,req);
+		break;
+	case SERVER_STATS:
+		serveStats(out,req);
+		break;
+	default:
+		putReply(out,req,-EPROTO,0);
+		return ;
+	}
+	countLatency(req.op,sampleNow()-start);
+}
+
+static void *clientThread(void *arg)
+{
+	int const fd = (int)(intptr_t)arg ;
+	uint8_t *in = (uint8_t *)malloc(SERVER_INBUF);
+	if (0 == in) {
+		perror("server");
+		close(fd);
+		return 0 ;
+	}
+	struct serverBuf_t out = { 0, 0, 0 };
+	size_t have = 0 ;
+	for (;;) {
+		ssize_t const n = read(fd,in+have,SERVER_INBUF-have);
+		if ((0 > n) && (EINTR == errno))
+			continue;
+		if (0 >= n)
+			break ;
+		have += n ;
+		size_t used = 0 ;
+		bool bad = false ;
+		while (have-used >= sizeof(struct serverRequest_t)) {
+			struct serverRequest_t req ;
+			memcpy(&req,in+used,sizeof(req));
+			if (req.namelen > SERVER_MAXNAME) {
+				bad = true ;
+				break ;
+			}
+			if (have-used < sizeof(req)+req.namelen)
+				break ;
+			serveRequest(out,req,(char const *)in+used+sizeof(req));
+			used += sizeof(req)+req.namelen ;
+		}
+		memmove(in,in+used,have-used);
+		have -= used ;
+		if (bad || (out.used && !writeAll(fd,out.data,out.used)))
+			break ;
+		out.used = 0 ;
+	}
+	close(fd);
+	free(in);
+	free(out.data);
+	return 0 ;
+}
+
+/*
+ * Print the latency counters of each kind of request
+ */
+void serverPrintStats(FILE *f, struct serverStats_t const *stats)
+{
+	static char const *const names[SERVER_OPS] = {
+		"read", "write", "decode", "snapshot", "stats"
+	};
+	for (unsigned op = 0 ; op < SERVER_OPS ; op++) {
+		struct serverStats_t const &s = stats[op];
+		if (0 == s.count)
+			continue;
+		uint64_t const p99 = s.count - s.count/100 ;
+		uint64_t seen = 0 ;
+		unsigned bucket = 0 ;
+		while ((bucket < SERVER_BUCKETS-1) && ((seen += s.buckets[bucket]) < p99))
+			bucket++ ;
+		fprintf(f, "%-8s %10llu requests, avg %.3f max %.3f p99 < %.3f us\n", names[op],
+			(unsigned long long)s.count, (double)s.total_ns/s.count/1000.0,
+			s.max_ns/1000.0, (double)(2ULL << bucket)/1000.0);
+	}
+}
+
+/*
+ * Serve the registers of defs on a socket at path until interrupted.
+ * Returns 0, or 1 after reporting an error.
+ */
+int serverRun(char const *path, struct regdb_t const *defs, unsigned cpu)
+{
+	server.defs = defs ;
+	server.cpu = cpu ;
+	server.backend = physmemBackend();
+	for (unsigned i = 0 ; i < SERVER_WRITE_LOCKS ; i++)
+		pthread_mutex_init(server.write_locks+i,0);
+
+	unsigned const count = defs->reg_count ;
+	phys_addr_t *addrs = (phys_addr_t *)malloc((count+1)*sizeof(addrs[0]));
+	for (unsigned i = 0 ; i < count ; i++)
+		addrs[i] = defs->regs[i].address ;
+	physmemPlan(addrs,count);
+	free(addrs);
+	server.ptrs = (void volatile **)malloc((count+1)*sizeof(server.ptrs[0]));
+	unsigned mapped = 0 ;
+	for (unsigned i = 0 ; i < count ; i++)
+		mapped += (0 != (server.ptrs[i] = physRegion(defs->regs[i].address)));
+
+	struct sockaddr_un sa ;
+	memset(&sa,0,sizeof(sa));
+	sa.sun_family = AF_UNIX ;
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return 1 ;
+	}
+	strcpy(sa.sun_path,path);
+	/* replace a socket left behind, but nothing else */
+	struct stat st ;
+	if (0 == lstat(path,&st)) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "%s: exists and is not a socket\n", path);
+			return 1 ;
+		}
+		unlink(path);
+	}
+	int const fd = socket(AF_UNIX,SOCK_STREAM,0);
+	mode_t const mask = umask(077);
+	bool const bound = (0 <= fd) && (0 == bind(fd,(struct sockaddr *)&sa,sizeof(sa)));
+	umask(mask);
+	if (!bound || (0 != listen(fd,SERVER_BACKLOG))) {
+		perror(path);
+		if (0 <= fd)
+			close(fd);
+		return 1 ;
+	}
+	signal(SIGPIPE,SIG_IGN);
+	sampleStopOnSignal();
+	printf("serving %u of %u registers on %s\n", mapped, count, path);
+	fflush(stdout);
+	while (!sample_stop) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		if (1 != poll(&pfd,1,200))
+			continue;
+		int const client = accept(fd,0,0);
+		if (0 > client)
+			continue;
+		pthread_t thread ;
+		int const err = pthread_create(&thread,0,clientThread,(void *)(intptr_t)client);
+		if (err) {
+			fprintf(stderr, "%s: unable to start client thread: %s\n", path, strerror(err));
+			close(client);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	close(fd);
+	unlink(path);
+	serverPrintStats(stderr,server.stats);
+	return 0 ;
+}
+
+/*
+ * Connect to a daemon, returns the socket or -1 after reporting an
+ * error
+ */
+int serverConnect(char const *path)
+{
+	struct sockaddr_un sa ;
+	memset(&sa,0,sizeof(sa));
+	sa.sun_family = AF_UNIX ;
+	strncpy(sa.sun_path,path,sizeof(sa.sun_path)-1);
+	int const fd = socket(AF_UNIX,SOCK_STREAM,0);
+	if ((0 > fd) || (0 != connect(fd,(struct sockaddr *)&sa,sizeof(sa)))) {
+		perror(path);
+		if (0 <= fd)
+			close(fd);
+		return -1 ;
+	}
+	return fd ;
+}
+
+/*
+ * Append a request to buf, to be sent with others in one write
+ */
+void serverRequest
+	( struct serverBuf_t &buf,
+	  unsigned op,
+	  char const *name,
+	  uint64_t address,
+	  uint32_t value,
+	  uint32_t mask,
+	  uint32_t tag )
+{
+	struct serverRequest_t req ;
+	memset(&req,0,sizeof(req));
+	req.op = op ;
+	req.tag = tag ;
+	req.address = address ;
+	req.value = value ;
+	req.mask = mask ;
+	req.namelen = name ? strlen(name) : 0 ;
+	outPut(buf,&req,sizeof(req));
+	outPut(buf,name,req.namelen);
+}
+
+bool serverSend(int fd, struct serverBuf_t &buf)
+{
+	bool const ok = writeAll(fd,buf.data,buf.used);
+	buf.used = 0 ;
+	return ok ;
+}
+
+static bool readAll(int fd, void *data, size_t len)
+{
+	uint8_t *p = (uint8_t *)data ;
+	while (len) {
+		ssize_t const n = read(fd,p,len);
+		if ((0 > n) && (EINTR == errno))
+			continue;
+		if (0 >= n)
+			return false ;
+		p += n ;
+		len -= n ;
+	}
+	return true ;
+}
+
+/*
+ * Read the next reply and its data, which stays valid until the next
+ * call. Returns false if the connection ended.
+ */
+bool serverReceive(int fd, struct serverReply_t &reply, uint8_t const *&data)
+{
+	static struct serverBuf_t in = { 0, 0, 0 };
+	if (!readAll(fd,&reply,sizeof(reply)))
+		return false ;
+	if (reply.length > SERVER_MAXREPLY) {
+		fprintf(stderr, "server reply of %u bytes\n", reply.length);
+		return false ;
+	}
+	in.used = 0 ;
+	uint8_t *p = (uint8_t *)outAlloc(in,(size_t)reply.length+1);
+	if (!readAll(fd,p,reply.length))
+		return false ;
+	data = p ;
+	return true ;
+}
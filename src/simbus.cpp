@@ -0,0 +1,261 @@
+/*
+ * simbus.cpp - simulated register bus for performance modelling
+ *
+ * Stands in for /dev/mem with memory from a file or memfd and makes
+ * each access cost what it would on the board: reads and writes spin
+ * for a latency configured per address range, and registers that
+ * clear when read are emulated. This gives a reproducible way to
+ * compare dump orders, sampling rates and batching without hardware.
+ *
+ * The model is a text file (--backend sim:MODEL) of lines:
+ *
+ *	memory file:PATH[@BASE] | memfd:SIZE[@BASE]
+ *	latency START[-END] READNS [WRITENS]
+ *	clear-on-read ADDRESS [MASK]
+ *	counter ADDRESS [STEP]
+ *
+ * e.g.
+ *	memory		memfd:0x400000@0x02000000
+ *	latency		0x02000000-0x020fffff	350	# AIPS1
+ *	latency		0x00900000-0x0093ffff	20	# OCRAM
+ *	clear-on-read	0x02020098	0x8000		# UART1_USR2.DTRF
+ *	counter		0x02098024			# GPT_CNT
+ *
+ * The first latency range containing an address applies, and accesses
+ * outside of every range are free. Bits in MASK (default all) are
+ * cleared after each read of a clear-on-read register, and a counter
+ * goes up by STEP (default 1) after each read, like a free-running
+ * timer. '#' starts a comment.
+ *
+ * (c) Copyright 2010 by Boundary Devices under GPLv2
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "devregs.h"
+
+struct simRange_t {
+	uint64_t	start ;
+	uint64_t	end ;		// inclusive
+	unsigned	read_ns ;
+	unsigned	write_ns ;
+};
+
+struct simClear_t {
+	uint64_t	address ;
+	unsigned	mask ;
+	unsigned	step ;		// counter if not 0
+};
+
+static struct physmemBackend_t const *memory = 0 ;
+static struct simRange_t *ranges = 0 ;
+static unsigned range_count = 0 ;
+static struct simClear_t *clears = 0 ;	// sorted by address
+static unsigned clear_count = 0 ;
+static unsigned long long bus_ns = 0 ;	// atomic, sampling groups share the bus
+static unsigned long cleared = 0 ;
+
+static uint64_t nowNs(void)
+{
+	struct timespec ts ;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec ;
+}
+
+/*
+ * Spin rather than sleep: the latencies modelled are far below the
+ * resolution of the scheduler
+ */
+static void busDelay(unsigned ns)
+{
+	if (0 == ns)
+		return ;
+	uint64_t const until = nowNs() + ns ;
+	while (nowNs() < until)
+		;
+	__atomic_fetch_add(&bus_ns,ns,__ATOMIC_RELAXED);
+}
+
+static struct simRange_t const *findRange(uint64_t addr)
+{
+	for (unsigned i = 0 ; i < range_count ; i++) {
+		if ((addr >= ranges[i].start) && (addr <= ranges[i].end))
+			return ranges+i ;
+	}
+	return 0 ;
+}
+
+static struct simClear_t const *findClear(uint64_t addr)
+{
+	unsigned lo = 0, hi = clear_count ;
+	while (lo < hi) {
+		unsigned const mid = lo + (hi-lo)/2 ;
+		if (clears[mid].address < addr)
+			lo = mid+1 ;
+		else
+			hi = mid ;
+	}
+	if ((lo < clear_count) && (clears[lo].address == addr))
+		return clears+lo ;
+	return 0 ;
+}
+
+static void *simMap(phys_addr_t start, size_t len)
+{
+	return memory->map(start,len);
+}
+
+static void simUnmap(void *map, size_t len)
+{
+	memory->unmap(map,len);
+}
+
+static unsigned simRead(void volatile *ptr, phys_addr_t addr, unsigned width)
+{
+	struct simRange_t const *r = findRange(addr);
+	unsigned const value = memory->read(ptr,addr,width);
+	struct simClear_t const *c = clear_count ? findClear(addr) : 0 ;
+	if (c && c->step)
+		memory->write(ptr,addr,width,value + c->step);
+	else if (c && (value & c->mask)) {
+		memory->write(ptr,addr,width,value & ~c->mask);
+		__atomic_fetch_add(&cleared,1,__ATOMIC_RELAXED);
+	}
+	busDelay(r ? r->read_ns : 0);
+	return value ;
+}
+
+static void simWrite(void volatile *ptr, phys_addr_t addr, unsigned width, unsigned value)
+{
+	struct simRange_t const *r = findRange(addr);
+	memory->write(ptr,addr,width,value);
+	busDelay(r ? r->write_ns : 0);
+}
+
+static void simReport(FILE *f)
+{
+	fprintf(f, "%llu ns of simulated bus latency, %lu registers cleared on read\n",
+		bus_ns, cleared);
+}
+
+static struct physmemBackend_t const simBackend = {
+	"sim", simMap, simUnmap, simRead, simWrite, simReport
+};
+
+static int compareClear(void const *lhs, void const *rhs)
+{
+	struct simClear_t const *l = (struct simClear_t const *)lhs ;
+	struct simClear_t const *r = (struct simClear_t const *)rhs ;
+	return (l->address < r->address) ? -1 : (l->address > r->address);
+}
+
+static bool parseNum(char const *word, uint64_t &value)
+{
+	char *end ;
+	if (0 == word)
+		return false ;
+	value = strtoull(word,&end,0);
+	return (end != word) && ('\0' == *end);
+}
+
+/*
+ * Parses one line of the model, returns false after reporting an error
+ */
+static bool parseModelLine(char const *model, unsigned lineNum, char *line)
+{
+	char *comment = strchr(line,'#');
+	if (comment)
+		*comment = '\0' ;
+	char *next = line ;
+	char *keyword = nextWord(next);
+	if (0 == keyword)
+		return true ;
+	char *arg = nextWord(next);
+	if (0 == strcmp(keyword,"memory")) {
+		if (arg && strncmp(arg,"sim:",4) && physmemSelect(arg)) {
+			memory = physmemBackend();
+			return true ;
+		}
+	} else if (0 == strcmp(keyword,"latency")) {
+		struct simRange_t r ;
+		uint64_t read_ns, write_ns ;
+		char *dash = arg ? strchr(arg,'-') : 0 ;
+		if (dash)
+			*dash = '\0' ;
+		char *ns = nextWord(next);
+		char *wns = nextWord(next);
+		bool ok = parseNum(arg,r.start) && parseNum(ns,read_ns);
+		r.end = r.start ;
+		if (ok && dash)
+			ok = parseNum(dash+1,r.end) && (r.end >= r.start);
+		write_ns = read_ns ;
+		if (ok && wns)
+			ok = parseNum(wns,write_ns);
+		if (ok) {
+			r.read_ns = read_ns ;
+			r.write_ns = write_ns ;
+			ranges = (struct simRange_t *)realloc(ranges,(range_count+1)*sizeof(r));
+			ranges[range_count++] = r ;
+			return true ;
+		}
+	} else if (0 == strcmp(keyword,"clear-on-read")) {
+		struct simClear_t c ;
+		uint64_t mask = 0xffffffff ;
+		char *maskword = nextWord(next);
+		if (parseNum(arg,c.address) && (!maskword || parseNum(maskword,mask))) {
+			c.mask = mask ;
+			c.step = 0 ;
+			clears = (struct simClear_t *)realloc(clears,(clear_count+1)*sizeof(c));
+			clears[clear_count++] = c ;
+			return true ;
+		}
+	} else if (0 == strcmp(keyword,"counter")) {
+		struct simClear_t c ;
+		uint64_t step = 1 ;
+		char *stepword = nextWord(next);
+		if (parseNum(arg,c.address) && (!stepword || parseNum(stepword,step)) && step) {
+			c.mask = 0 ;
+			c.step = step ;
+			clears = (struct simClear_t *)realloc(clears,(clear_count+1)*sizeof(c));
+			clears[clear_count++] = c ;
+			return true ;
+		}
+	} else {
+		fprintf(stderr, "%s:%u: unknown keyword '%s'\n", model, lineNum, keyword);
+		return false ;
+	}
+	fprintf(stderr, "%s:%u: invalid %s line\n", model, lineNum, keyword);
+	return false ;
+}
+
+/*
+ * Reads the model and returns the simulated bus backend, or 0 after
+ * reporting an error
+ */
+struct physmemBackend_t const *simbusOpen(char const *model)
+{
+	FILE *fIn = fopen(model, "r");
+	if (0 == fIn) {
+		perror(model);
+		return 0 ;
+	}
+	char *inBuf = 0 ;
+	size_t inSize = 0 ;
+	unsigned lineNum = 0 ;
+	bool ok = true ;
+	while (ok && (0 < getline(&inBuf,&inSize,fIn)))
+		ok = parseModelLine(model,++lineNum,inBuf);
+	free(inBuf);
+	fclose(fIn);
+	if (!ok)
+		return 0 ;
+	if (0 == memory) {
+		fprintf(stderr, "%s: no memory line\n", model);
+		return 0 ;
+	}
+	qsort(clears,clear_count,sizeof(clears[0]),compareClear);
+	return &simBackend ;
+}
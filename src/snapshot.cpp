@@ -0,0 +1,190 @@
+/*
+ * snapshot.cpp - binary register snapshots
+ *
+ * A snapshot records the values of a set of registers with as little
+ * work as possible at capture time: the values are read into an array
+ * and written out with the addresses and widths, and decoding them
+ * against the register database is left for later (--show-snapshot).
+ * See devregs.h for the file layout.
+ *
+ * (c) Copyright 2010 by Boundary Devices under GPLv2
+ *
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "devregs.h"
+
+bool snapshotWrite
+	( char const *path,
+	  struct snapshot_header_t const &header,
+	  struct snapshot_reg_t const *regs,
+	  uint32_t const *values )
+{
+	FILE *fOut = fopen(path, "wb");
+	if (0 == fOut) {
+		perror(path);
+		return false ;
+	}
+	bool ok = (1 == fwrite(&header,sizeof(header),1,fOut))
+		  && (header.reg_count == fwrite(regs,sizeof(regs[0]),header.reg_count,fOut))
+		  && (header.reg_count == fwrite(values,sizeof(values[0]),header.reg_count,fOut));
+	if (0 != fclose(fOut))
+		ok = false ;
+	if (!ok) {
+		perror(path);
+		unlink(path);
+	}
+	return ok ;
+}
+
+/*
+ * Map a snapshot read-only, returns false after reporting an error
+ */
+bool snapshotOpen(char const *path, struct snapshot_t &snap)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st ;
+	if ((0 > fd) || (0 != fstat(fd,&st))) {
+		perror(path);
+		if (0 <= fd)
+			close(fd);
+		return false ;
+	}
+	size_t const size = st.st_size ;
+	void *map = (size >= sizeof(struct snapshot_header_t))
+		    ? mmap(0, size, PROT_READ, MAP_SHARED, fd, 0)
+		    : MAP_FAILED ;
+	close(fd);
+	if (MAP_FAILED == map) {
+		fprintf(stderr, "%s: not a devregs snapshot\n", path);
+		return false ;
+	}
+	struct snapshot_header_t const *hdr = (struct snapshot_header_t const *)map ;
+	size_t const recsize = sizeof(struct snapshot_reg_t)+sizeof(uint32_t);
+	if ((0 == memcmp(hdr->magic,SNAPSHOT_MAGIC,sizeof(hdr->magic)))
+	    && (SNAPSHOT_BYTE_ORDER != hdr->byte_order)) {
+		fprintf(stderr, "%s: taken on a host of another byte order\n", path);
+		munmap(map,size);
+		return false ;
+	}
+	if ((0 != memcmp(hdr->magic,SNAPSHOT_MAGIC,sizeof(hdr->magic)))
+	    ||
+	    (SNAPSHOT_VERSION != hdr->version)
+	    ||
+	    (hdr->reg_count != (size-sizeof(*hdr))/recsize)
+	    ||
+	    (0 != (size-sizeof(*hdr))%recsize)) {
+		fprintf(stderr, "%s: not a devregs snapshot\n", path);
+		munmap(map,size);
+		return false ;
+	}
+	snap.header = hdr ;
+	snap.regs = (struct snapshot_reg_t const *)(hdr+1);
+	snap.values = (uint32_t const *)(snap.regs+hdr->reg_count);
+	return true ;
+}
+
+/*
+ * Positions of the values that differ between a and b, returns how many
+ * there are. The bits that changed are a[i]^b[i].
+ */
+unsigned snapshotChanges
+	( uint32_t const *a,
+	  uint32_t const *b,
+	  unsigned count,
+	  uint32_t *changed )
+{
+	unsigned n = 0 ;
+	for (unsigned i = 0 ; i < count ; i++) {
+		changed[n] = i ;
+		n += (0 != (a[i]^b[i]));
+	}
+	return n ;
+}
+
+struct alignKey_t {
+	uint64_t	address ;
+	uint32_t	width ;
+	uint32_t	pos ;
+};
+
+static int compareAlignKey(void const *lhs, void const *rhs)
+{
+	struct alignKey_t const *l = (struct alignKey_t const *)lhs ;
+	struct alignKey_t const *r = (struct alignKey_t const *)rhs ;
+	if (l->address != r->address)
+		return (l->address < r->address) ? -1 : 1 ;
+	if (l->width != r->width)
+		return (l->width < r->width) ? -1 : 1 ;
+	return (l->pos < r->pos) ? -1 : (l->pos > r->pos);
+}
+
+static struct alignKey_t *sortedKeys(struct snapshot_t const &snap)
+{
+	unsigned const count = snap.header->reg_count ;
+	struct alignKey_t *keys = (struct alignKey_t *)malloc((count+1)*sizeof(keys[0]));
+	for (unsigned i = 0 ; i < count ; i++) {
+		keys[i].address = snap.regs[i].address ;
+		keys[i].width = snap.regs[i].width ;
+		keys[i].pos = i ;
+	}
+	qsort(keys,count,sizeof(keys[0]),compareAlignKey);
+	return keys ;
+}
+
+/*
+ * Returns true if a and b hold the same registers in the same order,
+ * so their value arrays can be compared as they are. Otherwise lines
+ * the values of b up with the registers of a: values[i] is b's value
+ * of a's register i and match[i] its position in b, or SNAPSHOT_NOREG
+ * and a's own value if b does not have it.
+ */
+bool snapshotAlign
+	( struct snapshot_t const &a,
+	  struct snapshot_t const &b,
+	  uint32_t *values,
+	  uint32_t *match )
+{
+	unsigned const acount = a.header->reg_count ;
+	unsigned const bcount = b.header->reg_count ;
+	if (acount == bcount) {
+		unsigned i ;
+		for (i = 0 ; i < acount ; i++) {
+			if ((a.regs[i].address != b.regs[i].address)
+			    || (a.regs[i].width != b.regs[i].width))
+				break ;
+		}
+		if (i == acount)
+			return true ;
+	}
+
+	struct alignKey_t *akeys = sortedKeys(a);
+	struct alignKey_t *bkeys = sortedKeys(b);
+	for (unsigned i = 0 ; i < acount ; i++) {
+		values[i] = a.values[i];
+		match[i] = SNAPSHOT_NOREG ;
+	}
+	unsigned i = 0, j = 0 ;
+	while ((i < acount) && (j < bcount)) {
+		struct alignKey_t const &ak = akeys[i];
+		struct alignKey_t const &bk = bkeys[j];
+		if ((ak.address == bk.address) && (ak.width == bk.width)) {
+			values[ak.pos] = b.values[bk.pos];
+			match[ak.pos] = bk.pos ;
+			i++ ; j++ ;
+		} else if ((ak.address < bk.address)
+			   || ((ak.address == bk.address) && (ak.width < bk.width)))
+			i++ ;
+		else
+			j++ ;
+	}
+	free(akeys);
+	free(bkeys);
+	return false ;
+}
@@ -0,0 +1,316 @@
+/*
+ * trace.cpp - streaming binary traces of sampled registers
+ *
+ * A trace records every change seen while sampling, for days if need
+ * be, so nothing is formatted while it is taken: the sampling loop puts
+ * changes into a ring, and a writer thread takes them out, encodes
+ * them as small deltas and writes them. Traces are rendered later with
+ * the register database (--show-trace). See devregs.h for the layout.
+ *
+ * When several threads sample, each has a ring of its own and the
+ * writer merges them by time. A sample is only written once every ring
+ * that is empty has a watermark at or past it, i.e. once no older
+ * sample can still turn up.
+ *
+ * (c) Copyright 2010 by Boundary Devices under GPLv2
+ *
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "devregs.h"
+
+#define TRACE_BUFSIZE	65536
+#define TRACE_IDLE_NS	1000000		// writer sleep when the ring is empty
+
+struct traceSource_t {
+	struct sampleRing_t	*ring ;
+	unsigned		 tail ;
+	unsigned		 head ;		// as last loaded
+	uint64_t		 watermark ;	// as loaded before head
+};
+
+struct traceWriter_t {
+	FILE			*f ;
+	struct traceSource_t	*sources ;
+	unsigned		 nsources ;
+	unsigned		 count ;
+	uint32_t		*last ;		// value in the last record of each register
+	uint64_t		 last_ns ;
+	int			 done ;		// set by traceFinish()
+	bool			 failed ;
+	pthread_t		 thread ;
+	unsigned		 used ;
+	uint8_t			 buf[TRACE_BUFSIZE];
+};
+
+static struct traceWriter_t writer ;
+
+static uint8_t *putNumber(uint8_t *out, uint64_t n)
+{
+	while (n >= 0x80) {
+		*out++ = (uint8_t)n | 0x80 ;
+		n >>= 7 ;
+	}
+	*out++ = (uint8_t)n ;
+	return out ;
+}
+
+static void flushBuf(void)
+{
+	if (writer.used && (1 != fwrite(writer.buf,writer.used,1,writer.f)))
+		writer.failed = true ;
+	writer.used = 0 ;
+}
+
+/*
+ * Append a record, three numbers of at most 10 bytes each
+ */
+static void putRecord(uint64_t ns, uint64_t reg, uint64_t value)
+{
+	if (writer.used > TRACE_BUFSIZE-30)
+		flushBuf();
+	uint8_t *out = writer.buf+writer.used ;
+	out = putNumber(out,ns);
+	out = putNumber(out,reg);
+	out = putNumber(out,value);
+	writer.used = out-writer.buf ;
+}
+
+/*
+ * Write the oldest samples of the rings for as long as no ring can
+ * still produce an older one, returns how many were written. Once the
+ * samplers are done, everything is written.
+ */
+static unsigned mergeSamples(bool done)
+{
+	unsigned written = 0 ;
+	for (;;) {
+		struct traceSource_t *next = 0 ;
+		uint64_t oldest = 0 ;
+		uint64_t limit = ~(uint64_t)0 ;
+		for (unsigned i = 0 ; i < writer.nsources ; i++) {
+			struct traceSource_t &src = writer.sources[i];
+			if (src.tail != src.head) {
+				uint64_t const ns = src.ring->samples[src.tail & src.ring->mask].ns ;
+				if ((0 == next) || (ns < oldest)) {
+					next = &src ;
+					oldest = ns ;
+				}
+			} else if (!done && (src.watermark < limit))
+				limit = src.watermark ;
+		}
+		if ((0 == next) || (oldest > limit))
+			break ;
+		struct sample_t const &s = next->ring->samples[next->tail++ & next->ring->mask];
+		putRecord(s.ns-writer.last_ns,s.reg,s.value ^ writer.last[s.reg]);
+		writer.last_ns = s.ns ;
+		writer.last[s.reg] = s.value ;
+		written++ ;
+	}
+	return written ;
+}
+
+static void *writerThread(void *)
+{
+	/* leave ^C and the --duration timer to the samplers */
+	sigset_t signals ;
+	sigfillset(&signals);
+	pthread_sigmask(SIG_BLOCK,&signals,0);
+	for (;;) {
+		int const done = __atomic_load_n(&writer.done,__ATOMIC_ACQUIRE);
+		for (unsigned i = 0 ; i < writer.nsources ; i++) {
+			struct traceSource_t &src = writer.sources[i];
+			src.watermark = __atomic_load_n(&src.ring->watermark,__ATOMIC_ACQUIRE);
+			src.head = __atomic_load_n(&src.ring->head,__ATOMIC_ACQUIRE);
+		}
+		if (mergeSamples(done)) {
+			for (unsigned i = 0 ; i < writer.nsources ; i++) {
+				struct traceSource_t &src = writer.sources[i];
+				__atomic_store_n(&src.ring->tail,src.tail,__ATOMIC_RELEASE);
+			}
+			continue;
+		}
+		if (done)
+			break ;
+		flushBuf();
+		fflush(writer.f);
+		struct timespec const idle = { 0, TRACE_IDLE_NS };
+		nanosleep(&idle,0);
+	}
+	return 0 ;
+}
+
+/*
+ * Create a trace and start a thread writing the samples that appear in
+ * the rings, one per sampling group. Returns false after reporting an
+ * error.
+ */
+bool traceStart
+	( char const *path,
+	  struct trace_header_t const &header,
+	  struct snapshot_reg_t const *regs,
+	  uint32_t const *masks,
+	  struct sampleRing_t **rings,
+	  unsigned nrings )
+{
+	unsigned const count = header.reg_count ;
+	writer.f = fopen(path, "wb");
+	if (0 == writer.f) {
+		perror(path);
+		return false ;
+	}
+	if ((1 != fwrite(&header,sizeof(header),1,writer.f))
+	    || (count != fwrite(regs,sizeof(regs[0]),count,writer.f))
+	    || (count != fwrite(masks,sizeof(masks[0]),count,writer.f))) {
+		perror(path);
+		fclose(writer.f);
+		unlink(path);
+		return false ;
+	}
+	writer.sources = (struct traceSource_t *)calloc(nrings,sizeof(writer.sources[0]));
+	writer.nsources = nrings ;
+	for (unsigned i = 0 ; i < nrings ; i++) {
+		writer.sources[i].ring = rings[i];
+		writer.sources[i].tail = rings[i]->tail ;
+		writer.sources[i].head = rings[i]->tail ;
+	}
+	writer.count = count ;
+	writer.last = (uint32_t *)calloc(count+1,sizeof(writer.last[0]));
+	writer.last_ns = header.start_ns ;
+	writer.done = 0 ;
+	writer.failed = false ;
+	writer.used = 0 ;
+	int const err = pthread_create(&writer.thread,0,writerThread,0);
+	if (err) {
+		fprintf(stderr, "%s: unable to start writer: %s\n", path, strerror(err));
+		fclose(writer.f);
+		unlink(path);
+		free(writer.sources);
+		free(writer.last);
+		return false ;
+	}
+	return true ;
+}
+
+/*
+ * Once the samplers have stopped, wait for the writer to empty the
+ * rings, then end the trace with the passes of each group. Returns
+ * false after reporting a write error.
+ */
+bool traceFinish(uint64_t const *passes)
+{
+	__atomic_store_n(&writer.done,1,__ATOMIC_RELEASE);
+	pthread_join(writer.thread,0);
+	putRecord(0,writer.count,writer.nsources);
+	for (unsigned i = 0 ; i < writer.nsources ; i++) {
+		if (writer.used > TRACE_BUFSIZE-20)
+			flushBuf();
+		uint8_t *out = writer.buf+writer.used ;
+		out = putNumber(out,passes[i]);
+		out = putNumber(out,writer.sources[i].ring->dropped);
+		writer.used = out-writer.buf ;
+	}
+	flushBuf();
+	if (0 != fclose(writer.f))
+		writer.failed = true ;
+	if (writer.failed)
+		perror("trace");
+	free(writer.last);
+	free(writer.sources);
+	return !writer.failed ;
+}
+
+/*
+ * Map a trace read-only for traceNext(), returns false after reporting
+ * an error
+ */
+bool traceOpen(char const *path, struct trace_t &trace)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st ;
+	if ((0 > fd) || (0 != fstat(fd,&st))) {
+		perror(path);
+		if (0 <= fd)
+			close(fd);
+		return false ;
+	}
+	size_t const size = st.st_size ;
+	void *map = (size >= sizeof(struct trace_header_t))
+		    ? mmap(0, size, PROT_READ, MAP_SHARED, fd, 0)
+		    : MAP_FAILED ;
+	close(fd);
+	struct trace_header_t const *hdr = (struct trace_header_t const *)map ;
+	size_t const recsize = sizeof(struct snapshot_reg_t)+sizeof(uint32_t);
+	/* divided rather than multiplied, which could overflow a 32-bit size_t */
+	if ((MAP_FAILED == map)
+	    || (0 != memcmp(hdr->magic,TRACE_MAGIC,sizeof(hdr->magic)))
+	    || (TRACE_VERSION != hdr->version)
+	    || (hdr->reg_count > (size-sizeof(*hdr))/recsize)) {
+		fprintf(stderr, "%s: not a devregs trace\n", path);
+		if (MAP_FAILED != map)
+			munmap(map,size);
+		return false ;
+	}
+	trace.header = hdr ;
+	trace.regs = (struct snapshot_reg_t const *)(hdr+1);
+	trace.masks = (uint32_t const *)(trace.regs+hdr->reg_count);
+	trace.next = (uint8_t const *)(trace.masks+hdr->reg_count);
+	trace.end = (uint8_t const *)map + size ;
+	trace.values = (uint32_t *)calloc(hdr->reg_count+1,sizeof(trace.values[0]));
+	trace.ns = 0 ;
+	trace.ended = false ;
+	trace.groups = 0 ;
+	trace.passes = 0 ;
+	trace.dropped = 0 ;
+	return true ;
+}
+
+static bool getNumber(struct trace_t &trace, uint64_t &n)
+{
+	n = 0 ;
+	for (unsigned shift = 0 ; (trace.next < trace.end) && (shift < 64) ; shift += 7) {
+		uint8_t const b = *trace.next++ ;
+		n |= (uint64_t)(b & 0x7f) << shift ;
+		if (0 == (b & 0x80))
+			return true ;
+	}
+	return false ;
+}
+
+/*
+ * Decode the next record, returns false at the end of the trace
+ */
+bool traceNext(struct trace_t &trace, struct traceRecord_t &rec)
+{
+	uint64_t ns, reg, value ;
+	if (trace.ended || !getNumber(trace,ns) || !getNumber(trace,reg)
+	    || !getNumber(trace,value))
+		return false ;
+	trace.ns += ns ;
+	if (reg >= trace.header->reg_count) {
+		trace.ended = true ;
+		if (value > (uint64_t)(trace.end-trace.next))
+			value = trace.end-trace.next ;	// two bytes a group at least
+		trace.passes = (uint64_t *)calloc(value+1,sizeof(trace.passes[0]));
+		trace.dropped = (uint64_t *)calloc(value+1,sizeof(trace.dropped[0]));
+		while ((trace.groups < value)
+		       && getNumber(trace,trace.passes[trace.groups])
+		       && getNumber(trace,trace.dropped[trace.groups]))
+			trace.groups++ ;
+		return false ;
+	}
+	rec.ns = trace.ns ;
+	rec.reg = reg ;
+	rec.old = trace.values[reg];
+	rec.value = rec.old ^ (uint32_t)value ;
+	trace.values[reg] = rec.value ;
+	return true ;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# fields.sh - REG FIELD=VALUE... writes several fields with a single
+# read-modify-write: on a register whose bit 5 clears on read, a second
+# read before the write would see the bit gone and write it back clear.
+# Unknown fields and values too wide for their field write nothing.
+#
+# Runs off-target on the simulated bus, with the imx6q database
+# (installed or built in). Exits 77 (skipped) without one.
+#
+# (c) Copyright 2010 by Boundary Devices under GPLv2
+#
+
+DEVREGS=${DEVREGS:-../src/devregs}
+tmp=${TMPDIR:-/tmp}/fields.$$
+mkdir -p $tmp || exit 1
+trap 'rm -rf $tmp' EXIT
+
+truncate -s 64M $tmp/mem || exit 1
+cat > $tmp/model <<MODEL
+memory		file:$tmp/mem@0
+clear-on-read	0x02020084	0x0020	# UART1_UCR2.WS
+MODEL
+devregs="$DEVREGS -c imx6q --backend file:$tmp/mem@0"
+$devregs UART1_UCR1 2>/dev/null | grep -q UART1_UCR1 || exit 77
+
+$devregs UART1_UCR2 0x21 >/dev/null 2>&1
+ucr2() {
+	$devregs UART1_UCR2 2>/dev/null | sed -n 's/^UART1_UCR2:0x02020084	=//p'
+}
+
+# bad fields or values: nothing written, nothing read either
+$DEVREGS -c imx6q --backend sim:$tmp/model UART1_UCR2 RXEN=1 NOSUCH=1 2>&1 \
+	| grep -q 'No field NOSUCH in UART1_UCR2' || exit 1
+$DEVREGS -c imx6q --backend sim:$tmp/model UART1_UCR2 RXEN=2 2>/dev/null \
+	| grep -q '^UART1_UCR2:' && exit 1
+[ 0x0021 = `ucr2` ] || exit 1
+
+$DEVREGS -c imx6q --backend sim:$tmp/model UART1_UCR2 RXEN=1 TXEN=1 >$tmp/out 2>&1
+cat $tmp/out
+grep -q '^UART1_UCR2:0x02020084 == 0x0021\.\.\.0x00000027$' $tmp/out || exit 1
+[ 0x0027 = `ucr2` ] || exit 1
+exit 0
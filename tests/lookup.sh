@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# lookup.sh - registers are found by exact name (in any case), by the
+# address of a register or a range of them, by a name prefix and, when
+# no name starts with it, by a substring of a name. Addresses in no
+# register read on their own.
+#
+# Runs off-target on a file-backed register image, with the imx6q
+# database (installed or built in). Exits 77 (skipped) without one.
+#
+# (c) Copyright 2010 by Boundary Devices under GPLv2
+#
+
+DEVREGS=${DEVREGS:-../src/devregs}
+tmp=${TMPDIR:-/tmp}/lookup.$$
+mkdir -p $tmp || exit 1
+trap 'rm -rf $tmp' EXIT
+
+truncate -s 64M $tmp/mem || exit 1
+devregs="$DEVREGS -c imx6q --backend file:$tmp/mem@0"
+$devregs UART1_UCR1 2>/dev/null | grep -q UART1_UCR1 || exit 77
+
+# registers displayed for a spec, without their fields
+lookup() {
+	$devregs "$1" 2>$tmp/err | grep '^[A-Za-z0-9_]*:0x' > $tmp/out
+	cat $tmp/out
+}
+
+# exact names, through the hash
+[ "UART1_UCR2:0x02020084	=0x0000" = "`lookup UART1_UCR2`" ] || exit 1
+[ "UART1_UCR2:0x02020084	=0x0000" = "`lookup uart1_ucr2`" ] || exit 1
+lookup UART1_UCR2.TXEN | grep -q '^UART1_UCR2:' || exit 1
+
+# addresses, through the sorted index
+[ "UART1_UCR2:0x02020084	=0x0000" = "`lookup 0x02020084`" ] || exit 1
+[ ":0x02020086	=0x00000000" = "`lookup 0x02020086`" ] || exit 1
+lookup 0x02020080-0x0202008c >/dev/null
+[ 4 -eq `wc -l < $tmp/out` ] || exit 1
+for r in UCR1:0x02020080 UCR2:0x02020084 UCR3:0x02020088 UCR4:0x0202008c ; do
+	grep -q "^UART1_$r	" $tmp/out || exit 1
+done
+
+# name prefixes, then substrings
+lookup UART1_UC >/dev/null
+[ 4 -eq `wc -l < $tmp/out` ] || exit 1
+lookup ART1_UCR2 | grep -q '^UART1_UCR2:0x02020084	' || exit 1
+grep -q -v '^[A-Z0-9_]*UCR2:' $tmp/out && exit 1
+
+# nothing matched
+lookup NO_SUCH_REGISTER | grep -q . && exit 1
+grep -q 'Nothing matched NO_SUCH_REGISTER' $tmp/err || exit 1
+exit 0
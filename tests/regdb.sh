@@ -0,0 +1,113 @@
+#!/bin/sh
+#
+# regdb.sh - a compiled database gives the same answers as the .dat file
+# it was compiled from, and one that is damaged (a bad magic, the other
+# byte order, a section out of bounds, a register name outside the
+# string pool, a name hash without an empty slot, or truncated) is
+# reported and the .dat file used instead, without hanging.
+#
+# The .db file is only looked for next to the .dat file, so this needs
+# the imx6q database installed in /etc, and to be able to put a .db
+# there. Exits 77 (skipped) without those, if one is there already, or
+# if devregs has the database built in and so never reads a .db.
+#
+# (c) Copyright 2010 by Boundary Devices under GPLv2
+#
+
+DEVREGS=${DEVREGS:-../src/devregs}
+dat=/etc/devregs_imx6q.dat
+db=/etc/devregs_imx6q.db
+tmp=${TMPDIR:-/tmp}/regdb.$$
+[ -f $dat ] || exit 77
+[ -e $db ] && exit 77
+mkdir -p $tmp || exit 1
+trap 'rm -rf $tmp $db' EXIT
+touch $db 2>/dev/null || exit 77
+
+truncate -s 64M $tmp/mem || exit 1
+devregs="$DEVREGS -c imx6q --backend file:$tmp/mem@0"
+
+# what a few lookups show, with the errors apart
+lookups() {
+	for spec in UART1_UCR2 0x02020080-0x0202008c UART1_UC ART1_UCR4 ; do
+		timeout 10 $devregs $spec 2>>$tmp/err
+	done | grep -v '^Fixing cpu'
+}
+
+# a 32-bit word of the database, in its own byte order
+word() {
+	od -An -tu4 -j $1 -N4 $db | tr -d ' '
+}
+
+# offset (or with 4, size) of the section of type $1
+section() {
+	count=`word 16`
+	i=0
+	while [ $i -lt $count ] ; do
+		if [ $1 = `word $((48+16*i))` ] ; then
+			word $((48+16*i+${2:-8}))
+			return
+		fi
+		i=$((i+1))
+	done
+	exit 1
+}
+
+# overwrite the word at offset $1 with 0xffffffff
+ones() {
+	printf '\377\377\377\377' | dd of=$db bs=1 seek=$1 conv=notrunc 2>/dev/null
+}
+
+rm -f $db
+: > $tmp/err
+lookups > $tmp/expected
+[ 7 -le `grep -c '^UART1_' $tmp/expected` ] || exit 1
+
+$devregs --compile $dat $tmp/good.db 2>/dev/null | grep -q "registers, .* fields" || exit 1
+cp $tmp/good.db $db || exit 1
+: > $tmp/err
+lookups | cmp -s - $tmp/expected || exit 1
+if grep -q . $tmp/err ; then
+	cat $tmp/err
+	exit 1
+fi
+
+# an invalid file is used only if there's no built-in database
+printf 'X' | dd of=$db bs=1 conv=notrunc 2>/dev/null
+: > $tmp/err
+lookups > /dev/null
+grep -q "$db: not a devregs database" $tmp/err || exit 77
+
+# reported, and the .dat file used instead
+damaged() {
+	: > $tmp/err
+	lookups | cmp -s - $tmp/expected || exit 1
+	cat $tmp/err
+	grep -q "^$db: $1" $tmp/err || exit 1
+	cp $tmp/good.db $db
+}
+
+printf 'X' | dd of=$db bs=1 conv=notrunc 2>/dev/null
+damaged 'not a devregs database'
+
+set -- `od -An -to1 -j8 -N4 $db`
+printf "\\$4\\$3\\$2\\$1" | dd of=$db bs=1 seek=8 conv=notrunc 2>/dev/null
+damaged 'compiled with another byte order'
+
+ones 56
+damaged 'section 0 out of bounds'
+
+ones $((`section 1`+8))
+damaged 'invalid records'
+
+# every slot naming the first register, which used to loop forever
+dd if=$db of=$tmp/slots bs=4 skip=12 count=1 2>/dev/null	# type 1, of section 0
+while [ `wc -c < $tmp/slots` -lt `section 4 12` ] ; do
+	cat $tmp/slots $tmp/slots > $tmp/more && mv $tmp/more $tmp/slots
+done
+dd if=$tmp/slots of=$db bs=4 seek=$((`section 4`/4)) count=`section 4 4` conv=notrunc 2>/dev/null
+damaged 'invalid records'
+
+truncate -s $((`section 2`+8)) $db
+damaged ''
+exit 0
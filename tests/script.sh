@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# script.sh - a script is parsed whole before any of it runs, so a bad
+# line anywhere leaves the registers alone; its reads, writes, delays
+# and polls then run in order, stopping at a poll that times out. A
+# line longer than any buffer is still one step.
+#
+# Runs off-target on a file-backed register image, with the imx6q
+# database (installed or built in). Exits 77 (skipped) without one.
+#
+# (c) Copyright 2010 by Boundary Devices under GPLv2
+#
+
+DEVREGS=${DEVREGS:-../src/devregs}
+tmp=${TMPDIR:-/tmp}/script.$$
+mkdir -p $tmp || exit 1
+trap 'rm -rf $tmp' EXIT
+
+truncate -s 64M $tmp/mem || exit 1
+devregs="$DEVREGS -c imx6q --backend file:$tmp/mem@0"
+$devregs UART1_UCR1 2>/dev/null | grep -q UART1_UCR1 || exit 77
+
+ucr() {
+	$devregs UART1_UCR$1 2>/dev/null | sed -n "s/^UART1_UCR$1:0x0202008.	=//p"
+}
+
+# refused as a whole, naming the line
+bad() {
+	printf "UART1_UCR1 0x1\n$1\n" | $devregs -s - >$tmp/out 2>&1
+	grep -q "^stdin:2: $2" $tmp/out || exit 1
+	[ 0x0000 = `ucr 1` ] || exit 1
+}
+bad 'frobnicate 3' 'nothing matched frobnicate'
+bad 'delay' 'use delay TIME'
+bad 'UART1_UCR2 0x1 extra' "unexpected 'extra'"
+bad 'UART1_UC 0x1' 'invalid write'
+bad 'UART1_UCR2 RXEN=1 NOSUCH=1' ''
+bad 'poll UART1_UCR1==1' 'invalid condition'
+
+cat > $tmp/script <<SCRIPT
+# comments and blank lines are skipped
+
+	UART1_UCR1 0x1
+UART1_UCR2 RXEN=1 TXEN=1
+delay 1ms
+poll UART1_UCR1=1 10ms
+UART1_UCR3 0x4
+SCRIPT
+$devregs --dry-run -s $tmp/script >$tmp/out 2>&1
+cat $tmp/out
+[ 5 -eq `grep -c "^$tmp/script:[3-7]: " $tmp/out` ] || exit 1
+[ 0x0000 = `ucr 1` ] || exit 1
+
+$devregs -s $tmp/script >$tmp/out 2>&1
+cat $tmp/out
+[ 0x0001 = `ucr 1` ] || exit 1
+[ 0x0006 = `ucr 2` ] || exit 1
+[ 0x0004 = `ucr 3` ] || exit 1
+
+# a poll that times out stops the script
+printf 'poll UART1_UCR1=9 5ms\nUART1_UCR4 0x1\n' | $devregs -s - >$tmp/out 2>&1
+grep -q '^stdin:1: UART1_UCR1=9 not met after 5000 us, read 0x1$' $tmp/out || exit 1
+[ 0x0000 = `ucr 4` ] || exit 1
+
+# spaces well past 512 bytes between a register and its field
+{
+	printf 'UART1_UCR4'
+	i=0
+	while [ $i -lt 100 ] ; do
+		printf '          '
+		i=$((i+1))
+	done
+	printf 'UART1_DREN=1\n'
+} > $tmp/long
+$devregs -s $tmp/long >$tmp/out 2>&1
+cat $tmp/out
+grep -q '^UART1_UCR4:0x0202008c == 0x0000\.\.\.0x00000001$' $tmp/out || exit 1
+[ 0x0001 = `ucr 4` ] || exit 1
+exit 0
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# snapshot.sh - a snapshot reads back the registers it was taken of,
+# and --diff shows only the registers (and their fields) that changed,
+# between two snapshots or against the registers now. Truncated files
+# are refused.
+#
+# Runs off-target on a file-backed register image, with the imx6q
+# database (installed or built in). Exits 77 (skipped) without one.
+#
+# (c) Copyright 2010 by Boundary Devices under GPLv2
+#
+
+DEVREGS=${DEVREGS:-../src/devregs}
+tmp=${TMPDIR:-/tmp}/snapshot.$$
+mkdir -p $tmp || exit 1
+trap 'rm -rf $tmp' EXIT
+
+truncate -s 64M $tmp/mem || exit 1
+devregs="$DEVREGS -c imx6q --backend file:$tmp/mem@0"
+$devregs UART1_UCR1 2>/dev/null | grep -q UART1_UCR1 || exit 77
+
+$devregs UART1_UCR2 0x21 >/dev/null 2>&1
+$devregs --snapshot $tmp/before UART1 >/dev/null 2>&1
+[ -s $tmp/before ] || exit 1
+
+# as many registers as a live read, with the value written
+$devregs --show-snapshot $tmp/before 2>/dev/null | grep '^UART1_' > $tmp/shown
+[ `$devregs UART1 2>/dev/null | grep -c '^UART1_'` -eq `wc -l < $tmp/shown` ] || exit 1
+grep -q '^UART1_UCR2:0x02020084	=0x0021$' $tmp/shown || exit 1
+
+# an unchanged image differs in nothing
+$devregs --diff $tmp/before 2>/dev/null | grep -q '^UART1_' && exit 1
+
+$devregs UART1_UCR1 0x5 >/dev/null 2>&1
+$devregs --snapshot $tmp/after UART1 >/dev/null 2>&1
+$devregs UART1_UCR3 0x7 >/dev/null 2>&1
+
+$devregs --diff $tmp/before $tmp/after 2>/dev/null > $tmp/out
+cat $tmp/out
+[ 1 -eq `grep -c '^UART1_' $tmp/out` ] || exit 1
+grep -q '^UART1_UCR1:0x02020080	=0x0000 -> 0x0005$' $tmp/out || exit 1
+grep -q '^	UART1_UARTEN  *	 0- 0	=0x0 -> 0x1$' $tmp/out || exit 1
+
+# against the registers now, which include the later write
+$devregs --diff $tmp/before 2>/dev/null > $tmp/out
+cat $tmp/out
+[ 2 -eq `grep -c '^UART1_' $tmp/out` ] || exit 1
+grep -q '^UART1_UCR3:0x02020088	=0x0000 -> 0x0007$' $tmp/out || exit 1
+
+head -c 30 $tmp/before > $tmp/short
+$devregs --show-snapshot $tmp/short 2>&1 | grep -q 'not a devregs snapshot' || exit 1
+exit 0
@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# trace-groups.sh - a slowly paced --group must not hold back the trace
+# of a fast one: a register that changes on every read is traced flat
+# out next to a group sampled once a second, and nothing may be dropped
+# although the fast group alone makes more changes than its ring holds.
+#
+# Runs off-target on the simulated bus, with the imx6q database
+# (installed or built in). Exits 77 (skipped) without one.
+#
+# (c) Copyright 2010 by Boundary Devices under GPLv2
+#
+
+DEVREGS=${DEVREGS:-../src/devregs}
+tmp=${TMPDIR:-/tmp}/trace-groups.$$
+mkdir -p $tmp || exit 1
+trap 'rm -rf $tmp' EXIT
+
+truncate -s 64M $tmp/mem || exit 1
+cat > $tmp/model <<MODEL
+memory		file:$tmp/mem@0
+latency		0x02020084	10000	# 100000 reads/s
+counter		0x02020084		# UART1_UCR2
+MODEL
+devregs="$DEVREGS -c imx6q --backend sim:$tmp/model"
+$devregs UART1_UCR1 2>/dev/null | grep -q UART1_UCR1 || exit 77
+
+$devregs --trace $tmp/trace --duration 2s \
+	--group 'period=1s UART1_UCR1' --group 'UART1_UCR2' >$tmp/out 2>&1 || exit 1
+cat $tmp/out
+
+# both groups sampled, and neither dropped anything
+[ 2 -eq `grep -c ' 0 samples dropped' $tmp/out` ] || exit 1
+[ 65536 -lt `sed -n 's/.*group 1: \([0-9]*\) passes.*/\1/p' $tmp/out` ] || exit 1
+exit 0
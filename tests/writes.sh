@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# writes.sh - a write goes only to a register named exactly, or to the
+# address it starts at: a name that only matches several registers by
+# prefix, or an address inside a register, is refused without touching
+# anything, while .w and .b still write the bytes at any address.
+#
+# Runs off-target on a file-backed register image, with the imx6q
+# database (installed or built in). Exits 77 (skipped) without one.
+#
+# (c) Copyright 2010 by Boundary Devices under GPLv2
+#
+
+DEVREGS=${DEVREGS:-../src/devregs}
+tmp=${TMPDIR:-/tmp}/writes.$$
+mkdir -p $tmp || exit 1
+trap 'rm -rf $tmp' EXIT
+
+truncate -s 64M $tmp/mem || exit 1
+devregs="$DEVREGS -c imx6q --backend file:$tmp/mem@0"
+$devregs UART1_UCR1 2>/dev/null | grep -q UART1_UCR1 || exit 77
+
+# the registers of the image, which only writes change
+dump() {
+	$devregs 0x02020080-0x0202008c 2>/dev/null | grep '^UART1_'
+}
+dump > $tmp/before
+
+# several registers match, and are listed
+$devregs UART1_UC 0x1234 >$tmp/out 2>&1
+grep -q 'UART1_UC matches no register name exactly, no write made' $tmp/out || exit 1
+[ 4 -eq `grep -c '^	UART1_UCR[1-4]$' $tmp/out` ] || exit 1
+
+# an address inside a register
+$devregs 0x02020085 0x12 >$tmp/out 2>&1
+grep -q '0x02020085 is inside UART1_UCR2:0x02020084, no write made' $tmp/out || exit 1
+
+dump | cmp -s - $tmp/before || exit 1
+
+# by exact name, start address and width
+$devregs UART1_UCR1 0x1234 >/dev/null 2>&1
+$devregs 0x02020084 0x5678 >/dev/null 2>&1
+$devregs 0x02020089.b 0x9a >/dev/null 2>&1
+dump > $tmp/after
+cat $tmp/after
+grep -q '^UART1_UCR1:0x02020080	=0x1234$' $tmp/after || exit 1
+grep -q '^UART1_UCR2:0x02020084	=0x5678$' $tmp/after || exit 1
+grep -E -q '^UART1_UCR3:0x02020088	=0x(9a00|009a)$' $tmp/after || exit 1
+grep -q '^UART1_UCR4:0x0202008c	=0x0000$' $tmp/after || exit 1
+exit 0